@@ -3,7 +3,7 @@
 #include "nob.h"
 
 void common_flags(Cmd* cmd) {
-    cmd_append(cmd, "-Wall", "-Wextra", "-Werror", "-g");
+    cmd_append(cmd, "-Wall", "-Wextra", "-Werror", "-g", "-pthread");
 }
 
 int main(int argc, char** argv) {
@@ -11,7 +11,7 @@ int main(int argc, char** argv) {
     Cmd cmd = {0};
     cmd_append(&cmd, "cc");
     common_flags(&cmd);
-    cmd_append(&cmd, "src/main.c", "-o", "nslc", "src/lexer.c", "src/parser.c", "src/arena.c", "src/qbe.c", "src/codegen.c", "src/type_checker.c");
+    cmd_append(&cmd, "src/main.c", "-o", "nslc", "src/lexer.c", "src/parser.c", "src/arena.c", "src/qbe.c", "src/codegen.c", "src/type_checker.c", "src/ast_cache.c", "src/intern.c", "src/symbol_table.c", "src/types.c", "src/const_eval.c", "src/sema_cache.c", "src/cfg.c", "src/dataflow.c", "src/passes.c", "src/simplify_cfg.c", "src/dce.c", "src/gvn.c", "src/licm.c", "src/inline.c", "src/peephole.c", "src/sccp.c", "src/indvars.c");
     if (!cmd_run_sync_and_reset(&cmd)) return 1;
 
     if (argc >= 2 && strcmp(argv[1], "run") == 0) {
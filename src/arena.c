@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stddef.h>
+#include "../extern/stb_ds.h"
 
 // Size is in bytes
 Arena arena_new(size_t size) {
@@ -13,12 +14,23 @@ Arena arena_new(size_t size) {
     };
 }
 void arena_delete(Arena* arena) {
+    for (ptrdiff_t i = 0; i < arrlen(arena->full_blocks); i++) free(arena->full_blocks[i]);
+    arrfree(arena->full_blocks);
     free(arena->buffer);
 }
 
 void* arena_alloc(Arena* arena, size_t size) {
     size_t real_size = (size + 7) & ~ 7;
-    assert((arena->current - arena->buffer) + real_size <= arena->cap);
+    if ((arena->current - arena->buffer) + real_size > arena->cap) {
+        // Pointers into the full block stay valid, it's only freed with the arena
+        arrput(arena->full_blocks, arena->buffer);
+        size_t cap = arena->cap > 0 ? arena->cap * 2 : 1024;
+        while (cap < real_size) cap *= 2;
+        arena->buffer = malloc(sizeof(char) * cap);
+        assert(arena->buffer);
+        arena->current = arena->buffer;
+        arena->cap = cap;
+    }
 
     arena->current += real_size;
     return arena->current - real_size;
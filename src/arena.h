@@ -7,6 +7,8 @@ typedef struct {
     char* buffer;
     char* current;
     size_t cap;
+    // Blocks that ran full, the arena grows by another (bigger) block instead of failing
+    char** full_blocks;
 } Arena;
 
 Arena arena_new(size_t size);
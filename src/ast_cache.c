@@ -0,0 +1,452 @@
+#include "ast_cache.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../extern/stb_ds.h"
+#include "parser.h"
+#include "types.h"
+
+typedef struct {
+    AstCacheExpr* exprs;
+    AstCacheStatement* statements;
+    AstCacheArg* args;
+    char* strings;
+    struct { char* key; uint32_t value; }* string_offsets;
+    // Cleared once an annotation refers to a type that only exists in this run
+    bool checked;
+} AstCacheWriter;
+
+typedef struct {
+    const AstCacheHeader* header;
+    const AstCacheExpr* exprs;
+    const AstCacheStatement* statements;
+    const AstCacheArg* args;
+    const char* strings;
+    Expr* loaded_exprs;
+    Interner* interner;
+} AstCacheReader;
+
+uint64_t ast_cache_hash(const char* content) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* c = content; *c; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+char* ast_cache_path(const char* dir, uint64_t hash) {
+    size_t len = strlen(dir) + 32;
+    char* path = malloc(len);
+    assert(path);
+    snprintf(path, len, "%s/%016lx.ast", dir, hash);
+    return path;
+}
+
+static uint32_t writer_string(AstCacheWriter* w, char* str) {
+    ptrdiff_t i = shgeti(w->string_offsets, str);
+    if (i != -1) return w->string_offsets[i].value;
+
+    uint32_t offset = arrlen(w->strings);
+    size_t len = strlen(str) + 1;
+    memcpy(arraddnptr(w->strings, len), str, len);
+    shput(w->string_offsets, str, offset);
+    return offset;
+}
+
+static uint32_t writer_type(AstCacheWriter* w, TypeId type) {
+    if (type >= TYPE_BUILTIN_COUNT) w->checked = false;
+    return type;
+}
+
+static uint32_t writer_expr(AstCacheWriter* w, const Expr* expr);
+
+// Fills in the already reserved expr at `index`
+static void writer_expr_at(AstCacheWriter* w, uint32_t index, const Expr* expr) {
+    AstCacheExpr e = {
+        .type = expr->type,
+        .symbol = -1,
+    };
+    if (w->checked) {
+        e.value_type = writer_type(w, expr->value_type);
+        e.is_constant = expr->is_constant;
+        e.constant = expr->constant;
+    }
+    switch (expr->type) {
+        case ET_NUMBER: e.as.number = expr->as.number; break;
+        case ET_BOOL: e.as.boolean = expr->as.boolean; break;
+        case ET_VARIABLE: {
+            e.as.string = writer_string(w, expr->as.variable.name);
+            if (w->checked) e.symbol = expr->as.variable.symbol;
+            break;
+        }
+        case ET_BINARY: {
+            e.op = expr->as.binary.op;
+            e.as.binary.left = writer_expr(w, expr->as.binary.left);
+            e.as.binary.right = writer_expr(w, expr->as.binary.right);
+            break;
+        }
+        case ET_CALL: {
+            e.as.call.name = writer_string(w, expr->as.call.name);
+            // Reserved up front so the args stay contiguous, whatever they nest lands after them
+            e.as.call.first = arrlen(w->exprs);
+            e.as.call.count = arrlen(expr->as.call.args);
+            arraddnptr(w->exprs, e.as.call.count);
+            for (uint32_t i = 0; i < e.as.call.count; i++) writer_expr_at(w, e.as.call.first + i, expr->as.call.args[i]);
+            break;
+        }
+    }
+    w->exprs[index] = e;
+}
+
+static uint32_t writer_expr(AstCacheWriter* w, const Expr* expr) {
+    const uint32_t index = arrlen(w->exprs);
+    AstCacheExpr e = {0};
+    arrput(w->exprs, e);
+    writer_expr_at(w, index, expr);
+    return index;
+}
+
+static void writer_body(AstCacheWriter* w, const Statement* body, uint32_t* first, uint32_t* count);
+
+static AstCacheStatement writer_statement(AstCacheWriter* w, const Statement* st) {
+    AstCacheStatement s = {
+        .type = st->type,
+        .row = st->loc.row,
+        .col = st->loc.col,
+        .symbol = -1,
+    };
+    switch (st->type) {
+        case ST_RETURN: {
+            s.expr = writer_expr(w, st->as.ret);
+            break;
+        }
+        case ST_VARIABLE_DEFINE: {
+            s.name = writer_string(w, st->as.var_def.name);
+            s.value_type = writer_string(w, st->as.var_def.type);
+            s.expr = st->as.var_def.value != NULL ? writer_expr(w, st->as.var_def.value) : AST_CACHE_NO_EXPR;
+            s.is_const = st->as.var_def.is_const;
+            if (w->checked) {
+                s.checked_type = writer_type(w, st->as.var_def.value_type);
+                s.symbol = st->as.var_def.symbol;
+                s.is_folded = st->as.var_def.is_folded;
+            }
+            break;
+        }
+        case ST_SET_VARIABLE: {
+            s.name = writer_string(w, st->as.var_assign.var);
+            s.expr = writer_expr(w, st->as.var_assign.new_val);
+            if (w->checked) {
+                s.checked_type = writer_type(w, st->as.var_assign.value_type);
+                s.symbol = st->as.var_assign.symbol;
+            }
+            break;
+        }
+        case ST_IF: {
+            s.expr = writer_expr(w, st->as.if_st.cond);
+            writer_body(w, st->as.if_st.body, &s.first, &s.count);
+            break;
+        }
+        case ST_WHILE: {
+            s.expr = writer_expr(w, st->as.while_st.cond);
+            writer_body(w, st->as.while_st.body, &s.first, &s.count);
+            break;
+        }
+        case ST_FN_DEFINITION: {
+            s.name = writer_string(w, st->as.fn_def.name);
+            s.value_type = writer_string(w, st->as.fn_def.ret_type);
+            s.inline_hint = st->as.fn_def.inline_hint;
+            if (w->checked) {
+                s.checked_type = writer_type(w, st->as.fn_def.ret_value_type);
+                s.symbol = st->as.fn_def.symbol_count;
+            }
+            s.first_arg = arrlen(w->args);
+            s.arg_count = arrlen(st->as.fn_def.args);
+            for (ptrdiff_t i = 0; i < arrlen(st->as.fn_def.args); i++) {
+                AstCacheArg arg = {
+                    .name = writer_string(w, st->as.fn_def.args[i].name),
+                    .type = writer_string(w, st->as.fn_def.args[i].type),
+                    .value_type = w->checked ? writer_type(w, st->as.fn_def.args[i].value_type) : 0,
+                };
+                arrput(w->args, arg);
+            }
+            writer_body(w, st->as.fn_def.body, &s.first, &s.count);
+            break;
+        }
+        case ST_ERROR: break;
+    }
+    return s;
+}
+
+// The whole body gets reserved up front so it stays contiguous, nested bodies land after it
+static void writer_body(AstCacheWriter* w, const Statement* body, uint32_t* first, uint32_t* count) {
+    *first = arrlen(w->statements);
+    *count = arrlen(body);
+    arraddnptr(w->statements, *count);
+    for (uint32_t i = 0; i < *count; i++) {
+        AstCacheStatement s = writer_statement(w, &body[i]);
+        w->statements[*first + i] = s;
+    }
+}
+
+bool ast_cache_store(const char* path, uint64_t hash, const Statement* statements, bool checked) {
+    AstCacheWriter w = { .checked = checked };
+    uint32_t first, count;
+    writer_body(&w, statements, &first, &count);
+    assert(first == 0);
+
+    AstCacheHeader header = {
+        .magic = AST_CACHE_MAGIC,
+        .version = AST_CACHE_VERSION,
+        .top_level_count = count,
+        .source_hash = hash,
+        .expr_count = arrlen(w.exprs),
+        .statement_count = arrlen(w.statements),
+        .arg_count = arrlen(w.args),
+        .strings_size = arrlen(w.strings),
+        .is_checked = w.checked,
+    };
+
+    // Written next to the real entry first so a crash never leaves a torn cache file behind
+    size_t tmp_len = strlen(path) + 5;
+    char* tmp_path = malloc(tmp_len);
+    assert(tmp_path);
+    snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+    bool ok = false;
+    FILE* file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        perror("failed to create ast cache file");
+    } else {
+        ok = fwrite(&header, sizeof(header), 1, file) == 1;
+        if (ok && header.expr_count) ok = fwrite(w.exprs, sizeof(AstCacheExpr), header.expr_count, file) == header.expr_count;
+        if (ok && header.statement_count) ok = fwrite(w.statements, sizeof(AstCacheStatement), header.statement_count, file) == header.statement_count;
+        if (ok && header.arg_count) ok = fwrite(w.args, sizeof(AstCacheArg), header.arg_count, file) == header.arg_count;
+        if (ok && header.strings_size) ok = fwrite(w.strings, 1, header.strings_size, file) == header.strings_size;
+        if (fclose(file) != 0) ok = false;
+        if (ok) ok = rename(tmp_path, path) == 0;
+        if (!ok) {
+            fprintf(stderr, "Failed to write ast cache file %s\n", path);
+            remove(tmp_path);
+        }
+    }
+
+    free(tmp_path);
+    arrfree(w.exprs);
+    arrfree(w.statements);
+    arrfree(w.args);
+    arrfree(w.strings);
+    shfree(w.string_offsets);
+    return ok;
+}
+
+// Names get copied into the interner since the symbol table compares them by pointer, nothing keeps
+// pointing into the mapping once loading is done
+static bool reader_string(const AstCacheReader* r, uint32_t offset, char** out) {
+    if (offset >= r->header->strings_size) return false;
+    *out = intern(r->interner, r->strings + offset);
+    return true;
+}
+
+static bool reader_type(const AstCacheReader* r, uint32_t type, TypeId* out) {
+    if (!r->header->is_checked) return true;
+    if (type >= TYPE_BUILTIN_COUNT) return false;
+    *out = type;
+    return true;
+}
+
+// Symbols are only resolved in checked files
+static bool reader_symbol(const AstCacheReader* r, int64_t symbol, ptrdiff_t* out) {
+    if (!r->header->is_checked) {
+        *out = -1;
+        return true;
+    }
+    if (symbol < 0) return false;
+    *out = symbol;
+    return true;
+}
+
+static bool reader_expr(const AstCacheReader* r, uint32_t index, Expr** out) {
+    if (index >= r->header->expr_count) return false;
+    *out = &r->loaded_exprs[index];
+    return true;
+}
+
+static bool reader_exprs(AstCacheReader* r) {
+    for (uint32_t i = 0; i < r->header->expr_count; i++) {
+        const AstCacheExpr* e = &r->exprs[i];
+        Expr* expr = &r->loaded_exprs[i];
+        *expr = (Expr) { .type = e->type };
+        if (!reader_type(r, e->value_type, &expr->value_type)) return false;
+        if (r->header->is_checked) {
+            expr->is_constant = e->is_constant != 0;
+            expr->constant = e->constant;
+        }
+        switch (e->type) {
+            case ET_NUMBER: expr->as.number = e->as.number; break;
+            case ET_BOOL: expr->as.boolean = e->as.boolean != 0; break;
+            case ET_VARIABLE: {
+                if (!reader_symbol(r, e->symbol, &expr->as.variable.symbol)) return false;
+                if (!reader_string(r, e->as.string, &expr->as.variable.name)) return false;
+                break;
+            }
+            case ET_BINARY: {
+                expr->as.binary.op = e->op;
+                if (!reader_expr(r, e->as.binary.left, &expr->as.binary.left)) return false;
+                if (!reader_expr(r, e->as.binary.right, &expr->as.binary.right)) return false;
+                break;
+            }
+            case ET_CALL: {
+                if (!reader_string(r, e->as.call.name, &expr->as.call.name)) return false;
+                if ((uint64_t)e->as.call.first + e->as.call.count > r->header->expr_count) return false;
+                for (uint32_t a = 0; a < e->as.call.count; a++) arrput(expr->as.call.args, &r->loaded_exprs[e->as.call.first + a]);
+                break;
+            }
+            default: return false;
+        }
+    }
+    return true;
+}
+
+static bool reader_body(AstCacheReader* r, uint32_t first, uint32_t count, Statement** body);
+
+static bool reader_statement(AstCacheReader* r, const AstCacheStatement* s, Statement* st) {
+    st->type = s->type;
+    st->loc = (Location) { .row = s->row, .col = s->col };
+    switch (s->type) {
+        case ST_RETURN: {
+            return reader_expr(r, s->expr, &st->as.ret);
+        }
+        case ST_VARIABLE_DEFINE: {
+            st->as.var_def.is_const = s->is_const;
+            st->as.var_def.is_folded = r->header->is_checked && s->is_folded;
+            st->as.var_def.value = NULL;
+            return reader_symbol(r, s->symbol, &st->as.var_def.symbol) &&
+                   reader_type(r, s->checked_type, &st->as.var_def.value_type) &&
+                   reader_string(r, s->name, &st->as.var_def.name) &&
+                   reader_string(r, s->value_type, &st->as.var_def.type) &&
+                   (s->expr == AST_CACHE_NO_EXPR || reader_expr(r, s->expr, &st->as.var_def.value));
+        }
+        case ST_SET_VARIABLE: {
+            return reader_symbol(r, s->symbol, &st->as.var_assign.symbol) &&
+                   reader_type(r, s->checked_type, &st->as.var_assign.value_type) &&
+                   reader_string(r, s->name, &st->as.var_assign.var) &&
+                   reader_expr(r, s->expr, &st->as.var_assign.new_val);
+        }
+        case ST_IF: {
+            st->as.if_st.body = NULL;
+            return reader_expr(r, s->expr, &st->as.if_st.cond) &&
+                   reader_body(r, s->first, s->count, &st->as.if_st.body);
+        }
+        case ST_WHILE: {
+            st->as.while_st.body = NULL;
+            return reader_expr(r, s->expr, &st->as.while_st.cond) &&
+                   reader_body(r, s->first, s->count, &st->as.while_st.body);
+        }
+        case ST_FN_DEFINITION: {
+            st->as.fn_def.args = NULL;
+            st->as.fn_def.body = NULL;
+            if (s->inline_hint > FIH_NOINLINE) return false;
+            st->as.fn_def.inline_hint = s->inline_hint;
+            if (!reader_string(r, s->name, &st->as.fn_def.name)) return false;
+            if (!reader_string(r, s->value_type, &st->as.fn_def.ret_type)) return false;
+            if (!reader_type(r, s->checked_type, &st->as.fn_def.ret_value_type)) return false;
+            if (!reader_symbol(r, s->symbol, &st->as.fn_def.symbol_count)) return false;
+            if ((uint64_t)s->first_arg + s->arg_count > r->header->arg_count) return false;
+            for (uint32_t i = 0; i < s->arg_count; i++) {
+                FnArg arg = {0};
+                if (!reader_string(r, r->args[s->first_arg + i].name, &arg.name)) return false;
+                if (!reader_string(r, r->args[s->first_arg + i].type, &arg.type)) return false;
+                if (!reader_type(r, r->args[s->first_arg + i].value_type, &arg.value_type)) return false;
+                arrput(st->as.fn_def.args, arg);
+            }
+            return reader_body(r, s->first, s->count, &st->as.fn_def.body);
+        }
+        case ST_ERROR: return true;
+    }
+    return false;
+}
+
+static bool reader_body(AstCacheReader* r, uint32_t first, uint32_t count, Statement** body) {
+    if ((uint64_t)first + count > r->header->statement_count) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        Statement st = {0};
+        if (!reader_statement(r, &r->statements[first + i], &st)) return false;
+        arrput(*body, st);
+    }
+    return true;
+}
+
+bool ast_cache_load(const char* path, uint64_t hash, Interner* interner, AstCache* cache) {
+    *cache = (AstCache) {0};
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(AstCacheHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size = info.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    const AstCacheHeader* header = map;
+    const size_t expected_size = sizeof(AstCacheHeader) +
+                                 (size_t)header->expr_count * sizeof(AstCacheExpr) +
+                                 (size_t)header->statement_count * sizeof(AstCacheStatement) +
+                                 (size_t)header->arg_count * sizeof(AstCacheArg) +
+                                 header->strings_size;
+    if (memcmp(header->magic, AST_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != AST_CACHE_VERSION ||
+        header->source_hash != hash ||
+        header->top_level_count > header->statement_count ||
+        header->is_checked > 1 ||
+        size != expected_size ||
+        (header->strings_size != 0 && ((const char*)map)[size - 1] != 0)) {
+        munmap(map, size);
+        return false;
+    }
+
+    AstCacheReader r = {
+        .header = header,
+        .exprs = (const AstCacheExpr*)(header + 1),
+        .interner = interner,
+    };
+    r.statements = (const AstCacheStatement*)(r.exprs + header->expr_count);
+    r.args = (const AstCacheArg*)(r.statements + header->statement_count);
+    r.strings = (const char*)(r.args + header->arg_count);
+    // Not in the arena, a cached file can hold far more exprs than it fits
+    r.loaded_exprs = malloc(sizeof(Expr) * (header->expr_count > 0 ? header->expr_count : 1));
+    assert(r.loaded_exprs);
+
+    Statement* statements = NULL;
+    const bool ok = reader_exprs(&r) && reader_body(&r, 0, header->top_level_count, &statements);
+    const bool is_checked = header->is_checked;
+    // Every name got interned, nothing points into the mapping anymore
+    munmap(map, size);
+    if (!ok) {
+        fprintf(stderr, "Ignoring corrupted ast cache file %s\n", path);
+        arrfree(statements);
+        free(r.loaded_exprs);
+        return false;
+    }
+
+    *cache = (AstCache) {
+        .exprs = r.loaded_exprs,
+        .statements = statements,
+        .is_checked = is_checked,
+    };
+    return true;
+}
+
+void ast_cache_free(AstCache* cache) {
+    free(cache->exprs);
+    *cache = (AstCache) {0};
+}
@@ -0,0 +1,104 @@
+#ifndef AST_CACHE_H
+#define AST_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "intern.h"
+#include "parser.h"
+
+// On disk image of a parsed file. Every reference inside of it is an index
+// (into the node tables or the string table) so it can be mmapped at any address.
+// Files that passed the type checker also carry its annotations (and the ones of the
+// constant evaluator), a hit on one of those skips checking entirely.
+#define AST_CACHE_MAGIC "NSLAST\0"
+#define AST_CACHE_VERSION 5
+// Expr index of variables defined without a value
+#define AST_CACHE_NO_EXPR UINT32_MAX
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t top_level_count;
+    uint64_t source_hash;
+    uint32_t expr_count;
+    uint32_t statement_count;
+    uint32_t arg_count;
+    uint32_t strings_size;
+    // The annotations below are only meaningful when set
+    uint32_t is_checked;
+    uint32_t reserved;
+} AstCacheHeader;
+
+typedef struct {
+    uint32_t type;
+    uint32_t op;
+    union {
+        uint64_t number;
+        uint64_t boolean;
+        uint32_t string;
+        struct {
+            uint32_t left;
+            uint32_t right;
+        } binary;
+        // The args are a contiguous range of exprs, like bodies are of statements
+        struct {
+            uint32_t name;
+            uint32_t first;
+            uint32_t count;
+        } call;
+    } as;
+    // Annotations, only builtin types are ever stored
+    uint32_t value_type;
+    uint32_t is_constant;
+    int64_t symbol;
+    uint64_t constant;
+} AstCacheExpr;
+
+// Bodies are stored as contiguous ranges of statements, args as ranges of args
+typedef struct {
+    uint32_t type;
+    uint32_t name;
+    uint32_t value_type;
+    uint32_t expr;
+    uint32_t first;
+    uint32_t count;
+    uint32_t first_arg;
+    uint32_t arg_count;
+    // var_def: declared with `const`
+    uint32_t is_const;
+    // fn_def: FnInlineHint
+    uint32_t inline_hint;
+    int64_t row, col;
+    // Annotations: the resolved type (return type of a fn_def), the symbol (symbol count of a fn_def)
+    // and whether the constant evaluator folded a var_def
+    uint32_t checked_type;
+    uint32_t is_folded;
+    int64_t symbol;
+} AstCacheStatement;
+
+typedef struct {
+    uint32_t name;
+    uint32_t type;
+    uint32_t value_type;
+} AstCacheArg;
+
+typedef struct {
+    // One block backing every expr of `statements`
+    Expr* exprs;
+    Statement* statements;
+    bool is_checked;
+} AstCache;
+
+// FNV-1a over the source file content
+uint64_t ast_cache_hash(const char* content);
+// Returns a malloc'd path of the cache entry for `hash` inside of `dir`
+char* ast_cache_path(const char* dir, uint64_t hash);
+// `checked` stores the annotations as well, it gets dropped if one of them can't be stored
+bool ast_cache_store(const char* path, uint64_t hash, const Statement* statements, bool checked);
+// Maps the cache entry and rebuilds the AST from it, names are interned straight out of the mapping
+// which is unmapped again before returning.
+// Returns false on a miss (no entry, stale hash, different version)
+bool ast_cache_load(const char* path, uint64_t hash, Interner* interner, AstCache* cache);
+void ast_cache_free(AstCache* cache);
+
+#endif
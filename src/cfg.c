@@ -0,0 +1,170 @@
+#include "cfg.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "../extern/stb_ds.h"
+
+// Block on the DFS stack and the index of its next successor to visit
+typedef struct {
+    ptrdiff_t block;
+    ptrdiff_t next;
+} CfgVisit;
+
+// Iterative so deeply nested loops can't blow the stack
+static void cfg_compute_order(Cfg* cfg) {
+    const ptrdiff_t n = arrlen(cfg->function->blocks);
+    bool* visited = calloc(n + 1, sizeof(bool));
+    assert(visited);
+    ptrdiff_t* postorder = NULL;
+    CfgVisit* stack = NULL;
+
+    for (ptrdiff_t root = 0; root < n; root++) {
+        if (visited[root]) continue;
+        visited[root] = true;
+        arrput(stack, ((CfgVisit) { root, 0 }));
+        while (arrlen(stack) > 0) {
+            const ptrdiff_t top = arrlen(stack) - 1;
+            const QBEBlock* block = &cfg->function->blocks[stack[top].block];
+            if (stack[top].next < arrlen(block->succs)) {
+                const ptrdiff_t succ = block->succs[stack[top].next++];
+                if (!visited[succ]) {
+                    visited[succ] = true;
+                    arrput(stack, ((CfgVisit) { succ, 0 }));
+                }
+            } else {
+                arrput(postorder, stack[top].block);
+                (void)arrpop(stack);
+            }
+        }
+        // Blocks not reachable from the entry end up behind the reachable ones
+        for (ptrdiff_t i = arrlen(postorder) - 1; i >= 0; i--) arrput(cfg->order, postorder[i]);
+        arrfree(postorder);
+        if (root == 0) cfg->reachable_count = arrlen(cfg->order);
+    }
+
+    arrfree(stack);
+    free(visited);
+}
+
+// Walks both blocks up the dominator tree until they meet, `position` orders blocks by reverse postorder
+static ptrdiff_t cfg_intersect(const Cfg* cfg, const ptrdiff_t* position, ptrdiff_t a, ptrdiff_t b) {
+    while (a != b) {
+        while (position[a] > position[b]) a = cfg->idom[a];
+        while (position[b] > position[a]) b = cfg->idom[b];
+    }
+    return a;
+}
+
+// Cooper, Harvey and Kennedy's iterative algorithm, settles after a couple of passes in reverse postorder
+static void cfg_compute_dominators(Cfg* cfg) {
+    const ptrdiff_t n = arrlen(cfg->function->blocks);
+    ptrdiff_t* position = malloc((n + 1) * sizeof(ptrdiff_t));
+    assert(position);
+    for (ptrdiff_t i = 0; i < n; i++) {
+        position[cfg->order[i]] = i;
+        arrput(cfg->idom, -1);
+    }
+    if (n == 0) {
+        free(position);
+        return;
+    }
+
+    cfg->idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (ptrdiff_t i = 1; i < cfg->reachable_count; i++) {
+            const ptrdiff_t b = cfg->order[i];
+            const QBEBlock* block = &cfg->function->blocks[b];
+            ptrdiff_t idom = -1;
+            for (ptrdiff_t p = 0; p < arrlen(block->preds); p++) {
+                const ptrdiff_t pred = block->preds[p];
+                if (cfg->idom[pred] == -1) continue;
+                idom = idom == -1 ? pred : cfg_intersect(cfg, position, pred, idom);
+            }
+            if (idom != cfg->idom[b]) {
+                cfg->idom[b] = idom;
+                changed = true;
+            }
+        }
+    }
+    free(position);
+}
+
+Cfg cfg_build(const QBEFunction* function) {
+    Cfg cfg = { .function = function };
+    cfg_compute_order(&cfg);
+    cfg_compute_dominators(&cfg);
+    return cfg;
+}
+
+void cfg_free(Cfg* cfg) {
+    arrfree(cfg->order);
+    arrfree(cfg->idom);
+}
+
+bool cfg_dominates(const Cfg* cfg, ptrdiff_t a, ptrdiff_t b) {
+    if (cfg->idom[b] == -1) return false;
+    while (b != a && b != 0) b = cfg->idom[b];
+    return b == a;
+}
+
+// Everything that reaches a latch without going through the header
+static void cfg_loop_fill(const Cfg* cfg, CfgLoop* loop) {
+    const ptrdiff_t n = arrlen(cfg->function->blocks);
+    loop->contains = calloc(n + 1, sizeof(bool));
+    assert(loop->contains);
+    loop->contains[loop->header] = true;
+    ptrdiff_t* stack = NULL;
+    for (ptrdiff_t l = 0; l < arrlen(loop->latches); l++) {
+        if (loop->contains[loop->latches[l]]) continue;
+        loop->contains[loop->latches[l]] = true;
+        arrput(stack, loop->latches[l]);
+    }
+    while (arrlen(stack) > 0) {
+        const QBEBlock* block = &cfg->function->blocks[arrpop(stack)];
+        for (ptrdiff_t p = 0; p < arrlen(block->preds); p++) {
+            const ptrdiff_t pred = block->preds[p];
+            if (loop->contains[pred] || cfg->idom[pred] == -1) continue;
+            loop->contains[pred] = true;
+            arrput(stack, pred);
+        }
+    }
+    arrfree(stack);
+    for (ptrdiff_t i = 0; i < cfg->reachable_count; i++) {
+        if (loop->contains[cfg->order[i]]) arrput(loop->blocks, cfg->order[i]);
+    }
+}
+
+static int cfg_loop_compare(const void* a, const void* b) {
+    const ptrdiff_t size_a = arrlen(((const CfgLoop*)a)->blocks);
+    const ptrdiff_t size_b = arrlen(((const CfgLoop*)b)->blocks);
+    return (size_a > size_b) - (size_a < size_b);
+}
+
+CfgLoop* cfg_find_loops(const Cfg* cfg) {
+    CfgLoop* loops = NULL;
+    for (ptrdiff_t i = 0; i < cfg->reachable_count; i++) {
+        const ptrdiff_t header = cfg->order[i];
+        CfgLoop loop = { .header = header };
+        const QBEBlock* block = &cfg->function->blocks[header];
+        for (ptrdiff_t p = 0; p < arrlen(block->preds); p++) {
+            if (cfg_dominates(cfg, header, block->preds[p])) arrput(loop.latches, block->preds[p]);
+        }
+        if (arrlen(loop.latches) == 0) continue;
+        cfg_loop_fill(cfg, &loop);
+        arrput(loops, loop);
+    }
+    // A loop has more blocks than any loop nested in it
+    if (arrlen(loops) > 1) qsort(loops, arrlen(loops), sizeof(CfgLoop), cfg_loop_compare);
+    return loops;
+}
+
+void cfg_loops_free(CfgLoop* loops) {
+    for (ptrdiff_t l = 0; l < arrlen(loops); l++) {
+        arrfree(loops[l].blocks);
+        arrfree(loops[l].latches);
+        free(loops[l].contains);
+    }
+    arrfree(loops);
+}
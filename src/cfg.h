@@ -0,0 +1,39 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "qbe.h"
+
+// Control flow graph of a QBEFunction. The edges are the succs and preds of its blocks,
+// so the function has to be linked, the entry is block 0
+typedef struct {
+    const QBEFunction* function;
+    // Reverse postorder from the entry, blocks that can't be reached come last
+    ptrdiff_t* order;
+    // How many blocks at the front of `order` the entry reaches
+    ptrdiff_t reachable_count;
+    // Immediate dominator of every block, the entry is its own and blocks that can't be reached have -1
+    ptrdiff_t* idom;
+} Cfg;
+
+Cfg cfg_build(const QBEFunction* function);
+void cfg_free(Cfg* cfg);
+// Whether every path from the entry to `b` goes through `a`, blocks dominate themselves
+bool cfg_dominates(const Cfg* cfg, ptrdiff_t a, ptrdiff_t b);
+
+// Natural loop, the header dominates every block of it and the latches jump back to the header
+typedef struct {
+    ptrdiff_t header;
+    // Blocks of the loop in reverse postorder, so the header comes first
+    ptrdiff_t* blocks;
+    ptrdiff_t* latches;
+    // One flag per block of the function
+    bool* contains;
+} CfgLoop;
+
+// One loop per header, inner loops come before the loops containing them
+CfgLoop* cfg_find_loops(const Cfg* cfg);
+void cfg_loops_free(CfgLoop* loops);
+
+#endif
@@ -3,9 +3,13 @@
 #include <stddef.h>
 #include <string.h>
 #include "../extern/stb_ds.h"
+#include "cfg.h"
+#include "dataflow.h"
 #include "parser.h"
 #include "qbe.h"
 
+_Static_assert(FN_MAX_ARGS <= QBE_MAX_USES, "Every arg of a call has to fit into the uses of its instruction");
+
 char* fresh_temp(Codegen* codegen) {
     char buffer[32];
     memset(buffer, 0, 32);
@@ -22,23 +26,583 @@ char* fresh_label(Codegen* codegen, char* prefix) {
     return strdup(buffer);
 }
 
+void codegen_push_scope(Codegen* codegen) {
+    arrput(codegen->slot_scopes, codegen->live_slots);
+}
+
+void codegen_pop_scope(Codegen* codegen) {
+    codegen->live_slots = arrpop(codegen->slot_scopes);
+}
+
+static char* codegen_variable_slot(const Codegen* codegen, ptrdiff_t symbol) {
+    assert(symbol >= 0 && symbol < arrlen(codegen->variables) && "Variable wasn't resolved by the type checker");
+    assert(codegen->variables[symbol] != NULL);
+    return codegen->variables[symbol];
+}
+
+static char* codegen_define_variable(Codegen* codegen, ptrdiff_t symbol) {
+    assert(symbol >= 0 && "Variable wasn't resolved by the type checker");
+    while (arrlen(codegen->variables) <= symbol) arrput(codegen->variables, NULL);
+
+    if (codegen->live_slots == (size_t)arrlen(codegen->slots)) arrput(codegen->slots, fresh_temp(codegen));
+    codegen->variables[symbol] = codegen->slots[codegen->live_slots++];
+    return codegen->variables[symbol];
+}
+
+static void codegen_define_unset_variable(Codegen* codegen, const Statement* st) {
+    const ptrdiff_t symbol = st->as.var_def.symbol;
+    assert(symbol >= 0 && "Variable wasn't resolved by the type checker");
+    while (arrlen(codegen->variables) <= symbol) arrput(codegen->variables, NULL);
+    char* slot = fresh_temp(codegen);
+    arrput(codegen->unshared_slots, slot);
+    codegen->variables[symbol] = slot;
+    const CodegenUnsetVariable variable = { .name = st->as.var_def.name, .loc = st->loc };
+    hmput(codegen->unset_variables, symbol, variable);
+}
+
+// Whether the variable is read and written through its stack slot
+static bool codegen_in_memory(const Codegen* codegen, ptrdiff_t symbol) {
+    return !codegen->ssa || (symbol < arrlen(codegen->variables) && codegen->variables[symbol] != NULL);
+}
+
+static QBEValue const_value(uint64_t c) {
+    return (QBEValue) { .kind = QVK_CONST, .const_i = c };
+}
+
+static ptrdiff_t codegen_new_block(Codegen* codegen, char* label) {
+    CodegenBlock b = { .label = label, .index = -1 };
+    arrput(codegen->blocks, b);
+    return arrlen(codegen->blocks) - 1;
+}
+
+static void codegen_add_pred(Codegen* codegen, ptrdiff_t b, ptrdiff_t pred) {
+    assert(!codegen->blocks[b].sealed && "Block got a new pred after it was sealed");
+    arrput(codegen->blocks[b].preds, pred);
+}
+
+// QBEBlock code is being generated into, only valid until the next block gets started
+static QBEBlock* codegen_block(Codegen* codegen) {
+    assert(codegen->current != -1 && "Generating code nothing can reach");
+    return &codegen->function->blocks[codegen->blocks[codegen->current].index];
+}
+
+// Ends the current block with `jump`
+static void codegen_end_block(Codegen* codegen, QBEInstruction jump) {
+    codegen_block(codegen)->jump = jump;
+    codegen->current = -1;
+}
+
+static void codegen_jump(Codegen* codegen, ptrdiff_t target) {
+    codegen_add_pred(codegen, target, codegen->current);
+    codegen_end_block(codegen, (QBEInstruction) { .type = QIT_JMP, .jmp = { .label = codegen->blocks[target].label } });
+}
+
+static void codegen_branch(Codegen* codegen, QBEValue cond, ptrdiff_t then, ptrdiff_t otherwise) {
+    codegen_add_pred(codegen, then, codegen->current);
+    codegen_add_pred(codegen, otherwise, codegen->current);
+    codegen_end_block(codegen, (QBEInstruction) {
+        .type = QIT_JNZ,
+        .jnz = {.then = codegen->blocks[then].label, .otherwise = codegen->blocks[otherwise].label, .value = cond}
+    });
+}
+
+// Code falls into the new block unless the previous one ended with a jump.
+// A block nothing jumps or falls into never gets a QBEBlock, the code after it is skipped
+// until the next block something reaches
+static void codegen_start_block(Codegen* codegen, ptrdiff_t b) {
+    if (codegen->current != -1) codegen_jump(codegen, b);
+    if (arrlen(codegen->blocks[b].preds) == 0) return;
+    qbe_function_push_block(codegen->function, codegen->blocks[b].label);
+    codegen->blocks[b].index = arrlen(codegen->function->blocks) - 1;
+    codegen->current = b;
+}
+
+static void codegen_collect_assigned(const Statement* body, ptrdiff_t** assigned) {
+    for (ptrdiff_t i = 0; i < arrlen(body); i++) {
+        switch (body[i].type) {
+            case ST_SET_VARIABLE: arrput(*assigned, body[i].as.var_assign.symbol); break;
+            case ST_IF: codegen_collect_assigned(body[i].as.if_st.body, assigned); break;
+            case ST_WHILE: codegen_collect_assigned(body[i].as.while_st.body, assigned); break;
+            default: break;
+        }
+    }
+}
+
+static void codegen_set_variable_type(Codegen* codegen, ptrdiff_t symbol, QBEValueType type) {
+    while (arrlen(codegen->variable_types) <= symbol) arrput(codegen->variable_types, QVT_WORD);
+    codegen->variable_types[symbol] = type;
+}
+
+static QBEValue ssa_resolve(Codegen* codegen, QBEValue value) {
+    return qbe_substitution_resolve(codegen->phi_aliases, value);
+}
+
+static void ssa_write(Codegen* codegen, ptrdiff_t b, ptrdiff_t symbol, QBEValue value) {
+    hmput(codegen->blocks[b].defs, symbol, value);
+}
+
+static QBEValue ssa_read(Codegen* codegen, ptrdiff_t b, ptrdiff_t symbol);
+
+static ptrdiff_t ssa_new_phi(Codegen* codegen, ptrdiff_t b, ptrdiff_t symbol) {
+    CodegenPhi phi = {
+        .symbol = symbol,
+        .value = { .kind = QVK_TEMP, .name = fresh_temp(codegen) },
+    };
+    arrput(codegen->blocks[b].phis, phi);
+    return arrlen(codegen->blocks[b].phis) - 1;
+}
+
+// A phi whose args are all the same value (besides the phi itself) just stands for that value
+static QBEValue ssa_add_phi_args(Codegen* codegen, ptrdiff_t b, ptrdiff_t p) {
+    const ptrdiff_t symbol = codegen->blocks[b].phis[p].symbol;
+    for (ptrdiff_t i = 0; i < arrlen(codegen->blocks[b].preds); i++) {
+        const ptrdiff_t pred = codegen->blocks[b].preds[i];
+        // Reading can add phis to other blocks, so nothing here is held onto across it
+        QBEPhiArg arg = { .label = codegen->blocks[pred].label, .value = ssa_read(codegen, pred, symbol) };
+        arrput(codegen->blocks[b].phis[p].args, arg);
+    }
+
+    const CodegenPhi* phi = &codegen->blocks[b].phis[p];
+    QBEValue same = { .kind = QVK_CONST, .const_i = 0 };
+    bool found = false;
+    for (ptrdiff_t i = 0; i < arrlen(phi->args); i++) {
+        const QBEValue arg = ssa_resolve(codegen, phi->args[i].value);
+        if (qbe_value_equal(&arg, &phi->value)) continue;
+        if (found && !qbe_value_equal(&arg, &same)) return phi->value;
+        same = arg;
+        found = true;
+    }
+    shput(codegen->phi_aliases, phi->value.name, same);
+    return same;
+}
+
+static QBEValue ssa_read_recursive(Codegen* codegen, ptrdiff_t b, ptrdiff_t symbol) {
+    const CodegenBlock* block = &codegen->blocks[b];
+    QBEValue value;
+    if (!block->sealed) {
+        // Only loop headers stay open, until the jump back from the end of the loop is generated
+        bool assigned = false;
+        for (ptrdiff_t i = 0; i < arrlen(block->assigned); i++) assigned |= block->assigned[i] == symbol;
+        if (assigned) {
+            const ptrdiff_t p = ssa_new_phi(codegen, b, symbol);
+            value = codegen->blocks[b].phis[p].value;
+        } else if (arrlen(block->preds) > 0) {
+            // Nothing in the loop changes it, the first pred is the one entering the loop
+            value = ssa_read(codegen, block->preds[0], symbol);
+        } else {
+            // The loop is never entered
+            value = (QBEValue) { .kind = QVK_CONST, .const_i = 0 };
+        }
+    } else if (arrlen(block->preds) == 0) {
+        // Unreachable code, any value does
+        value = (QBEValue) { .kind = QVK_CONST, .const_i = 0 };
+    } else if (arrlen(block->preds) == 1) {
+        value = ssa_read(codegen, block->preds[0], symbol);
+    } else {
+        const ptrdiff_t p = ssa_new_phi(codegen, b, symbol);
+        // Written before looking at the preds so going around a loop ends at the phi
+        ssa_write(codegen, b, symbol, codegen->blocks[b].phis[p].value);
+        value = ssa_add_phi_args(codegen, b, p);
+    }
+    ssa_write(codegen, b, symbol, value);
+    return value;
+}
+
+static QBEValue ssa_read(Codegen* codegen, ptrdiff_t b, ptrdiff_t symbol) {
+    const ptrdiff_t i = hmgeti(codegen->blocks[b].defs, symbol);
+    if (i != -1) return ssa_resolve(codegen, codegen->blocks[b].defs[i].value);
+    return ssa_read_recursive(codegen, b, symbol);
+}
+
+static void ssa_seal(Codegen* codegen, ptrdiff_t b) {
+    // Phis created while the block was open don't have any args yet
+    for (ptrdiff_t p = 0; p < arrlen(codegen->blocks[b].phis); p++) {
+        if (codegen->blocks[b].phis[p].args == NULL) ssa_add_phi_args(codegen, b, p);
+    }
+    codegen->blocks[b].sealed = true;
+}
+
+// Phis only get emitted once the whole function is generated, since reading a variable
+// can add them to any block generated before
+static void ssa_finish(Codegen* codegen) {
+    // Trivial phis could already be used before they turned out to be trivial
+    qbe_function_substitute(codegen->function, codegen->phi_aliases);
+    // Resolved before any of the trivial ones get freed, their names are keys of the aliases
+    for (ptrdiff_t b = 0; b < arrlen(codegen->blocks); b++) {
+        for (ptrdiff_t p = 0; p < arrlen(codegen->blocks[b].phis); p++) {
+            CodegenPhi* phi = &codegen->blocks[b].phis[p];
+            for (ptrdiff_t a = 0; a < arrlen(phi->args); a++) phi->args[a].value = ssa_resolve(codegen, phi->args[a].value);
+        }
+    }
+    char** trivial = NULL;
+    for (ptrdiff_t b = 0; b < arrlen(codegen->blocks); b++) {
+        CodegenBlock* cb = &codegen->blocks[b];
+        for (ptrdiff_t p = arrlen(cb->phis) - 1; p >= 0; p--) {
+            CodegenPhi* phi = &cb->phis[p];
+            if (shgeti(codegen->phi_aliases, phi->value.name) != -1) {
+                arrput(trivial, phi->value.name);
+                arrfree(phi->args);
+                continue;
+            }
+            assert(cb->index != -1);
+            qbe_block_assign_ins_at(
+                &codegen->function->blocks[cb->index],
+                0,
+                (QBEInstruction) { .type = QIT_PHI, .phi.args = phi->args },
+                codegen->variable_types[phi->symbol],
+                phi->value
+            );
+        }
+    }
+
+    for (ptrdiff_t b = 0; b < arrlen(codegen->blocks); b++) {
+        arrfree(codegen->blocks[b].preds);
+        hmfree(codegen->blocks[b].defs);
+        arrfree(codegen->blocks[b].phis);
+        arrfree(codegen->blocks[b].assigned);
+    }
+    arrfree(codegen->blocks);
+    shfree(codegen->phi_aliases);
+    for (ptrdiff_t i = 0; i < arrlen(trivial); i++) free(trivial[i]);
+    arrfree(trivial);
+    arrfree(codegen->variable_types);
+}
+
+// One error per variable, at the first read in block order that nothing might have been assigned before
+static void codegen_check_unset_reads(Codegen* codegen) {
+    const QBEFunction* func = codegen->function;
+    Cfg cfg = cfg_build(func);
+    StatementRef* unassigned = definite_assignment_unassigned(&cfg);
+    cfg_free(&cfg);
+
+    ptrdiff_t* reported = NULL;
+    for (ptrdiff_t u = 0; u < arrlen(unassigned); u++) {
+        const QBEStatement* load = &func->blocks[unassigned[u].block].statements[unassigned[u].index];
+        const ptrdiff_t r = shgeti(codegen->unset_reads, load->assign.value.name);
+        assert(r != -1 && "Stack slot of a variable defined with a value loaded before anything was stored into it");
+        const ptrdiff_t symbol = codegen->unset_reads[r].value.symbol;
+        bool seen = false;
+        for (ptrdiff_t i = 0; i < arrlen(reported); i++) seen |= reported[i] == symbol;
+        if (seen) continue;
+        arrput(reported, symbol);
+        const CodegenError error = {
+            .message = "Variable might be read before anything was assigned to it",
+            .loc = codegen->unset_reads[r].value.loc,
+            .variable = hmget(codegen->unset_variables, symbol),
+        };
+        arrput(codegen->errors, error);
+    }
+    arrfree(reported);
+    arrfree(unassigned);
+    shfree(codegen->unset_reads);
+}
+
+static void display_line(char* file_content, Location loc) {
+    long offset = get_offset_in_buffer(file_content, loc);
+    if (offset < 0) return;
+    char* line_start = file_content + offset - loc.col + 1;
+    char* line_end = file_content + offset;
+    while (*line_end && *line_end != '\n') line_end++;
+
+    fwrite(line_start, 1, line_end - line_start, stderr);
+    fputc('\n', stderr);
+    fprintf(stderr, "%*s^\n", (int)(loc.col - 1), "");
+}
+
+void codegen_error_display(CodegenError error, char* file_content, char* input_name) {
+    fprintf(stderr, "[codegen::error] %s:%lu:%lu: %s\n", input_name, error.loc.row, error.loc.col, error.message);
+    display_line(file_content, error.loc);
+    fprintf(stderr, "[codegen::note] %s:%lu:%lu: `%s` is defined here without a value\n",
+            input_name, error.variable.loc.row, error.variable.loc.col, error.variable.name);
+    display_line(file_content, error.variable.loc);
+}
+
+static void generate_function_body(Codegen* codegen, FnArg* args, Statement* body, QBEFunction* func) {
+    arrfree(codegen->variables);
+    arrfree(codegen->slots);
+    arrfree(codegen->unshared_slots);
+    hmfree(codegen->unset_variables);
+    codegen->live_slots = 0;
+    codegen->function = func;
+
+    codegen->current = codegen_new_block(codegen, "entry");
+    qbe_function_push_block(func, "entry");
+    codegen->blocks[codegen->current].index = 0;
+    ssa_seal(codegen, codegen->current);
+
+    codegen_push_scope(codegen);
+    // Args are the first symbols of a function
+    for (ptrdiff_t i = 0; i < arrlen(args); i++) {
+        char* param = fresh_temp(codegen);
+        const QBEValueType type = codegen_value_type(codegen, args[i].value_type);
+        const QBEMemoryType memory_type = codegen_memory_type(codegen, args[i].value_type);
+        qbe_function_push_param(func, param, type);
+        QBEValue value = { .kind = QVK_TEMP, .name = param };
+        if (!codegen->ssa) {
+            generate_store(codegen_block(codegen), value, memory_type, codegen_define_variable(codegen, i));
+            continue;
+        }
+        // Going through a slot truncates narrow args, in a temporary that has to be done by hand
+        if (memory_type == QMT_BYTE || memory_type == QMT_HALF) {
+            QBEValue truncated = { .kind = QVK_TEMP, .name = fresh_temp(codegen) };
+            qbe_block_assign_ins(codegen_block(codegen), (QBEInstruction) {
+                .type = QIT_EXT,
+                .ext = { .type = memory_type, .is_signed = type_is_signed(codegen->types, args[i].value_type), .value = value }
+            }, QVT_WORD, truncated);
+            value = truncated;
+        }
+        codegen_set_variable_type(codegen, i, type);
+        ssa_write(codegen, codegen->current, i, value);
+    }
+    for (ptrdiff_t i = 0; i < arrlen(body); i++) {
+        generate_statement(codegen, body[i]);
+    }
+    // Falling off the end returns 0
+    if (codegen->current != -1) codegen_end_block(codegen, (QBEInstruction) { .type = QIT_RETURN, .ret = const_value(0) });
+    codegen_pop_scope(codegen);
+    ssa_finish(codegen);
+
+    // Every slot is allocated once up front, variables of sibling blocks end up sharing them
+    // so they're all big enough for any scalar
+    for (ptrdiff_t i = 0; i < arrlen(codegen->slots) + arrlen(codegen->unshared_slots); i++) {
+        const ptrdiff_t shared = arrlen(codegen->slots);
+        QBEValue slot = {.kind = QVK_TEMP, .name = i < shared ? codegen->slots[i] : codegen->unshared_slots[i - shared] };
+        qbe_block_assign_ins_at(
+            &func->blocks[0],
+            i,
+            (QBEInstruction) {
+                .type = QIT_ALLOC8,
+                .alloc8.size = 8
+            },
+            QVT_LONG,
+            slot
+        );
+    }
+    qbe_function_link(func);
+    // Every other variable gets a value when it's defined
+    if (shlen(codegen->unset_reads) > 0) codegen_check_unset_reads(codegen);
+    codegen->function = NULL;
+}
+
 void generate_code(Codegen* codegen, Statement* sts) {
+    // Top level statements end up in main, which comes first in the module
+    qbe_module_create_function(&codegen->mod, "main", QVT_WORD);
     for (ptrdiff_t i = 0; i < arrlen(sts); i++) {
         if (sts[i].type == ST_FN_DEFINITION) {
             Statement* st = &sts[i];
-            QBEFunction* func = qbe_module_create_function(&codegen->mod, st->as.fn_def.name, QVT_WORD);
-            QBEBlock* block = qbe_function_push_block(func, "entry");
-            for (ptrdiff_t j = 0; j < arrlen(sts[i].as.fn_def.body); j++) {
-                generate_statement(codegen, sts[i].as.fn_def.body[j], block);
+            QBEFunction* func = qbe_module_create_function(&codegen->mod, st->as.fn_def.name, codegen_value_type(codegen, st->as.fn_def.ret_value_type));
+            switch (st->as.fn_def.inline_hint) {
+                case FIH_DEFAULT: break;
+                case FIH_INLINE: func->inline_hint = QIH_ALWAYS; break;
+                case FIH_NOINLINE: func->inline_hint = QIH_NEVER; break;
             }
+            generate_function_body(codegen, st->as.fn_def.args, st->as.fn_def.body, func);
         }
     }
-    for (ptrdiff_t i = 0; i < arrlen(sts); i++) {
-        generate_statement(codegen, sts[i], codegen->entry);
+    // Creating the other functions can move main around
+    generate_function_body(codegen, NULL, sts, &codegen->mod.functions[0]);
+}
+
+QBEValueType codegen_value_type(const Codegen* codegen, TypeId type) {
+    return type_size(codegen->types, type) == 8 ? QVT_LONG : QVT_WORD;
+}
+
+QBEMemoryType codegen_memory_type(const Codegen* codegen, TypeId type) {
+    switch (type_size(codegen->types, type)) {
+        case 1: return QMT_BYTE;
+        case 2: return QMT_HALF;
+        case 4: return QMT_WORD;
+        case 8: return QMT_LONG;
+    }
+    assert(false && "Type doesn't fit into a register");
+    return QMT_LONG;
+}
+
+// Assigns the result of `ins` to a fresh temporary, bytes and halfs are computed as words
+// so their result gets truncated back to the range of `type`
+static QBEValue generate_arithmetic(Codegen* codegen, QBEBlock* block, QBEInstruction ins, TypeId type) {
+    QBEValue result = { .kind = QVK_TEMP, .name = fresh_temp(codegen) };
+    qbe_block_assign_ins(block, ins, codegen_value_type(codegen, type), result);
+
+    const QBEMemoryType memory_type = codegen_memory_type(codegen, type);
+    if (memory_type != QMT_BYTE && memory_type != QMT_HALF) return result;
+    QBEValue truncated = { .kind = QVK_TEMP, .name = fresh_temp(codegen) };
+    qbe_block_assign_ins(block, (QBEInstruction) {
+        .type = QIT_EXT,
+        .ext = {
+            .type = memory_type,
+            .is_signed = type_is_signed(codegen->types, type),
+            .value = result,
+        }
+    }, QVT_WORD, truncated);
+    return truncated;
+}
+
+static bool is_const(QBEValue value, uint64_t c) {
+    return value.kind == QVK_CONST && value.const_i == c;
+}
+
+// Computes `left op right` at compile time when it's known, either because both sides are
+// constants or because of an identity like x + 0, x * 1, x * 0, x - x.
+// Every value is already in the range of its type, so x itself can stand for the result
+static bool codegen_fold_binary(const Codegen* codegen, const Expr* expr, QBEValue left, QBEValue right, QBEValue* result) {
+    const TypeId operand_type = expr->as.binary.left->value_type;
+    const bool is_signed = type_is_signed(codegen->types, operand_type);
+    const bool same = qbe_value_equal(&left, &right) && left.kind == QVK_TEMP;
+    if (left.kind == QVK_CONST && right.kind == QVK_CONST) {
+        const uint64_t l = left.const_i, r = right.const_i;
+        uint64_t value;
+        switch (expr->as.binary.op) {
+            case '+': value = l + r; break;
+            case '-': value = l - r; break;
+            case '*': value = l * r; break;
+            case '/': {
+                // Left for the program to trap on at run time
+                if (r == 0 || (is_signed && (int64_t)r == -1)) return false;
+                value = is_signed ? (uint64_t)((int64_t)l / (int64_t)r) : l / r;
+                break;
+            }
+            case '>': value = is_signed ? (int64_t)l > (int64_t)r : l > r; break;
+            case '<': value = is_signed ? (int64_t)l < (int64_t)r : l < r; break;
+            default: return false;
+        }
+        *result = (QBEValue) { .kind = QVK_CONST, .const_i = type_wrap(codegen->types, expr->value_type, value) };
+        return true;
+    }
+    const QBEValue zero = { .kind = QVK_CONST, .const_i = 0 };
+    switch (expr->as.binary.op) {
+        case '+': {
+            if (is_const(right, 0)) *result = left;
+            else if (is_const(left, 0)) *result = right;
+            else return false;
+            return true;
+        }
+        case '-': {
+            if (is_const(right, 0)) *result = left;
+            else if (same) *result = zero;
+            else return false;
+            return true;
+        }
+        case '*': {
+            if (is_const(right, 1)) *result = left;
+            else if (is_const(left, 1)) *result = right;
+            else if (is_const(left, 0) || is_const(right, 0)) *result = zero;
+            else return false;
+            return true;
+        }
+        case '/': {
+            if (!is_const(right, 1)) return false;
+            *result = left;
+            return true;
+        }
+        case '>': case '<': {
+            if (!same) return false;
+            *result = zero;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Assigns `left op right` to a fresh temporary
+static QBEValue generate_binary_ins(Codegen* codegen, QBEBlock* block, QBEInstructionType op, QBEValueType type, QBEValue left, QBEValue right) {
+    QBEValue result = { .kind = QVK_TEMP, .name = fresh_temp(codegen) };
+    qbe_block_assign_ins(block, (QBEInstruction) { .type = op, .add = { .left = left, .right = right } }, type, result);
+    return result;
+}
+
+static bool is_power_of_two(uint64_t c) {
+    return c != 0 && (c & (c - 1)) == 0;
+}
+
+// x * 2^k is a shift, x * (2^k + 1) and x * (2^k - 1) a shift and an add or a sub
+static bool generate_mul_by_const(Codegen* codegen, QBEBlock* block, TypeId type, QBEValue x, uint64_t c, QBEValue* result) {
+    const QBEValueType value_type = codegen_value_type(codegen, type);
+    const unsigned width = value_type == QVT_LONG ? 64 : 32;
+    if (is_power_of_two(c) && (unsigned)__builtin_ctzll(c) < width) {
+        *result = generate_arithmetic(codegen, block, (QBEInstruction) {
+            .type = QIT_SHL,
+            .shl = { .left = x, .right = const_value(__builtin_ctzll(c)) },
+        }, type);
+        return true;
+    }
+    QBEInstructionType combine;
+    unsigned k;
+    if (c > 2 && is_power_of_two(c - 1)) {
+        combine = QIT_ADD;
+        k = __builtin_ctzll(c - 1);
+    } else if (c > 2 && is_power_of_two(c + 1)) {
+        combine = QIT_SUB;
+        k = __builtin_ctzll(c + 1);
+    } else {
+        return false;
+    }
+    if (k >= width) return false;
+    const QBEValue shifted = generate_binary_ins(codegen, block, QIT_SHL, value_type, x, const_value(k));
+    *result = generate_arithmetic(codegen, block, (QBEInstruction) {
+        .type = combine,
+        .add = { .left = shifted, .right = x },
+    }, type);
+    return true;
+}
+
+// Division by 2^k becomes shifts, signed ones round towards zero by adding 2^k - 1 to negative
+// dividends first. Division of words by other constants becomes a multiplication by a
+// fixed point reciprocal done in longs (Granlund and Montgomery, "Division by Invariant
+// Integers using Multiplication"). QBE has no way to get the high half of a 64 bit product,
+// so longs only get the shifts
+static bool generate_div_by_const(Codegen* codegen, QBEBlock* block, TypeId type, QBEValue x, uint64_t c, QBEValue* result) {
+    const bool is_signed = type_is_signed(codegen->types, type);
+    const QBEValueType value_type = codegen_value_type(codegen, type);
+    const unsigned width = value_type == QVT_LONG ? 64 : 32;
+    // Dividing by 1 is folded already, dividing by negative numbers is left alone
+    if (c < 2 || (is_signed && (int64_t)c < 2)) return false;
+
+    if (is_power_of_two(c)) {
+        const unsigned k = __builtin_ctzll(c);
+        if (!is_signed) {
+            *result = generate_binary_ins(codegen, block, QIT_SHR, value_type, x, const_value(k));
+            return true;
+        }
+        const QBEValue sign = generate_binary_ins(codegen, block, QIT_SAR, value_type, x, const_value(width - 1));
+        const QBEValue bias = generate_binary_ins(codegen, block, QIT_SHR, value_type, sign, const_value(width - k));
+        const QBEValue biased = generate_binary_ins(codegen, block, QIT_ADD, value_type, x, bias);
+        *result = generate_binary_ins(codegen, block, QIT_SAR, value_type, biased, const_value(k));
+        return true;
     }
+    if (value_type != QVT_WORD) return false;
+
+    // The quotient ends up in a long, QBE lets longs be used wherever a word is expected
+    QBEValue wide = { .kind = QVK_TEMP, .name = fresh_temp(codegen) };
+    qbe_block_assign_ins(block, (QBEInstruction) {
+        .type = QIT_EXT,
+        .ext = { .type = QMT_WORD, .is_signed = is_signed, .value = x },
+    }, QVT_LONG, wide);
+    // Smallest l with c <= 2^l
+    const unsigned l = 64 - __builtin_clzll(c - 1);
+    if (is_signed) {
+        // |x| <= 2^31 and m <= 2^32, so the product fits. The quotient is rounded down,
+        // negative ones get 1 added back to round towards zero
+        const uint64_t m = (UINT64_C(1) << (31 + l)) / c + 1;
+        const QBEValue product = generate_binary_ins(codegen, block, QIT_MUL, QVT_LONG, wide, const_value(m));
+        const QBEValue quotient = generate_binary_ins(codegen, block, QIT_SAR, QVT_LONG, product, const_value(31 + l));
+        const QBEValue sign = generate_binary_ins(codegen, block, QIT_SAR, QVT_LONG, wide, const_value(63));
+        *result = generate_binary_ins(codegen, block, QIT_SUB, QVT_LONG, quotient, sign);
+        return true;
+    }
+    // m = 2^32 + low is a 33 bit number, x * m >> (32 + l) gets computed as
+    // ((x * low >> 32) + x) >> l so nothing overflows
+    const uint64_t low = (uint64_t)(((unsigned __int128)1 << (32 + l)) / c + 1 - ((unsigned __int128)1 << 32));
+    const QBEValue product = generate_binary_ins(codegen, block, QIT_MUL, QVT_LONG, wide, const_value(low));
+    const QBEValue high = generate_binary_ins(codegen, block, QIT_SHR, QVT_LONG, product, const_value(32));
+    const QBEValue sum = generate_binary_ins(codegen, block, QIT_ADD, QVT_LONG, high, wide);
+    *result = generate_binary_ins(codegen, block, QIT_SHR, QVT_LONG, sum, const_value(l));
+    return true;
 }
 
-QBEValue generate_expr(Codegen* codegen, const Expr* expr, QBEBlock* block) {
+QBEValue generate_expr(Codegen* codegen, const Expr* expr) {
+    if (expr->is_constant) return (QBEValue) { .kind = QVK_CONST, .const_i = expr->constant };
+    QBEBlock* block = codegen_block(codegen);
     switch (expr->type) {
         case ET_NUMBER: {
             return (QBEValue) {
@@ -53,202 +617,198 @@ QBEValue generate_expr(Codegen* codegen, const Expr* expr, QBEBlock* block) {
             };
         }
         case ET_VARIABLE: {
-            Variable v = {0};
-            for (ptrdiff_t i = 0; i < arrlen(codegen->variables); i++) {
-                if (strcmp(codegen->variables[i].name, expr->as.variable) == 0) {
-                    v = codegen->variables[i];
-                    break;
-                }
-            }
+            const ptrdiff_t symbol = expr->as.variable.symbol;
+            if (!codegen_in_memory(codegen, symbol)) return ssa_read(codegen, codegen->current, symbol);
             char* place = fresh_temp(codegen);
             QBEValue result = {.kind = QVK_TEMP, .name = place };
-            
+            // Lookups on an empty map allocate it
+            if (hmlen(codegen->unset_variables) > 0 && hmgeti(codegen->unset_variables, symbol) != -1) {
+                CodegenUnsetRead read = { .key = place, .value = { .symbol = symbol, .loc = codegen->loc } };
+                shputs(codegen->unset_reads, read);
+            }
+
             qbe_block_assign_ins(
                 block,
                 (QBEInstruction) {
-                    .type = QIT_LOADW,
-                    .loadw.name = v.ptr_name
+                    .type = QIT_LOAD,
+                    .load = {
+                        .type = codegen_memory_type(codegen, expr->value_type),
+                        .is_signed = type_is_signed(codegen->types, expr->value_type),
+                        .name = codegen_variable_slot(codegen, expr->as.variable.symbol)
+                    }
                 }, 
-                QVT_WORD, 
+                codegen_value_type(codegen, expr->value_type), 
                 result
             );
             return result;
         }
         case ET_BINARY: {
-            QBEValue left = generate_expr(codegen, expr->as.binary.left, block);
-            QBEValue right = generate_expr(codegen, expr->as.binary.right, block);
+            QBEValue left = generate_expr(codegen, expr->as.binary.left);
+            QBEValue right = generate_expr(codegen, expr->as.binary.right);
+            QBEValue folded;
+            if (codegen_fold_binary(codegen, expr, left, right, &folded)) return folded;
+            const TypeId operand_type = expr->as.binary.left->value_type;
+            const bool is_signed = type_is_signed(codegen->types, operand_type);
             switch (expr->as.binary.op) {
                 case '+': {
-                    char* name = fresh_temp(codegen);
-                    QBEValue result = { .kind = QVK_TEMP, .name = name };
-
-                    qbe_block_assign_ins(
-                        block,
-                        (QBEInstruction) {
-                            .type = QIT_ADD,
-                            .add = { .left = left, .right = right }, 
-                        }, 
-                        QVT_WORD, 
-                        result
-                    );
-                    return result; 
+                    return generate_arithmetic(codegen, block, (QBEInstruction) {
+                        .type = QIT_ADD,
+                        .add = { .left = left, .right = right }, 
+                    }, expr->value_type);
                 }
                 case '-': {
-                    char* name = fresh_temp(codegen);
-                    QBEValue result = { .kind = QVK_TEMP, .name = name };
-
-                    qbe_block_assign_ins(
-                        block,
-                        (QBEInstruction) {
-                            .type = QIT_SUB,
-                            .sub = { .left = left, .right = right }, 
-                        }, 
-                        QVT_WORD, 
-                        result
-                    );
-                    return result; 
+                    return generate_arithmetic(codegen, block, (QBEInstruction) {
+                        .type = QIT_SUB,
+                        .sub = { .left = left, .right = right }, 
+                    }, expr->value_type);
                 }
                 case '*': {
-                    char* name = fresh_temp(codegen);
-
-                    QBEValue result = { .kind = QVK_TEMP, .name = name };
-
-                    qbe_block_assign_ins(
-                        block,
-                        (QBEInstruction) {
-                            .type = QIT_MUL,
-                            .mul = { .left = left, .right = right }, 
-                        }, 
-                        QVT_WORD, 
-                        result
-                    );
-                    return result; 
+                    if (left.kind == QVK_CONST) {
+                        const QBEValue tmp = left;
+                        left = right;
+                        right = tmp;
+                    }
+                    if (right.kind == QVK_CONST) {
+                        QBEValue reduced;
+                        if (generate_mul_by_const(codegen, block, expr->value_type, left, right.const_i, &reduced)) return reduced;
+                    }
+                    return generate_arithmetic(codegen, block, (QBEInstruction) {
+                        .type = QIT_MUL,
+                        .mul = { .left = left, .right = right }, 
+                    }, expr->value_type);
                 }
                 case '/': {
-                    char* name = fresh_temp(codegen);
-
-                    QBEValue result = { .kind = QVK_TEMP, .name = name };
-
-                    qbe_block_assign_ins(
-                        block,
-                        (QBEInstruction) {
-                            .type = QIT_DIV,
-                            .div = { .left = left, .right = right }, 
-                        }, 
-                        QVT_WORD, 
-                        result
-                    );
-                    return result; 
+                    if (right.kind == QVK_CONST) {
+                        QBEValue reduced;
+                        if (generate_div_by_const(codegen, block, expr->value_type, left, right.const_i, &reduced)) return reduced;
+                    }
+                    return generate_arithmetic(codegen, block, (QBEInstruction) {
+                        .type = is_signed ? QIT_DIV : QIT_UDIV,
+                        .div = { .left = left, .right = right }, 
+                    }, expr->value_type);
                 }
                 case '>': {
                     char* name = fresh_temp(codegen);
                     QBEValue result = { .kind = QVK_TEMP, .name = name };
-                    return generate_cmp(block, QCT_GT, QVT_WORD, left, right, result);
+                    return generate_cmp(block, is_signed ? QCT_GT : QCT_UGT, codegen_value_type(codegen, operand_type), left, right, result);
                 }
                 case '<': {
                     char* name = fresh_temp(codegen);
                     QBEValue result = { .kind = QVK_TEMP, .name = name };
-                    return generate_cmp(block, QCT_LT, QVT_WORD, left, right, result);
+                    return generate_cmp(block, is_signed ? QCT_LT : QCT_ULT, codegen_value_type(codegen, operand_type), left, right, result);
                 }
             }
+            break;
+        }
+        case ET_CALL: {
+            QBECallArg* args = NULL;
+            for (ptrdiff_t i = 0; i < arrlen(expr->as.call.args); i++) {
+                const Expr* arg = expr->as.call.args[i];
+                QBECallArg call_arg = {
+                    .type = codegen_value_type(codegen, arg->value_type),
+                    .value = generate_expr(codegen, arg),
+                };
+                arrput(args, call_arg);
+            }
+            QBEValue result = { .kind = QVK_TEMP, .name = fresh_temp(codegen) };
+            qbe_block_assign_ins(codegen_block(codegen), (QBEInstruction) {
+                .type = QIT_CALL,
+                .call = { .name = expr->as.call.name, .args = args }
+            }, codegen_value_type(codegen, expr->value_type), result);
+            return result;
         }
     }
     assert(false && "Not implemented");
+    return (QBEValue) { 0 };
+}
+
+// Ends the current block with a branch on `cond`. Booleans are always 0 or 1 and comparisons
+// already produce one, so the value feeds jnz as is. A condition known at compile time
+// just jumps to the side it takes
+static void generate_cond(Codegen* codegen, const Expr* cond, ptrdiff_t then, ptrdiff_t otherwise) {
+    const QBEValue value = generate_expr(codegen, cond);
+    if (value.kind == QVK_CONST) {
+        codegen_jump(codegen, value.const_i != 0 ? then : otherwise);
+        return;
+    }
+    codegen_branch(codegen, value, then, otherwise);
 }
 
-void generate_statement(Codegen* codegen, Statement st, QBEBlock* block) {
+void generate_statement(Codegen* codegen, Statement st) {
+        // Code after a return or inside of a branch that's never taken can't run
+        if (codegen->current == -1) return;
+        codegen->loc = st.loc;
         switch (st.type) {
 
             case ST_FN_DEFINITION: {break;} // function codegen happens before any main func
             case ST_SET_VARIABLE: {
-                QBEValue new_value = generate_expr(codegen, st.as.var_assign.new_val, block);
+                QBEValue new_value = generate_expr(codegen, st.as.var_assign.new_val);
 
-                Variable v = {0};
-                for (ptrdiff_t i = 0; i < arrlen(codegen->variables); i++) {
-                    if (strcmp(codegen->variables[i].name, st.as.var_assign.var) == 0) {
-                        v = codegen->variables[i];
-                        break;
-                    }
+                if (!codegen_in_memory(codegen, st.as.var_assign.symbol)) {
+                    ssa_write(codegen, codegen->current, st.as.var_assign.symbol, new_value);
+                    return;
                 }
-                generate_store(block, new_value, v.ptr_name);
+                generate_store(codegen_block(codegen), new_value, codegen_memory_type(codegen, st.as.var_assign.value_type), codegen_variable_slot(codegen, st.as.var_assign.symbol));
                 return;
             }
             case ST_IF: {
-                QBEValue cond = generate_expr(codegen, st.as.if_st.cond, block);
-                char* then_label_name = fresh_label(codegen, "then_");
-                char* else_label_name = fresh_label(codegen, "else_");
-                char* cond_name = fresh_temp(codegen);
-                QBEValue cond_place = { .name = cond_name, .kind = QVK_TEMP };
-                const QBEValue zero = { .kind = QVK_CONST, .const_i = 0 };
-                generate_cmp(block, QCT_NE, QVT_WORD, cond, zero, cond_place);
-                qbe_block_push_ins(block, (QBEInstruction) {
-                    .type = QIT_JNZ,
-                    .jnz = {.then = then_label_name, .otherwise = else_label_name, .value = cond_place}
-                });
-                qbe_block_push_label(block, then_label_name);
-                for (ptrdiff_t i = 0; i < arrlen(st.as.if_st.body); i++) generate_statement(codegen, st.as.if_st.body[i], block);
-                qbe_block_push_label(block, else_label_name);
+                const ptrdiff_t then = codegen_new_block(codegen, fresh_label(codegen, "then_"));
+                const ptrdiff_t join = codegen_new_block(codegen, fresh_label(codegen, "else_"));
+                generate_cond(codegen, st.as.if_st.cond, then, join);
+                codegen_start_block(codegen, then);
+                ssa_seal(codegen, then);
+                codegen_push_scope(codegen);
+                for (ptrdiff_t i = 0; i < arrlen(st.as.if_st.body); i++) generate_statement(codegen, st.as.if_st.body[i]);
+                codegen_pop_scope(codegen);
+                codegen_start_block(codegen, join);
+                ssa_seal(codegen, join);
                 return;
             }
             case ST_RETURN: {
-                QBEValue value = generate_expr(codegen, st.as.ret, block);
-                qbe_block_push_ins(block, (QBEInstruction) {
+                QBEValue value = generate_expr(codegen, st.as.ret);
+                codegen_end_block(codegen, (QBEInstruction) {
                     .type = QIT_RETURN,
                     .ret = value
                 });
                 return;
             }
             case ST_VARIABLE_DEFINE: {
-                char* var_temp = fresh_temp(codegen);
-                QBEValue alloc_result = {.kind = QVK_TEMP, .name = var_temp };
-                
-                qbe_block_assign_ins(
-                    block, 
-                    (QBEInstruction) {
-                        .type = QIT_ALLOC8,
-                        .alloc8.size = 1
-                    }, 
-                    QVT_LONG, 
-                    alloc_result
-                );
-                
-                Variable v = {
-                    .name = strdup(st.as.var_def.name),
-                    .ptr_name = strdup(var_temp),
-                };
-                arrput(codegen->variables, v);
-                
-                QBEValue value = generate_expr(codegen, st.as.var_def.value, block);
-                
-                generate_store(block, value, var_temp);
+                // Every use is an immediate already, so the variable doesn't need a slot
+                if (st.as.var_def.is_folded) return;
+                if (st.as.var_def.value == NULL) {
+                    codegen_define_unset_variable(codegen, &st);
+                    return;
+                }
+                // The value can still refer to a variable this definition shadows
+                QBEValue value = generate_expr(codegen, st.as.var_def.value);
+
+                if (codegen->ssa) {
+                    codegen_set_variable_type(codegen, st.as.var_def.symbol, codegen_value_type(codegen, st.as.var_def.value_type));
+                    ssa_write(codegen, codegen->current, st.as.var_def.symbol, value);
+                    return;
+                }
+                generate_store(codegen_block(codegen), value, codegen_memory_type(codegen, st.as.var_def.value_type), codegen_define_variable(codegen, st.as.var_def.symbol));
                 return;
             }
             case ST_WHILE: {
-                char* header_label_name = fresh_label(codegen, "header_");
-                char* body_label_name = fresh_label(codegen, "body_");
-                char* out_label_name = fresh_label(codegen, "out_");
-                char* cond_name = fresh_temp(codegen);
-                qbe_block_push_label(block, header_label_name);
-                QBEValue cond = generate_expr(codegen, st.as.while_st.cond, block);
-                QBEValue cond_place = {
-                    .name = cond_name,
-                    .kind = QVK_TEMP,
-                };
-                const QBEValue zero = {
-                    .kind = QVK_CONST,
-                    .const_i = 0
-                };
-                generate_cmp(block, QCT_NE, QVT_WORD, cond, zero, cond_place);
-                qbe_block_push_ins(block, (QBEInstruction) {
-                    .type = QIT_JNZ,
-                    .jnz = {.then = body_label_name, .otherwise = out_label_name, .value = cond_place}
-                });
-                qbe_block_push_label(block, body_label_name);
-                for (ptrdiff_t i = 0; i < arrlen(st.as.if_st.body); i++) {
-                    generate_statement(codegen, st.as.if_st.body[i], block);
+                // Rotated, the condition is tested once before the loop and then at the bottom of
+                // every iteration, so going around the loop takes a single branch
+                const ptrdiff_t body = codegen_new_block(codegen, fresh_label(codegen, "body_"));
+                const ptrdiff_t out = codegen_new_block(codegen, fresh_label(codegen, "out_"));
+                codegen_collect_assigned(st.as.while_st.body, &codegen->blocks[body].assigned);
+                generate_cond(codegen, st.as.while_st.cond, body, out);
+                // Stays open until the branch back to it is generated
+                codegen_start_block(codegen, body);
+                codegen_push_scope(codegen);
+                for (ptrdiff_t i = 0; i < arrlen(st.as.while_st.body); i++) {
+                    generate_statement(codegen, st.as.while_st.body[i]);
                 }
-                qbe_block_push_ins(block, (QBEInstruction) { .type = QIT_JMP, .jmp = { .label = header_label_name } });
-                qbe_block_push_label(block, out_label_name);
+                codegen_pop_scope(codegen);
+                codegen->loc = st.loc;
+                if (codegen->current != -1) generate_cond(codegen, st.as.while_st.cond, body, out);
+                ssa_seal(codegen, body);
+                codegen_start_block(codegen, out);
+                ssa_seal(codegen, out);
                 return;
             }
             case ST_ERROR: {
@@ -258,10 +818,11 @@ void generate_statement(Codegen* codegen, Statement st, QBEBlock* block) {
         }
 }
 
-void generate_store(QBEBlock* block, QBEValue val, char* into) {
+void generate_store(QBEBlock* block, QBEValue val, QBEMemoryType type, char* into) {
     qbe_block_push_ins(block, (QBEInstruction) {
-        .type = QIT_STOREW,
-        .storew = {
+        .type = QIT_STORE,
+        .store = {
+            .type = type,
             .value = val,
             .name = into,
         }
@@ -6,25 +6,100 @@
 #include "parser.h"
 
 typedef struct {
-    char* name;
-    char* ptr_name;
-} Variable;
+    ptrdiff_t symbol;
+    QBEValue value;
+    QBEPhiArg* args;
+} CodegenPhi;
+
+// SSA construction state of a basic block of the function being generated
+typedef struct {
+    char* label;
+    // Index of its QBEBlock in the function, -1 until it's started (and forever if nothing reaches it).
+    // Phis get inserted at its start once the function is done
+    ptrdiff_t index;
+    ptrdiff_t* preds;
+    // Every pred is known, so reading a variable can look through all of them
+    bool sealed;
+    // Value every variable has at the end of the block so far, keyed by symbol
+    struct { ptrdiff_t key; QBEValue value; }* defs;
+    CodegenPhi* phis;
+    // Loop headers only: symbols assigned somewhere in the loop, the rest can be read
+    // from before the loop while the header isn't sealed yet
+    ptrdiff_t* assigned;
+} CodegenBlock;
+
+// Variable defined without a value. It lives in a stack slot of its own even when building SSA,
+// so definite assignment can tell which of its reads nothing might have been assigned before
+typedef struct {
+    const char* name;
+    Location loc;
+} CodegenUnsetVariable;
+
+// Read of an unset variable, keyed by the temporary the load defines
+typedef struct {
+    char* key;
+    struct {
+        ptrdiff_t symbol;
+        Location loc;
+    } value;
+} CodegenUnsetRead;
+
+typedef struct {
+    const char* message;
+    Location loc;
+    // The variable the error is about
+    CodegenUnsetVariable variable;
+} CodegenError;
 
 typedef struct {
     QBEModule mod;
-    QBEFunction* main;
-    QBEBlock* entry;
-    Variable* variables;
+    // Function being generated
+    QBEFunction* function;
+    const TypeTable* types;
+    // Stack slot of every variable of the function being generated, indexed by the symbol ids
+    // the type checker resolved
+    char** variables;
+    // Stack slots of the function being generated, the ones past `live_slots`
+    // belong to variables that went out of scope and get handed out again
+    char** slots;
+    size_t live_slots;
+    size_t* slot_scopes;
+    // Slots of the unset variables of the function being generated, never handed out again
+    char** unshared_slots;
+    struct { ptrdiff_t key; CodegenUnsetVariable value; }* unset_variables;
+    CodegenUnsetRead* unset_reads;
+    // Statement being generated, errors point at it
+    Location loc;
+    CodegenError* errors;
     size_t temp_count;
+    // Keep variables in temporaries instead of stack slots, the SSA form is built on the fly
+    // (Braun et al., "Simple and Efficient Construction of Static Single Assignment Form")
+    bool ssa;
+    CodegenBlock* blocks;
+    // Block being generated into, -1 right after a jump until the next label
+    ptrdiff_t current;
+    // Value type of every variable of the function being generated, indexed by symbol
+    QBEValueType* variable_types;
+    // Phis that turned out to be trivial and the value they stand for
+    QBESubstitution* phi_aliases;
 } Codegen;
 
 
 
+// Reports reads of variables that might not have been assigned yet to `errors`
 void generate_code(Codegen* codegen, Statement* sts);
-void generate_statement(Codegen* codegen, Statement st, QBEBlock* block);
-QBEValue generate_expr(Codegen* codegen, const Expr* expr, QBEBlock* block);
+void codegen_error_display(CodegenError error, char* file_content, char* input_name);
+void generate_statement(Codegen* codegen, Statement st);
+QBEValue generate_expr(Codegen* codegen, const Expr* expr);
 char* fresh_temp(Codegen* codegen);
 
-void generate_store(QBEBlock* block, QBEValue val, char* into);
+void codegen_push_scope(Codegen* codegen);
+void codegen_pop_scope(Codegen* codegen);
+
+// QBE temporaries are either words or longs, narrower integers live in words
+QBEValueType codegen_value_type(const Codegen* codegen, TypeId type);
+QBEMemoryType codegen_memory_type(const Codegen* codegen, TypeId type);
+
+void generate_store(QBEBlock* block, QBEValue val, QBEMemoryType type, char* into);
 QBEValue generate_cmp(QBEBlock* block, QBEComparisonType cmp, QBEValueType element_type, QBEValue l, QBEValue r, QBEValue into);
 #endif
@@ -0,0 +1,198 @@
+#include "const_eval.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "../extern/stb_ds.h"
+
+typedef struct {
+    bool assigned;
+    bool known;
+    // Known from literals and `const` declarations alone
+    bool is_strict;
+    uint64_t value;
+} ConstSymbol;
+
+typedef struct {
+    TypeChecker* checker;
+    // Indexed by symbol id
+    ConstSymbol* symbols;
+} ConstEval;
+
+static void const_mark_assignments(ConstEval* eval, const Statement* body) {
+    for (ptrdiff_t i = 0; i < arrlen(body); i++) {
+        const Statement* st = &body[i];
+        switch (st->type) {
+            case ST_SET_VARIABLE: eval->symbols[st->as.var_assign.symbol].assigned = true; break;
+            case ST_IF: const_mark_assignments(eval, st->as.if_st.body); break;
+            case ST_WHILE: const_mark_assignments(eval, st->as.while_st.body); break;
+            case ST_RETURN: case ST_VARIABLE_DEFINE: case ST_FN_DEFINITION: case ST_ERROR: break;
+        }
+    }
+}
+
+// Values are kept sign extended for signed types and zero extended for unsigned ones
+static bool const_in_range(const Type* type, uint64_t value) {
+    const unsigned bits = type->size * 8;
+    if (bits >= 64) return true;
+    if (type->is_signed) {
+        const int64_t max = (INT64_C(1) << (bits - 1)) - 1;
+        return (int64_t)value >= -max - 1 && (int64_t)value <= max;
+    }
+    return value <= (UINT64_MAX >> (64 - bits));
+}
+
+// Overflows and divisions by zero are only errors in `strict` expressions, the ones made of literals and
+// `const` declarations. Anything using a propagated `let` might sit in a branch that never runs, so it's
+// left for runtime instead
+static bool const_binary(ConstEval* eval, const Expr* expr, bool strict, uint64_t l, uint64_t r, uint64_t* result) {
+    const Type* type = type_get(eval->checker->types, expr->as.binary.left->value_type);
+    if (type->kind != TYK_INT) return false;
+    const bool is_signed = type->is_signed;
+    bool overflow = false;
+    switch (expr->as.binary.op) {
+        case '+': {
+            overflow = is_signed ? __builtin_add_overflow((int64_t)l, (int64_t)r, (int64_t*)result)
+                                 : __builtin_add_overflow(l, r, result);
+            break;
+        }
+        case '-': {
+            overflow = is_signed ? __builtin_sub_overflow((int64_t)l, (int64_t)r, (int64_t*)result)
+                                 : __builtin_sub_overflow(l, r, result);
+            break;
+        }
+        case '*': {
+            overflow = is_signed ? __builtin_mul_overflow((int64_t)l, (int64_t)r, (int64_t*)result)
+                                 : __builtin_mul_overflow(l, r, result);
+            break;
+        }
+        case '/': {
+            if (r == 0) {
+                if (strict) checker_error(eval->checker, eval->checker->loc, "Division by zero in constant expression");
+                return false;
+            }
+            if (is_signed) {
+                overflow = (int64_t)l == INT64_MIN && (int64_t)r == -1;
+                if (!overflow) *result = (uint64_t)((int64_t)l / (int64_t)r);
+            } else {
+                *result = l / r;
+            }
+            break;
+        }
+        case '>': {
+            *result = is_signed ? (int64_t)l > (int64_t)r : l > r;
+            return true;
+        }
+        case '<': {
+            *result = is_signed ? (int64_t)l < (int64_t)r : l < r;
+            return true;
+        }
+        default: return false;
+    }
+    if (overflow || !const_in_range(type, *result)) {
+        if (strict) checker_error(eval->checker, eval->checker->loc, "Constant expression overflows its type");
+        return false;
+    }
+    return true;
+}
+
+static void const_fold(ConstEval* eval, Expr* expr);
+
+// `strict` gets cleared when the value depends on a `let`
+static bool const_eval_expr(ConstEval* eval, Expr* expr, bool* strict) {
+    expr->is_constant = false;
+    switch (expr->type) {
+        case ET_NUMBER: {
+            expr->constant = expr->as.number;
+            break;
+        }
+        case ET_BOOL: {
+            expr->constant = expr->as.boolean;
+            break;
+        }
+        case ET_VARIABLE: {
+            const ConstSymbol* symbol = &eval->symbols[expr->as.variable.symbol];
+            if (!symbol->known) return false;
+            if (!symbol->is_strict) *strict = false;
+            expr->constant = symbol->value;
+            break;
+        }
+        case ET_BINARY: {
+            // Both sides get folded even if the other one can't be
+            const bool left = const_eval_expr(eval, expr->as.binary.left, strict);
+            const bool right = const_eval_expr(eval, expr->as.binary.right, strict);
+            if (!left || !right) return false;
+            const uint64_t l = expr->as.binary.left->constant;
+            const uint64_t r = expr->as.binary.right->constant;
+            if (!const_binary(eval, expr, *strict, l, r, &expr->constant)) return false;
+            break;
+        }
+        case ET_CALL: {
+            // Calls are left to the inliner, their args can still be folded
+            for (ptrdiff_t i = 0; i < arrlen(expr->as.call.args); i++) const_fold(eval, expr->as.call.args[i]);
+            return false;
+        }
+    }
+    expr->is_constant = true;
+    return true;
+}
+
+static void const_fold(ConstEval* eval, Expr* expr) {
+    bool strict = true;
+    const_eval_expr(eval, expr, &strict);
+}
+
+static void const_eval_body(ConstEval* eval, Statement* body) {
+    for (ptrdiff_t i = 0; i < arrlen(body); i++) {
+        Statement* st = &body[i];
+        eval->checker->loc = st->loc;
+        switch (st->type) {
+            case ST_VARIABLE_DEFINE: {
+                const ptrdiff_t error_count = arrlen(eval->checker->errors);
+                bool strict = true;
+                const bool known = st->as.var_def.value != NULL && const_eval_expr(eval, st->as.var_def.value, &strict);
+                ConstSymbol* symbol = &eval->symbols[st->as.var_def.symbol];
+                // The definition is the only value the variable ever has
+                st->as.var_def.is_folded = known && !symbol->assigned;
+                if (st->as.var_def.is_folded) {
+                    symbol->known = true;
+                    symbol->is_strict = strict && st->as.var_def.is_const;
+                    symbol->value = st->as.var_def.value->constant;
+                }
+                if (st->as.var_def.is_const && !known && arrlen(eval->checker->errors) == error_count) {
+                    checker_error(eval->checker, st->loc, "`const` value has to be known at compile time");
+                }
+                break;
+            }
+            case ST_SET_VARIABLE: {
+                const_fold(eval, st->as.var_assign.new_val);
+                break;
+            }
+            case ST_RETURN: {
+                const_fold(eval, st->as.ret);
+                break;
+            }
+            case ST_IF: {
+                const_fold(eval, st->as.if_st.cond);
+                const_eval_body(eval, st->as.if_st.body);
+                break;
+            }
+            case ST_WHILE: {
+                const_fold(eval, st->as.while_st.cond);
+                const_eval_body(eval, st->as.while_st.body);
+                break;
+            }
+            case ST_FN_DEFINITION: case ST_ERROR: break;
+        }
+    }
+}
+
+void const_eval(TypeChecker* checker, Statement* body, ptrdiff_t symbol_count) {
+    ConstEval eval = {
+        .checker = checker,
+        .symbols = calloc(symbol_count + 1, sizeof(ConstSymbol)),
+    };
+    assert(eval.symbols);
+    const_mark_assignments(&eval, body);
+    const_eval_body(&eval, body);
+    free(eval.symbols);
+}
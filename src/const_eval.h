@@ -0,0 +1,15 @@
+#ifndef CONST_EVAL_H
+#define CONST_EVAL_H
+
+#include "parser.h"
+#include "type_checker.h"
+
+// Folds every expression whose value is known at compile time: literals, arithmetic on them
+// and variables that never get assigned after their definition. Overflows and divisions by zero
+// of literals and `const` values are reported as errors into `checker`, ones involving a `let`
+// are left for runtime.
+// `body` has to be free of type errors, `symbol_count` is the amount of symbols defined in it.
+// Function definitions inside of `body` are skipped, they get evaluated on their own.
+void const_eval(TypeChecker* checker, Statement* body, ptrdiff_t symbol_count);
+
+#endif
@@ -0,0 +1,373 @@
+#include "dataflow.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../extern/stb_ds.h"
+
+BitSet bitset_new(size_t bit_count) {
+    BitSet set = {
+        .words = calloc((bit_count + 63) / 64 + 1, sizeof(uint64_t)),
+        .bit_count = bit_count,
+    };
+    assert(set.words);
+    return set;
+}
+
+void bitset_free(BitSet* set) {
+    free(set->words);
+    set->words = NULL;
+}
+
+static size_t bitset_word_count(const BitSet* set) {
+    return (set->bit_count + 63) / 64;
+}
+
+void bitset_set(BitSet* set, size_t bit) {
+    assert(bit < set->bit_count);
+    set->words[bit / 64] |= UINT64_C(1) << (bit % 64);
+}
+
+void bitset_clear(BitSet* set, size_t bit) {
+    assert(bit < set->bit_count);
+    set->words[bit / 64] &= ~(UINT64_C(1) << (bit % 64));
+}
+
+bool bitset_test(const BitSet* set, size_t bit) {
+    assert(bit < set->bit_count);
+    return (set->words[bit / 64] >> (bit % 64)) & 1;
+}
+
+void bitset_fill(BitSet* set) {
+    const size_t words = bitset_word_count(set);
+    if (words == 0) return;
+    memset(set->words, 0xff, words * sizeof(uint64_t));
+    // Bits past the end stay clear so comparing sets word by word works
+    if (set->bit_count % 64 != 0) set->words[words - 1] = (UINT64_C(1) << (set->bit_count % 64)) - 1;
+}
+
+void bitset_copy(BitSet* dst, const BitSet* src) {
+    assert(dst->bit_count == src->bit_count);
+    memcpy(dst->words, src->words, bitset_word_count(src) * sizeof(uint64_t));
+}
+
+bool bitset_union(BitSet* dst, const BitSet* src) {
+    assert(dst->bit_count == src->bit_count);
+    bool changed = false;
+    for (size_t i = 0; i < bitset_word_count(dst); i++) {
+        const uint64_t word = dst->words[i] | src->words[i];
+        changed |= word != dst->words[i];
+        dst->words[i] = word;
+    }
+    return changed;
+}
+
+bool bitset_intersect(BitSet* dst, const BitSet* src) {
+    assert(dst->bit_count == src->bit_count);
+    bool changed = false;
+    for (size_t i = 0; i < bitset_word_count(dst); i++) {
+        const uint64_t word = dst->words[i] & src->words[i];
+        changed |= word != dst->words[i];
+        dst->words[i] = word;
+    }
+    return changed;
+}
+
+bool bitset_difference(BitSet* dst, const BitSet* src) {
+    assert(dst->bit_count == src->bit_count);
+    bool changed = false;
+    for (size_t i = 0; i < bitset_word_count(dst); i++) {
+        const uint64_t word = dst->words[i] & ~src->words[i];
+        changed |= word != dst->words[i];
+        dst->words[i] = word;
+    }
+    return changed;
+}
+
+static BitSet* bitsets_new(size_t count, size_t bit_count) {
+    BitSet* sets = NULL;
+    for (size_t i = 0; i < count; i++) arrput(sets, bitset_new(bit_count));
+    return sets;
+}
+
+static void bitsets_free(BitSet** sets) {
+    for (ptrdiff_t i = 0; i < arrlen(*sets); i++) bitset_free(&(*sets)[i]);
+    arrfree(*sets);
+}
+
+// Meet over the blocks flowing into `b`, without any the identity of the meet is left in `into`
+static void dataflow_meet(const DataflowProblem* problem, const ptrdiff_t* from, const BitSet* values, BitSet* into) {
+    if (problem->meet == DF_INTERSECTION) bitset_fill(into);
+    else memset(into->words, 0, bitset_word_count(into) * sizeof(uint64_t));
+    for (ptrdiff_t i = 0; i < arrlen(from); i++) {
+        if (problem->meet == DF_INTERSECTION) bitset_intersect(into, &values[from[i]]);
+        else bitset_union(into, &values[from[i]]);
+    }
+}
+
+DataflowResult dataflow_solve(const Cfg* cfg, const DataflowProblem* problem) {
+    const ptrdiff_t n = arrlen(cfg->function->blocks);
+    const bool forward = problem->direction == DF_FORWARD;
+    DataflowResult result = {
+        .in = bitsets_new(n, problem->bit_count),
+        .out = bitsets_new(n, problem->bit_count),
+    };
+    // Values flowing into a block (`in` for forward problems) and out of it
+    BitSet* entering = forward ? result.in : result.out;
+    BitSet* leaving = forward ? result.out : result.in;
+    if (problem->meet == DF_INTERSECTION) {
+        for (ptrdiff_t b = 0; b < n; b++) bitset_fill(&leaving[b]);
+    }
+
+    // Every block is on the worklist once up front, after that only blocks whose inputs changed
+    ptrdiff_t* worklist = NULL;
+    bool* queued = calloc(n + 1, sizeof(bool));
+    assert(queued);
+    for (ptrdiff_t i = n - 1; i >= 0; i--) {
+        arrput(worklist, forward ? cfg->order[i] : cfg->order[n - 1 - i]);
+        queued[arrlast(worklist)] = true;
+    }
+
+    BitSet next = bitset_new(problem->bit_count);
+    while (arrlen(worklist) > 0) {
+        const ptrdiff_t b = arrpop(worklist);
+        queued[b] = false;
+        const QBEBlock* block = &cfg->function->blocks[b];
+        const ptrdiff_t* from = forward ? block->preds : block->succs;
+        const ptrdiff_t* to = forward ? block->succs : block->preds;
+
+        dataflow_meet(problem, from, leaving, &entering[b]);
+        const bool boundary = forward ? b == 0 : arrlen(block->succs) == 0;
+        if (boundary) {
+            if (arrlen(from) == 0) bitset_copy(&entering[b], &problem->boundary);
+            else if (problem->meet == DF_INTERSECTION) bitset_intersect(&entering[b], &problem->boundary);
+            else bitset_union(&entering[b], &problem->boundary);
+        }
+
+        bitset_copy(&next, &entering[b]);
+        bitset_difference(&next, &problem->kill[b]);
+        bitset_union(&next, &problem->gen[b]);
+        if (memcmp(next.words, leaving[b].words, bitset_word_count(&next) * sizeof(uint64_t)) == 0) continue;
+        bitset_copy(&leaving[b], &next);
+
+        for (ptrdiff_t i = 0; i < arrlen(to); i++) {
+            if (queued[to[i]]) continue;
+            queued[to[i]] = true;
+            arrput(worklist, to[i]);
+        }
+    }
+
+    bitset_free(&next);
+    free(queued);
+    arrfree(worklist);
+    return result;
+}
+
+void dataflow_problem_free(DataflowProblem* problem) {
+    bitsets_free(&problem->gen);
+    bitsets_free(&problem->kill);
+    bitset_free(&problem->boundary);
+}
+
+void dataflow_result_free(DataflowResult* result) {
+    bitsets_free(&result->in);
+    bitsets_free(&result->out);
+}
+
+static void temp_ids_add(TempIds* temps, const char* name) {
+    if (shgeti(temps->ids, name) != -1) return;
+    shput(temps->ids, (char*)name, arrlen(temps->names));
+    arrput(temps->names, name);
+}
+
+static void temp_ids_add_uses(TempIds* temps, const char* uses[QBE_MAX_USES], size_t use_count) {
+    for (size_t u = 0; u < use_count; u++) temp_ids_add(temps, uses[u]);
+}
+
+TempIds temp_ids_build(const QBEFunction* function) {
+    TempIds temps = {0};
+    const char* uses[QBE_MAX_USES];
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        const QBEBlock* block = &function->blocks[b];
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            const QBEStatement* st = &block->statements[i];
+            if (st->type == QST_ASSIGN) temp_ids_add(&temps, st->assign.value.name);
+            if (st->type == QST_ASSIGN && st->assign.instruction.type == QIT_PHI) {
+                const QBEPhiArg* args = st->assign.instruction.phi.args;
+                for (ptrdiff_t a = 0; a < arrlen(args); a++) {
+                    if (args[a].value.kind == QVK_TEMP) temp_ids_add(&temps, args[a].value.name);
+                }
+            }
+            // Params are only ever used
+            temp_ids_add_uses(&temps, uses, qbe_statement_uses(st, uses));
+        }
+        temp_ids_add_uses(&temps, uses, qbe_instruction_uses(&block->jump, uses));
+    }
+    return temps;
+}
+
+ptrdiff_t temp_ids_get(const TempIds* temps, const char* name) {
+    // shgeti writes the index of the lookup into the map header, not into the entries
+    TempId* ids = temps->ids;
+    const ptrdiff_t i = shgeti(ids, name);
+    return i == -1 ? -1 : ids[i].value;
+}
+
+void temp_ids_free(TempIds* temps) {
+    shfree(temps->ids);
+    arrfree(temps->names);
+}
+
+static DataflowProblem dataflow_problem_new(const Cfg* cfg, DataflowDirection direction, DataflowMeet meet, size_t bit_count) {
+    return (DataflowProblem) {
+        .direction = direction,
+        .meet = meet,
+        .bit_count = bit_count,
+        .gen = bitsets_new(arrlen(cfg->function->blocks), bit_count),
+        .kill = bitsets_new(arrlen(cfg->function->blocks), bit_count),
+        .boundary = bitset_new(bit_count),
+    };
+}
+
+// Phi args coming from `b` are read at its very end, after everything it defines
+static void liveness_phi_uses(const Cfg* cfg, const TempIds* temps, ptrdiff_t b, BitSet* gen) {
+    const QBEBlock* block = &cfg->function->blocks[b];
+    for (ptrdiff_t s = 0; s < arrlen(block->succs); s++) {
+        const QBEBlock* succ = &cfg->function->blocks[block->succs[s]];
+        for (ptrdiff_t i = 0; i < arrlen(succ->statements); i++) {
+            const QBEStatement* st = &succ->statements[i];
+            // Phis are all at the start
+            if (st->type != QST_ASSIGN || st->assign.instruction.type != QIT_PHI) break;
+            const QBEPhiArg* args = st->assign.instruction.phi.args;
+            for (ptrdiff_t a = 0; a < arrlen(args); a++) {
+                if (args[a].value.kind != QVK_TEMP || strcmp(args[a].label, block->name) != 0) continue;
+                bitset_set(gen, temp_ids_get(temps, args[a].value.name));
+            }
+        }
+    }
+}
+
+static void liveness_add_uses(const TempIds* temps, const char* uses[QBE_MAX_USES], size_t use_count, BitSet* gen) {
+    for (size_t u = 0; u < use_count; u++) bitset_set(gen, temp_ids_get(temps, uses[u]));
+}
+
+Liveness liveness_compute(const Cfg* cfg) {
+    Liveness liveness = { .temps = temp_ids_build(cfg->function) };
+    DataflowProblem problem = dataflow_problem_new(cfg, DF_BACKWARD, DF_UNION, arrlen(liveness.temps.names));
+
+    const char* uses[QBE_MAX_USES];
+    for (ptrdiff_t b = 0; b < arrlen(cfg->function->blocks); b++) {
+        const QBEBlock* block = &cfg->function->blocks[b];
+        liveness_phi_uses(cfg, &liveness.temps, b, &problem.gen[b]);
+        liveness_add_uses(&liveness.temps, uses, qbe_instruction_uses(&block->jump, uses), &problem.gen[b]);
+        // Walking backwards, gen ends up with the uses that aren't preceded by a definition in the block
+        for (ptrdiff_t i = arrlen(block->statements) - 1; i >= 0; i--) {
+            const QBEStatement* st = &block->statements[i];
+            if (st->type == QST_ASSIGN) {
+                const ptrdiff_t def = temp_ids_get(&liveness.temps, st->assign.value.name);
+                bitset_set(&problem.kill[b], def);
+                bitset_clear(&problem.gen[b], def);
+            }
+            liveness_add_uses(&liveness.temps, uses, qbe_statement_uses(st, uses), &problem.gen[b]);
+        }
+    }
+
+    liveness.result = dataflow_solve(cfg, &problem);
+    dataflow_problem_free(&problem);
+    return liveness;
+}
+
+void liveness_free(Liveness* liveness) {
+    temp_ids_free(&liveness->temps);
+    dataflow_result_free(&liveness->result);
+}
+
+// The temporary (or slot) `st` defines, -1 if it doesn't define anything.
+// Allocating a slot doesn't count, what's in it only gets defined by storing into it
+static ptrdiff_t statement_definition(const TempIds* temps, const QBEStatement* st) {
+    if (st->type == QST_ASSIGN && st->assign.instruction.type == QIT_ALLOC8) return -1;
+    if (st->type == QST_ASSIGN) return temp_ids_get(temps, st->assign.value.name);
+    if (st->type == QST_THROWAWAY && st->throwaway.type == QIT_STORE) return temp_ids_get(temps, st->throwaway.store.name);
+    return -1;
+}
+
+ReachingDefinitions reaching_definitions_compute(const Cfg* cfg) {
+    ReachingDefinitions defs = { .temps = temp_ids_build(cfg->function) };
+    const ptrdiff_t temp_count = arrlen(defs.temps.names);
+    // Definitions of every temporary
+    ptrdiff_t** defs_of = calloc(temp_count + 1, sizeof(ptrdiff_t*));
+    assert(defs_of);
+    for (ptrdiff_t b = 0; b < arrlen(cfg->function->blocks); b++) {
+        const QBEBlock* block = &cfg->function->blocks[b];
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            const ptrdiff_t defined = statement_definition(&defs.temps, &block->statements[i]);
+            if (defined == -1) continue;
+            arrput(defs_of[defined], arrlen(defs.statements));
+            const StatementRef ref = { .block = b, .index = i };
+            arrput(defs.statements, ref);
+            arrput(defs.defined, defined);
+        }
+    }
+
+    DataflowProblem problem = dataflow_problem_new(cfg, DF_FORWARD, DF_UNION, arrlen(defs.statements));
+    // Definitions are numbered block by block in statement order
+    for (ptrdiff_t def = 0; def < arrlen(defs.statements); def++) {
+        const ptrdiff_t b = defs.statements[def].block;
+        const ptrdiff_t* others = defs_of[defs.defined[def]];
+        for (ptrdiff_t i = 0; i < arrlen(others); i++) {
+            bitset_set(&problem.kill[b], others[i]);
+            bitset_clear(&problem.gen[b], others[i]);
+        }
+        bitset_set(&problem.gen[b], def);
+    }
+
+    defs.result = dataflow_solve(cfg, &problem);
+    dataflow_problem_free(&problem);
+    for (ptrdiff_t i = 0; i < temp_count; i++) arrfree(defs_of[i]);
+    free(defs_of);
+    return defs;
+}
+
+void reaching_definitions_free(ReachingDefinitions* defs) {
+    temp_ids_free(&defs->temps);
+    arrfree(defs->statements);
+    arrfree(defs->defined);
+    dataflow_result_free(&defs->result);
+}
+
+StatementRef* definite_assignment_unassigned(const Cfg* cfg) {
+    TempIds temps = temp_ids_build(cfg->function);
+    DataflowProblem problem = dataflow_problem_new(cfg, DF_FORWARD, DF_INTERSECTION, arrlen(temps.names));
+    for (ptrdiff_t b = 0; b < arrlen(cfg->function->blocks); b++) {
+        const QBEBlock* block = &cfg->function->blocks[b];
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            const QBEStatement* st = &block->statements[i];
+            if (st->type == QST_THROWAWAY && st->throwaway.type == QIT_STORE) {
+                bitset_set(&problem.gen[b], temp_ids_get(&temps, st->throwaway.store.name));
+            }
+        }
+    }
+    DataflowResult result = dataflow_solve(cfg, &problem);
+
+    StatementRef* unassigned = NULL;
+    BitSet assigned = bitset_new(arrlen(temps.names));
+    for (ptrdiff_t b = 0; b < arrlen(cfg->function->blocks); b++) {
+        const QBEBlock* block = &cfg->function->blocks[b];
+        bitset_copy(&assigned, &result.in[b]);
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            const QBEStatement* st = &block->statements[i];
+            if (st->type == QST_THROWAWAY && st->throwaway.type == QIT_STORE) {
+                bitset_set(&assigned, temp_ids_get(&temps, st->throwaway.store.name));
+            }
+            if (st->type == QST_ASSIGN && st->assign.instruction.type == QIT_LOAD &&
+                !bitset_test(&assigned, temp_ids_get(&temps, st->assign.instruction.load.name))) {
+                arrput(unassigned, ((StatementRef) { .block = b, .index = i }));
+            }
+        }
+    }
+
+    bitset_free(&assigned);
+    dataflow_result_free(&result);
+    dataflow_problem_free(&problem);
+    temp_ids_free(&temps);
+    return unassigned;
+}
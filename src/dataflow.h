@@ -0,0 +1,110 @@
+#ifndef DATAFLOW_H
+#define DATAFLOW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cfg.h"
+
+typedef struct {
+    uint64_t* words;
+    size_t bit_count;
+} BitSet;
+
+BitSet bitset_new(size_t bit_count);
+void bitset_free(BitSet* set);
+void bitset_set(BitSet* set, size_t bit);
+void bitset_clear(BitSet* set, size_t bit);
+bool bitset_test(const BitSet* set, size_t bit);
+// Sets every bit below bit_count
+void bitset_fill(BitSet* set);
+void bitset_copy(BitSet* dst, const BitSet* src);
+// The operations below return whether `dst` changed
+bool bitset_union(BitSet* dst, const BitSet* src);
+bool bitset_intersect(BitSet* dst, const BitSet* src);
+bool bitset_difference(BitSet* dst, const BitSet* src);
+
+typedef enum {
+    DF_FORWARD,
+    DF_BACKWARD,
+} DataflowDirection;
+
+typedef enum {
+    DF_UNION,
+    DF_INTERSECTION,
+} DataflowMeet;
+
+// A gen/kill problem over a Cfg. For forward problems out = gen | (in & ~kill),
+// backward ones flip in and out.
+typedef struct {
+    DataflowDirection direction;
+    DataflowMeet meet;
+    size_t bit_count;
+    // One per block of the Cfg
+    BitSet* gen;
+    BitSet* kill;
+    // Flows into the entry block (forward) or out of the blocks without successors (backward)
+    BitSet boundary;
+} DataflowProblem;
+
+typedef struct {
+    // One per block of the Cfg
+    BitSet* in;
+    BitSet* out;
+} DataflowResult;
+
+// Worklist solver, blocks are visited in reverse postorder for forward problems and postorder
+// for backward ones so most problems settle in a couple of passes
+DataflowResult dataflow_solve(const Cfg* cfg, const DataflowProblem* problem);
+void dataflow_problem_free(DataflowProblem* problem);
+void dataflow_result_free(DataflowResult* result);
+
+typedef struct {
+    char* key;
+    ptrdiff_t value;
+} TempId;
+
+// Dense ids for the temporaries of a QBEFunction (stack slots included) so they can be used as bits
+typedef struct {
+    TempId* ids;
+    const char** names;
+} TempIds;
+
+TempIds temp_ids_build(const QBEFunction* function);
+// Returns -1 for names that don't appear in the function
+ptrdiff_t temp_ids_get(const TempIds* temps, const char* name);
+void temp_ids_free(TempIds* temps);
+
+// Temporaries live at the start (in) and the end (out) of every block
+typedef struct {
+    TempIds temps;
+    DataflowResult result;
+} Liveness;
+
+Liveness liveness_compute(const Cfg* cfg);
+void liveness_free(Liveness* liveness);
+
+typedef struct {
+    ptrdiff_t block;
+    ptrdiff_t index;
+} StatementRef;
+
+// Every assignment of a temporary (besides allocating a slot) and every store into a slot is a definition,
+// the bits are indices into `statements`
+typedef struct {
+    TempIds temps;
+    // Where every definition is
+    StatementRef* statements;
+    // Temporary (or slot) each definition defines
+    ptrdiff_t* defined;
+    DataflowResult result;
+} ReachingDefinitions;
+
+ReachingDefinitions reaching_definitions_compute(const Cfg* cfg);
+void reaching_definitions_free(ReachingDefinitions* defs);
+
+// Returns every load from a stack slot that nothing might have been stored into on some path leading
+// to it, in block order
+StatementRef* definite_assignment_unassigned(const Cfg* cfg);
+
+#endif
@@ -0,0 +1,211 @@
+#include "passes.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "../extern/stb_ds.h"
+#include "dataflow.h"
+
+typedef struct {
+    const QBEFunction* function;
+    // Only computed when the function stores anything, its temporary ids are the ones used everywhere
+    // else then
+    bool has_stores;
+    ReachingDefinitions reaching;
+    TempIds temps;
+    // Statement defining every temporary, block is -1 for params
+    StatementRef* defs;
+    // Definitions (indices into reaching.statements) storing into every slot
+    ptrdiff_t** stores_of;
+    // For every load of every block the last store into its slot before it in the block, -1 if there's none
+    ptrdiff_t** store_before;
+    // One flag per statement of every block
+    bool** live;
+    StatementRef* worklist;
+} Dce;
+
+static void dce_mark(Dce* dce, StatementRef ref) {
+    if (ref.block == -1 || dce->live[ref.block][ref.index]) return;
+    dce->live[ref.block][ref.index] = true;
+    arrput(dce->worklist, ref);
+}
+
+static void dce_mark_temp(Dce* dce, const char* name) {
+    const ptrdiff_t id = temp_ids_get(&dce->temps, name);
+    assert(id != -1);
+    dce_mark(dce, dce->defs[id]);
+}
+
+static void dce_mark_uses(Dce* dce, const QBEInstruction* ins) {
+    const char* uses[QBE_MAX_USES];
+    const size_t count = qbe_instruction_uses(ins, uses);
+    for (size_t u = 0; u < count; u++) dce_mark_temp(dce, uses[u]);
+}
+
+static bool is_store(const QBEStatement* st) {
+    return st->type == QST_THROWAWAY && st->throwaway.type == QIT_STORE;
+}
+
+static bool is_load(const QBEStatement* st) {
+    return st->type == QST_ASSIGN && st->assign.instruction.type == QIT_LOAD;
+}
+
+// Stores per slot and the store every load sees from its own block, one pass over the function
+static void dce_index_stores(Dce* dce) {
+    const QBEFunction* function = dce->function;
+    const ReachingDefinitions* reaching = &dce->reaching;
+    const ptrdiff_t temp_count = arrlen(dce->temps.names);
+    dce->stores_of = calloc(temp_count + 1, sizeof(ptrdiff_t*));
+    dce->store_before = calloc(arrlen(function->blocks) + 1, sizeof(ptrdiff_t*));
+    // Only valid for the block the store is in
+    StatementRef* last_store = malloc((temp_count + 1) * sizeof(StatementRef));
+    assert(dce->stores_of && dce->store_before && last_store);
+    for (ptrdiff_t t = 0; t < temp_count; t++) last_store[t] = (StatementRef) { .block = -1, .index = -1 };
+    for (ptrdiff_t d = 0; d < arrlen(reaching->statements); d++) {
+        const StatementRef ref = reaching->statements[d];
+        if (is_store(&function->blocks[ref.block].statements[ref.index])) arrput(dce->stores_of[reaching->defined[d]], d);
+    }
+
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        const QBEBlock* block = &function->blocks[b];
+        dce->store_before[b] = malloc((arrlen(block->statements) + 1) * sizeof(ptrdiff_t));
+        assert(dce->store_before[b]);
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            const QBEStatement* st = &block->statements[i];
+            dce->store_before[b][i] = -1;
+            if (is_store(st)) {
+                last_store[temp_ids_get(&dce->temps, st->throwaway.store.name)] = (StatementRef) { .block = b, .index = i };
+            } else if (is_load(st)) {
+                const StatementRef store = last_store[temp_ids_get(&dce->temps, st->assign.instruction.load.name)];
+                if (store.block == b) dce->store_before[b][i] = store.index;
+            }
+        }
+    }
+    free(last_store);
+}
+
+// A live load brings along the stores into its slot that can reach it: the last one before it in its
+// block or, if there's none, the ones reaching the start of the block
+static void dce_mark_reaching_stores(Dce* dce, StatementRef load, const char* slot) {
+    if (!dce->has_stores) return;
+    const ptrdiff_t before = dce->store_before[load.block][load.index];
+    if (before != -1) {
+        dce_mark(dce, (StatementRef) { .block = load.block, .index = before });
+        return;
+    }
+    const ReachingDefinitions* reaching = &dce->reaching;
+    const ptrdiff_t* stores = dce->stores_of[temp_ids_get(&dce->temps, slot)];
+    for (ptrdiff_t s = 0; s < arrlen(stores); s++) {
+        if (bitset_test(&reaching->result.in[load.block], stores[s])) dce_mark(dce, reaching->statements[stores[s]]);
+    }
+}
+
+static void dce_process(Dce* dce, StatementRef ref) {
+    const QBEStatement* st = &dce->function->blocks[ref.block].statements[ref.index];
+    const QBEInstruction* ins = st->type == QST_ASSIGN ? &st->assign.instruction : &st->throwaway;
+    dce_mark_uses(dce, ins);
+    switch (ins->type) {
+        case QIT_PHI: {
+            for (ptrdiff_t a = 0; a < arrlen(ins->phi.args); a++) {
+                if (ins->phi.args[a].value.kind == QVK_TEMP) dce_mark_temp(dce, ins->phi.args[a].value.name);
+            }
+            break;
+        }
+        case QIT_LOAD: dce_mark_reaching_stores(dce, ref, ins->load.name); break;
+        default: {}
+    }
+}
+
+// Removes the statements that aren't marked and frees what they own
+static size_t dce_sweep(QBEFunction* function, bool** live) {
+    size_t changes = 0;
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        QBEBlock* block = &function->blocks[b];
+        ptrdiff_t kept = 0;
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            QBEStatement* st = &block->statements[i];
+            if (live[b][i]) {
+                block->statements[kept++] = *st;
+                continue;
+            }
+            if (st->type == QST_ASSIGN) {
+                free(st->assign.value.name);
+                if (st->assign.instruction.type == QIT_PHI) arrfree(st->assign.instruction.phi.args);
+            }
+            changes++;
+        }
+        if (kept < arrlen(block->statements)) arrsetlen(block->statements, kept);
+    }
+    return changes;
+}
+
+static bool has_stores(const QBEFunction* function) {
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        for (ptrdiff_t i = 0; i < arrlen(function->blocks[b].statements); i++) {
+            if (is_store(&function->blocks[b].statements[i])) return true;
+        }
+    }
+    return false;
+}
+
+size_t dead_code_elimination(QBEFunction* function) {
+    Dce dce = { .function = function, .has_stores = has_stores(function) };
+    // Without stores every load reads a slot nothing was put into, there's nothing to keep alive for them
+    if (dce.has_stores) {
+        Cfg cfg = cfg_build(function);
+        dce.reaching = reaching_definitions_compute(&cfg);
+        cfg_free(&cfg);
+        dce.temps = dce.reaching.temps;
+        dce_index_stores(&dce);
+    } else {
+        dce.temps = temp_ids_build(function);
+    }
+    const ptrdiff_t temp_count = arrlen(dce.temps.names);
+    dce.defs = malloc((temp_count + 1) * sizeof(StatementRef));
+    dce.live = calloc(arrlen(function->blocks) + 1, sizeof(bool*));
+    assert(dce.defs && dce.live);
+    for (ptrdiff_t t = 0; t < temp_count; t++) dce.defs[t] = (StatementRef) { .block = -1, .index = -1 };
+
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        const QBEBlock* block = &function->blocks[b];
+        dce.live[b] = calloc(arrlen(block->statements) + 1, sizeof(bool));
+        assert(dce.live[b]);
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            const QBEStatement* st = &block->statements[i];
+            const StatementRef ref = { .block = b, .index = i };
+            if (st->type == QST_ASSIGN) dce.defs[temp_ids_get(&dce.temps, st->assign.value.name)] = ref;
+        }
+    }
+
+    // Jumps are what keeps everything else alive, along with anything besides stores that throws its value away.
+    // Calls stay as well, even though functions can't change anything the callee might never return
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        const QBEBlock* block = &function->blocks[b];
+        dce_mark_uses(&dce, &block->jump);
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            const QBEStatement* st = &block->statements[i];
+            const bool is_call = st->type == QST_ASSIGN && st->assign.instruction.type == QIT_CALL;
+            if (is_call || (st->type == QST_THROWAWAY && st->throwaway.type != QIT_STORE)) {
+                dce_mark(&dce, (StatementRef) { .block = b, .index = i });
+            }
+        }
+    }
+    while (arrlen(dce.worklist) > 0) dce_process(&dce, arrpop(dce.worklist));
+
+    // The temporary ids point into the names the sweep frees
+    if (dce.has_stores) {
+        for (ptrdiff_t t = 0; t < arrlen(dce.temps.names); t++) arrfree(dce.stores_of[t]);
+        for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) free(dce.store_before[b]);
+        free(dce.stores_of);
+        free(dce.store_before);
+        reaching_definitions_free(&dce.reaching);
+    } else {
+        temp_ids_free(&dce.temps);
+    }
+    const size_t changes = dce_sweep(function, dce.live);
+
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) free(dce.live[b]);
+    free(dce.live);
+    free(dce.defs);
+    arrfree(dce.worklist);
+    return changes;
+}
@@ -0,0 +1,242 @@
+#include "passes.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../extern/stb_ds.h"
+#include "cfg.h"
+#include "dataflow.h"
+
+// What an instruction computes, hashed as plain bytes so it has no padding
+typedef struct {
+    int32_t type;
+    int32_t opcode;
+    // Memory type and sign of an ext, comparison and operand type of a cmp
+    int32_t variant;
+    // Bit o is set when operand o is a constant instead of the id of a temporary
+    int32_t constants;
+    uint64_t operands[2];
+} ValueKey;
+
+// Instruction to the temporary that already holds its value
+typedef struct {
+    ValueKey key;
+    QBEValue value;
+} ValueNumber;
+
+typedef struct {
+    QBEFunction* function;
+    TempIds temps;
+    ValueNumber* numbers;
+    // Keys added to `numbers` in the order they were added, so scopes can be closed again
+    ValueKey* added;
+    // Slot name to the value last stored into or loaded from it in the current block
+    QBESubstitution* memory;
+    QBESubstitution* substitutions;
+    // Names of the temporaries that got replaced, freed once nothing refers to them anymore
+    char** replaced;
+    // One flag per statement of every block
+    bool** removed;
+} ValueNumbering;
+
+static void value_key_operand(const ValueNumbering* vn, ValueKey* key, size_t o, const QBEValue* value) {
+    if (value->kind == QVK_CONST) {
+        key->constants |= 1 << o;
+        key->operands[o] = value->const_i;
+        return;
+    }
+    const ptrdiff_t id = temp_ids_get(&vn->temps, value->name);
+    assert(id != -1);
+    key->operands[o] = id;
+}
+
+// Temporaries before constants and both in increasing order, so `a + b` and `b + a` get the same key
+static void value_key_sort(ValueKey* key) {
+    const int32_t left = key->constants & 1, right = (key->constants >> 1) & 1;
+    if (left < right || (left == right && key->operands[0] <= key->operands[1])) return;
+    const uint64_t operand = key->operands[0];
+    key->operands[0] = key->operands[1];
+    key->operands[1] = operand;
+    key->constants = (left << 1) | right;
+}
+
+// Returns false for instructions that can't be numbered
+static bool value_key(const ValueNumbering* vn, QBEValueType type, const QBEInstruction* ins, ValueKey* key) {
+    *key = (ValueKey) { .type = type, .opcode = ins->type };
+    switch (ins->type) {
+        case QIT_ADD: case QIT_SUB: case QIT_MUL: case QIT_DIV: case QIT_UDIV:
+        case QIT_SHL: case QIT_SAR: case QIT_SHR: {
+            value_key_operand(vn, key, 0, &ins->add.left);
+            value_key_operand(vn, key, 1, &ins->add.right);
+            if (ins->type == QIT_ADD || ins->type == QIT_MUL) value_key_sort(key);
+            return true;
+        }
+        case QIT_EXT: {
+            key->variant = ins->ext.type * 2 + ins->ext.is_signed;
+            value_key_operand(vn, key, 0, &ins->ext.value);
+            return true;
+        }
+        case QIT_CMP: {
+            key->variant = ins->cmp.cmp * 2 + ins->cmp.type;
+            value_key_operand(vn, key, 0, &ins->cmp.l);
+            value_key_operand(vn, key, 1, &ins->cmp.r);
+            if (ins->cmp.cmp == QCT_NE) value_key_sort(key);
+            return true;
+        }
+        default: return false;
+    }
+}
+
+static void value_numbering_replace(ValueNumbering* vn, ptrdiff_t b, ptrdiff_t i, QBEValue value) {
+    QBEStatement* st = &vn->function->blocks[b].statements[i];
+    shput(vn->substitutions, st->assign.value.name, value);
+    arrput(vn->replaced, st->assign.value.name);
+    vn->removed[b][i] = true;
+}
+
+// Loads reuse what the block last stored into or loaded from the slot. Only words and longs
+// since smaller loads extend what they read
+static void value_numbering_memory(ValueNumbering* vn, ptrdiff_t b, ptrdiff_t i) {
+    QBEStatement* st = &vn->function->blocks[b].statements[i];
+    if (st->type == QST_THROWAWAY && st->throwaway.type == QIT_STORE) {
+        if (st->throwaway.store.type == QMT_WORD || st->throwaway.store.type == QMT_LONG) {
+            shput(vn->memory, st->throwaway.store.name, st->throwaway.store.value);
+        } else {
+            (void)shdel(vn->memory, st->throwaway.store.name);
+        }
+        return;
+    }
+    if (st->type != QST_ASSIGN || st->assign.instruction.type != QIT_LOAD) return;
+    const QBEInstruction* load = &st->assign.instruction;
+    if (load->load.type != QMT_WORD && load->load.type != QMT_LONG) return;
+    const ptrdiff_t known = shgeti(vn->memory, load->load.name);
+    if (known != -1) {
+        value_numbering_replace(vn, b, i, vn->memory[known].value);
+    } else {
+        shput(vn->memory, load->load.name, st->assign.value);
+    }
+}
+
+static void value_numbering_block(ValueNumbering* vn, ptrdiff_t b) {
+    QBEBlock* block = &vn->function->blocks[b];
+    for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+        QBEStatement* st = &block->statements[i];
+        QBEInstruction* ins = st->type == QST_ASSIGN ? &st->assign.instruction : &st->throwaway;
+        // Operands are rewritten as we go so the keys see through earlier replacements
+        QBEValue* operands[QBE_MAX_USES];
+        const size_t count = qbe_instruction_operands(ins, operands);
+        for (size_t o = 0; o < count; o++) *operands[o] = qbe_substitution_resolve(vn->substitutions, *operands[o]);
+
+        value_numbering_memory(vn, b, i);
+        if (st->type != QST_ASSIGN || vn->removed[b][i]) continue;
+        ValueKey key;
+        if (!value_key(vn, st->assign.type, ins, &key)) continue;
+        // Lookups on an empty map allocate it, so they have to go through vn->numbers itself
+        const ptrdiff_t known = hmgeti(vn->numbers, key);
+        if (known != -1) {
+            value_numbering_replace(vn, b, i, vn->numbers[known].value);
+        } else {
+            hmput(vn->numbers, key, st->assign.value);
+            arrput(vn->added, key);
+        }
+    }
+    shfree(vn->memory);
+    vn->memory = NULL;
+}
+
+// Drops the numbers of the blocks that don't dominate what's visited next
+static void value_numbering_close_scope(ValueNumbering* vn, ptrdiff_t start) {
+    while (arrlen(vn->added) > start) {
+        const ValueKey key = arrpop(vn->added);
+        (void)hmdel(vn->numbers, key);
+    }
+}
+
+// Blocks get visited in a preorder of the dominator tree, the numbers of a block stay around
+// for every block it dominates
+static void value_numbering_dominator_tree(ValueNumbering* vn, const Cfg* cfg) {
+    const ptrdiff_t n = arrlen(vn->function->blocks);
+    ptrdiff_t** children = calloc(n + 1, sizeof(ptrdiff_t*));
+    assert(children);
+    // Reverse postorder keeps the children in the order the blocks come in
+    for (ptrdiff_t i = 1; i < cfg->reachable_count; i++) {
+        const ptrdiff_t b = cfg->order[i];
+        arrput(children[cfg->idom[b]], b);
+    }
+
+    // Entries with a scope close it again once every block dominated by `block` is done
+    typedef struct {
+        ptrdiff_t block;
+        ptrdiff_t scope;
+    } Visit;
+    Visit* stack = NULL;
+    arrput(stack, ((Visit) { 0, -1 }));
+    while (arrlen(stack) > 0) {
+        const Visit visit = arrpop(stack);
+        if (visit.scope != -1) {
+            value_numbering_close_scope(vn, visit.scope);
+            continue;
+        }
+        arrput(stack, ((Visit) { visit.block, arrlen(vn->added) }));
+        value_numbering_block(vn, visit.block);
+        for (ptrdiff_t c = arrlen(children[visit.block]) - 1; c >= 0; c--) {
+            arrput(stack, ((Visit) { children[visit.block][c], -1 }));
+        }
+    }
+    arrfree(stack);
+    for (ptrdiff_t b = 0; b < n; b++) arrfree(children[b]);
+    free(children);
+}
+
+static size_t value_numbering(QBEFunction* function, bool global) {
+    ValueNumbering vn = { .function = function, .temps = temp_ids_build(function) };
+    const ptrdiff_t n = arrlen(function->blocks);
+    vn.removed = calloc(n + 1, sizeof(bool*));
+    assert(vn.removed);
+    for (ptrdiff_t b = 0; b < n; b++) {
+        vn.removed[b] = calloc(arrlen(function->blocks[b].statements) + 1, sizeof(bool));
+        assert(vn.removed[b]);
+    }
+
+    if (global) {
+        Cfg cfg = cfg_build(function);
+        value_numbering_dominator_tree(&vn, &cfg);
+        cfg_free(&cfg);
+    } else {
+        for (ptrdiff_t b = 0; b < n; b++) {
+            value_numbering_block(&vn, b);
+            value_numbering_close_scope(&vn, 0);
+        }
+    }
+    value_numbering_close_scope(&vn, 0);
+    hmfree(vn.numbers);
+    arrfree(vn.added);
+    temp_ids_free(&vn.temps);
+
+    // Phis and jumps weren't rewritten yet
+    qbe_function_substitute(function, vn.substitutions);
+    for (ptrdiff_t b = 0; b < n; b++) {
+        QBEBlock* block = &function->blocks[b];
+        ptrdiff_t kept = 0;
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            if (!vn.removed[b][i]) block->statements[kept++] = block->statements[i];
+        }
+        if (kept < arrlen(block->statements)) arrsetlen(block->statements, kept);
+        free(vn.removed[b]);
+    }
+    free(vn.removed);
+
+    const size_t changes = arrlen(vn.replaced);
+    shfree(vn.substitutions);
+    for (ptrdiff_t i = 0; i < arrlen(vn.replaced); i++) free(vn.replaced[i]);
+    arrfree(vn.replaced);
+    return changes;
+}
+
+size_t local_value_numbering(QBEFunction* function) {
+    return value_numbering(function, false);
+}
+
+size_t global_value_numbering(QBEFunction* function) {
+    return value_numbering(function, true);
+}
@@ -0,0 +1,670 @@
+#include "passes.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../extern/stb_ds.h"
+#include "cfg.h"
+#include "dataflow.h"
+
+// Value of a temporary in iteration k of its loop (counting from 0) is c[0] + c[1] * k + c[2] * k * (k - 1) / 2,
+// every coefficient is a constant or a temporary from outside of the loop. Order 0 means the value isn't known,
+// 1 that it never changes and 2 that it goes up by the same amount every iteration
+typedef struct {
+    size_t order;
+    QBEValue c[3];
+} Recurrence;
+
+typedef enum {
+    RS_NEW,
+    RS_VISITING,
+    RS_DONE,
+} RecurrenceState;
+
+typedef struct {
+    char* key;
+    bool value;
+} NameSet;
+
+typedef struct {
+    QBEFunction* function;
+    const CfgLoop* loop;
+    // The only block outside of the loop jumping to its header and the only block jumping back to it
+    ptrdiff_t entry;
+    ptrdiff_t latch;
+    TempIds temps;
+    // Statement defining every temporary, block is -1 for params
+    StatementRef* defs;
+    Recurrence* recurrences;
+    RecurrenceState* states;
+    // Computes the coefficients, whatever the rewritten loop ends up using goes at the end of the entry
+    QBEStatement* prologue;
+    // Every temporary of the function (copies), so new ones don't clash with them
+    NameSet* names;
+    size_t next_name;
+} IndVars;
+
+static bool is_phi(const QBEStatement* st) {
+    return st->type == QST_ASSIGN && st->assign.instruction.type == QIT_PHI;
+}
+
+// Words are kept sign extended, the way codegen writes negative i32 constants
+static uint64_t wrap(QBEValueType type, uint64_t value) {
+    return type == QVT_WORD ? (uint64_t)(int64_t)(int32_t)value : value;
+}
+
+static QBEValue constant(uint64_t value) {
+    return (QBEValue) { .kind = QVK_CONST, .const_i = value };
+}
+
+static bool is_constant(const QBEValue* value, QBEValueType type, uint64_t c) {
+    return value->kind == QVK_CONST && wrap(type, value->const_i) == wrap(type, c);
+}
+
+static bool below(QBEValueType type, bool is_signed, uint64_t a, uint64_t b) {
+    if (type == QVT_WORD) return is_signed ? (int32_t)a < (int32_t)b : (uint32_t)a < (uint32_t)b;
+    return is_signed ? (int64_t)a < (int64_t)b : a < b;
+}
+
+static const QBEStatement* definition(const IndVars* iv, const char* name) {
+    const StatementRef def = iv->defs[temp_ids_get(&iv->temps, name)];
+    if (def.block == -1) return NULL;
+    return &iv->function->blocks[def.block].statements[def.index];
+}
+
+static bool is_invariant(const IndVars* iv, const QBEValue* value) {
+    if (value->kind == QVK_CONST) return true;
+    const StatementRef def = iv->defs[temp_ids_get(&iv->temps, value->name)];
+    return def.block == -1 || !iv->loop->contains[def.block];
+}
+
+static QBEValue new_temp(IndVars* iv) {
+    char buffer[256];
+    do {
+        snprintf(buffer, sizeof(buffer), "%s.iv%zu", iv->function->blocks[iv->loop->header].name, iv->next_name++);
+    } while (shgeti(iv->names, buffer) != -1);
+    shput(iv->names, buffer, true);
+    return (QBEValue) { .kind = QVK_TEMP, .name = strdup(buffer) };
+}
+
+// Appends `left op right` to the prologue, folding it right away where it can
+static QBEValue emit(IndVars* iv, QBEInstructionType op, QBEValueType type, QBEValue left, QBEValue right) {
+    if (left.kind == QVK_CONST && right.kind == QVK_CONST) {
+        const uint64_t l = left.const_i;
+        const uint64_t shift = right.const_i & (type == QVT_WORD ? 31 : 63);
+        switch (op) {
+            case QIT_ADD: return constant(wrap(type, l + right.const_i));
+            case QIT_SUB: return constant(wrap(type, l - right.const_i));
+            case QIT_MUL: return constant(wrap(type, l * right.const_i));
+            case QIT_SHL: return constant(wrap(type, l << shift));
+            case QIT_SHR: return constant(wrap(type, (type == QVT_WORD ? (uint32_t)l : l) >> shift));
+            default: assert(false && "Unreachable");
+        }
+    }
+    if (op != QIT_MUL && is_constant(&right, type, 0)) return left;
+    if (op == QIT_ADD && is_constant(&left, type, 0)) return right;
+    if (op == QIT_MUL) {
+        if (is_constant(&right, type, 1)) return left;
+        if (is_constant(&left, type, 1)) return right;
+        if (is_constant(&left, type, 0) || is_constant(&right, type, 0)) return constant(0);
+    }
+    for (ptrdiff_t i = 0; i < arrlen(iv->prologue); i++) {
+        const QBEStatement* st = &iv->prologue[i];
+        const QBEInstruction* ins = &st->assign.instruction;
+        if (ins->type == op && st->assign.type == type && qbe_value_equal(&ins->add.left, &left) && qbe_value_equal(&ins->add.right, &right)) {
+            return st->assign.value;
+        }
+    }
+    const QBEValue result = new_temp(iv);
+    const QBEStatement st = {
+        .type = QST_ASSIGN,
+        .assign = {
+            .value = result,
+            .type = type,
+            .instruction = { .type = op, .add = { .left = left, .right = right } },
+        },
+    };
+    arrput(iv->prologue, st);
+    return result;
+}
+
+static Recurrence recurrence_trim(QBEValueType type, Recurrence r) {
+    while (r.order > 1 && is_constant(&r.c[r.order - 1], type, 0)) r.order--;
+    return r;
+}
+
+// Adds or subtracts two recurrences coefficient by coefficient
+static Recurrence recurrence_combine(IndVars* iv, QBEInstructionType op, QBEValueType type, const Recurrence* a, const Recurrence* b) {
+    Recurrence r = { .order = a->order > b->order ? a->order : b->order };
+    for (size_t i = 0; i < r.order; i++) {
+        const QBEValue left = i < a->order ? a->c[i] : constant(0);
+        const QBEValue right = i < b->order ? b->c[i] : constant(0);
+        r.c[i] = emit(iv, op, type, left, right);
+    }
+    return recurrence_trim(type, r);
+}
+
+static Recurrence recurrence_scale(IndVars* iv, QBEValueType type, const Recurrence* a, QBEValue factor) {
+    Recurrence r = { .order = a->order };
+    for (size_t i = 0; i < r.order; i++) r.c[i] = emit(iv, QIT_MUL, type, a->c[i], factor);
+    return recurrence_trim(type, r);
+}
+
+static Recurrence recurrence_of(IndVars* iv, const QBEValue* value);
+
+// Header phis starting at something from outside of the loop that the latch adds a recurrence of a lower
+// order to (or subtracts one from) are recurrences one order higher
+static Recurrence phi_recurrence(IndVars* iv, const QBEStatement* phi, ptrdiff_t block) {
+    const QBEPhiArg* args = phi->assign.instruction.phi.args;
+    if (block != iv->loop->header || arrlen(args) != 2) return (Recurrence) { 0 };
+    const QBEValue* init = NULL;
+    const QBEValue* next = NULL;
+    for (ptrdiff_t a = 0; a < 2; a++) {
+        if (strcmp(args[a].label, iv->function->blocks[iv->entry].name) == 0) init = &args[a].value;
+        if (strcmp(args[a].label, iv->function->blocks[iv->latch].name) == 0) next = &args[a].value;
+    }
+    if (init == NULL || next == NULL || is_invariant(iv, next)) return (Recurrence) { 0 };
+
+    const QBEStatement* st = definition(iv, next->name);
+    if (st->type != QST_ASSIGN || st->assign.type != phi->assign.type) return (Recurrence) { 0 };
+    const QBEInstruction* update = &st->assign.instruction;
+    const QBEValue* step = NULL;
+    if (update->type == QIT_ADD && qbe_value_equal(&update->add.left, &phi->assign.value)) step = &update->add.right;
+    else if (update->type == QIT_ADD && qbe_value_equal(&update->add.right, &phi->assign.value)) step = &update->add.left;
+    else if (update->type == QIT_SUB && qbe_value_equal(&update->sub.left, &phi->assign.value)) step = &update->sub.right;
+    if (step == NULL) return (Recurrence) { 0 };
+
+    const QBEValueType type = phi->assign.type;
+    Recurrence e = recurrence_of(iv, step);
+    if (e.order == 0 || e.order == 3) return (Recurrence) { 0 };
+    if (update->type == QIT_SUB) {
+        for (size_t i = 0; i < e.order; i++) e.c[i] = emit(iv, QIT_SUB, type, constant(0), e.c[i]);
+    }
+    Recurrence r = { .order = e.order + 1, .c = { *init } };
+    for (size_t i = 0; i < e.order; i++) r.c[i + 1] = e.c[i];
+    return recurrence_trim(type, r);
+}
+
+static Recurrence recurrence_compute(IndVars* iv, const QBEStatement* st, ptrdiff_t block) {
+    const QBEInstruction* ins = &st->assign.instruction;
+    const QBEValueType type = st->assign.type;
+    switch (ins->type) {
+        case QIT_PHI: return phi_recurrence(iv, st, block);
+        case QIT_ADD: case QIT_SUB: {
+            const Recurrence a = recurrence_of(iv, &ins->add.left);
+            const Recurrence b = recurrence_of(iv, &ins->add.right);
+            if (a.order == 0 || b.order == 0) break;
+            return recurrence_combine(iv, ins->type, type, &a, &b);
+        }
+        case QIT_MUL: {
+            const Recurrence a = recurrence_of(iv, &ins->mul.left);
+            const Recurrence b = recurrence_of(iv, &ins->mul.right);
+            if (a.order == 0 || b.order == 0) break;
+            if (a.order == 1) return recurrence_scale(iv, type, &b, a.c[0]);
+            if (b.order == 1) return recurrence_scale(iv, type, &a, b.c[0]);
+            break;
+        }
+        case QIT_SHL: {
+            if (ins->shl.right.kind != QVK_CONST) break;
+            const Recurrence a = recurrence_of(iv, &ins->shl.left);
+            if (a.order == 0) break;
+            const uint64_t shift = ins->shl.right.const_i & (type == QVT_WORD ? 31 : 63);
+            return recurrence_scale(iv, type, &a, constant(wrap(type, (uint64_t)1 << shift)));
+        }
+        default: {}
+    }
+    return (Recurrence) { 0 };
+}
+
+static Recurrence recurrence_of(IndVars* iv, const QBEValue* value) {
+    if (is_invariant(iv, value)) return (Recurrence) { .order = 1, .c = { *value } };
+    const ptrdiff_t id = temp_ids_get(&iv->temps, value->name);
+    // Going around in a circle without going through a header phi the right way
+    if (iv->states[id] == RS_VISITING) return (Recurrence) { 0 };
+    if (iv->states[id] == RS_DONE) return iv->recurrences[id];
+    iv->states[id] = RS_VISITING;
+    const StatementRef def = iv->defs[id];
+    const QBEStatement* st = &iv->function->blocks[def.block].statements[def.index];
+    const Recurrence r = st->type == QST_ASSIGN ? recurrence_compute(iv, st, def.block) : (Recurrence) { 0 };
+    iv->recurrences[id] = r;
+    iv->states[id] = RS_DONE;
+    return r;
+}
+
+// Turns `cmp` into `less < greater`, false for comparisons that aren't orderings
+static bool ordering(const QBEInstruction* cmp, QBEValue* less, QBEValue* greater, bool* is_signed) {
+    switch (cmp->cmp.cmp) {
+        case QCT_LT: case QCT_ULT: *less = cmp->cmp.l; *greater = cmp->cmp.r; break;
+        case QCT_GT: case QCT_UGT: *less = cmp->cmp.r; *greater = cmp->cmp.l; break;
+        case QCT_NE: return false;
+    }
+    *is_signed = cmp->cmp.cmp == QCT_LT || cmp->cmp.cmp == QCT_GT;
+    return true;
+}
+
+static const QBEInstruction* defining_cmp(const IndVars* iv, const QBEValue* value) {
+    if (value->kind != QVK_TEMP) return NULL;
+    const QBEStatement* st = definition(iv, value->name);
+    if (st == NULL || st->type != QST_ASSIGN || st->assign.instruction.type != QIT_CMP) return NULL;
+    return &st->assign.instruction;
+}
+
+// Whether the entry only jumps into the loop if `less < greater`
+static bool is_guarded(const IndVars* iv, const QBEValue* less, const QBEValue* greater, QBEValueType type, bool is_signed) {
+    const QBEInstruction* jump = &iv->function->blocks[iv->entry].jump;
+    const char* header = iv->function->blocks[iv->loop->header].name;
+    if (jump->type != QIT_JNZ || strcmp(jump->jnz.then, header) != 0 || strcmp(jump->jnz.otherwise, header) == 0) return false;
+    const QBEInstruction* cmp = defining_cmp(iv, &jump->jnz.value);
+    QBEValue l, g;
+    bool s;
+    if (cmp == NULL || cmp->cmp.type != type || !ordering(cmp, &l, &g, &s)) return false;
+    return s == is_signed && qbe_value_equal(&l, less) && qbe_value_equal(&g, greater);
+}
+
+// How many times the loop runs, when the latch counts a header phi up (down) by one and goes around again
+// while it's below (above) something the loop doesn't change. Unless both ends are constants the entry has
+// to check the same thing before going in, the loop runs at least once either way
+static bool trip_count(IndVars* iv, QBEValue* count, QBEValueType* count_type) {
+    const QBEBlock* header = &iv->function->blocks[iv->loop->header];
+    const QBEInstruction* jump = &iv->function->blocks[iv->latch].jump;
+    if (jump->type != QIT_JNZ || strcmp(jump->jnz.then, header->name) != 0) return false;
+    const QBEInstruction* cmp = defining_cmp(iv, &jump->jnz.value);
+    QBEValue less, greater;
+    bool is_signed;
+    if (cmp == NULL || !ordering(cmp, &less, &greater, &is_signed)) return false;
+
+    for (ptrdiff_t i = 0; i < arrlen(header->statements) && is_phi(&header->statements[i]); i++) {
+        const QBEStatement* phi = &header->statements[i];
+        const QBEValueType type = phi->assign.type;
+        if (type != cmp->cmp.type) continue;
+        const Recurrence r = recurrence_of(iv, &phi->assign.value);
+        if (r.order != 2 || r.c[1].kind != QVK_CONST) continue;
+        const QBEPhiArg* args = phi->assign.instruction.phi.args;
+        const QBEValue* next = strcmp(args[0].label, iv->function->blocks[iv->latch].name) == 0 ? &args[0].value : &args[1].value;
+
+        bool counts_up;
+        QBEValue bound;
+        if (is_constant(&r.c[1], type, 1) && qbe_value_equal(&less, next) && is_invariant(iv, &greater)) {
+            counts_up = true;
+            bound = greater;
+        } else if (is_constant(&r.c[1], type, -1) && qbe_value_equal(&greater, next) && is_invariant(iv, &less)) {
+            counts_up = false;
+            bound = less;
+        } else {
+            continue;
+        }
+        const QBEValue from = counts_up ? r.c[0] : bound;
+        const QBEValue to = counts_up ? bound : r.c[0];
+
+        if (from.kind == QVK_CONST && to.kind == QVK_CONST) {
+            const uint64_t first = wrap(type, r.c[0].const_i + r.c[1].const_i);
+            const bool goes_on = counts_up ? below(type, is_signed, first, bound.const_i) : below(type, is_signed, bound.const_i, first);
+            if (!goes_on) {
+                *count = constant(1);
+            } else if (below(type, is_signed, from.const_i, to.const_i)) {
+                *count = constant(wrap(type, to.const_i - from.const_i));
+            } else {
+                // Only stops after wrapping around
+                continue;
+            }
+        } else if (is_guarded(iv, &from, &to, type, is_signed)) {
+            *count = emit(iv, QIT_SUB, type, to, from);
+        } else {
+            continue;
+        }
+        *count_type = type;
+        return true;
+    }
+    return false;
+}
+
+// Value in the last iteration of a loop that runs `count` times
+static QBEValue evaluate(IndVars* iv, const Recurrence* r, QBEValueType type, QBEValue count) {
+    const QBEValue k = emit(iv, QIT_SUB, type, count, constant(1));
+    QBEValue value = r->c[0];
+    if (r->order > 1) value = emit(iv, QIT_ADD, type, value, emit(iv, QIT_MUL, type, r->c[1], k));
+    if (r->order > 2) {
+        // k * (k - 1) / 2 without losing the top bit: whichever of k and k - 1 is even gets halved
+        const QBEValue half = emit(iv, QIT_SHR, type, k, constant(1));
+        const QBEValue odd = emit(iv, QIT_SUB, type, k, emit(iv, QIT_SHL, type, half, constant(1)));
+        const QBEValue previous = emit(iv, QIT_SUB, type, k, constant(1));
+        const QBEValue even_part = emit(iv, QIT_MUL, type, half, previous);
+        const QBEValue odd_part = emit(iv, QIT_MUL, type, odd, emit(iv, QIT_SHR, type, previous, constant(1)));
+        const QBEValue triangle = emit(iv, QIT_ADD, type, even_part, odd_part);
+        value = emit(iv, QIT_ADD, type, value, emit(iv, QIT_MUL, type, r->c[2], triangle));
+    }
+    return value;
+}
+
+// Only the rewritten loop and what comes after it read the prologue, so whatever nothing reads stays out
+static void flush_prologue(IndVars* iv, NameSet** needed) {
+    QBEStatement* kept = NULL;
+    for (ptrdiff_t i = arrlen(iv->prologue) - 1; i >= 0; i--) {
+        QBEStatement* st = &iv->prologue[i];
+        if (shgeti(*needed, st->assign.value.name) == -1) {
+            free(st->assign.value.name);
+            continue;
+        }
+        const char* uses[QBE_MAX_USES];
+        const size_t count = qbe_statement_uses(st, uses);
+        for (size_t u = 0; u < count; u++) shput(*needed, (char*)uses[u], true);
+        arrput(kept, *st);
+    }
+    QBEBlock* entry = &iv->function->blocks[iv->entry];
+    for (ptrdiff_t i = arrlen(kept) - 1; i >= 0; i--) arrput(entry->statements, kept[i]);
+    arrfree(kept);
+    arrfree(iv->prologue);
+}
+
+static void need(NameSet** needed, const QBEValue* value) {
+    if (value->kind == QVK_TEMP) shput(*needed, value->name, true);
+}
+
+// Temporaries of the loop read after it, each one once
+static void outside_uses(const IndVars* iv, QBEValue** uses) {
+    NameSet* seen = NULL;
+    for (ptrdiff_t b = 0; b < arrlen(iv->function->blocks); b++) {
+        if (iv->loop->contains[b]) continue;
+        QBEBlock* block = &iv->function->blocks[b];
+        QBEValue** values = NULL;
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            QBEStatement* st = &block->statements[i];
+            QBEInstruction* ins = st->type == QST_ASSIGN ? &st->assign.instruction : &st->throwaway;
+            if (ins->type == QIT_PHI) {
+                for (ptrdiff_t a = 0; a < arrlen(ins->phi.args); a++) arrput(values, &ins->phi.args[a].value);
+                continue;
+            }
+            QBEValue* operands[QBE_MAX_USES];
+            const size_t count = qbe_instruction_operands(ins, operands);
+            for (size_t o = 0; o < count; o++) arrput(values, operands[o]);
+        }
+        QBEValue* operands[QBE_MAX_USES];
+        const size_t count = qbe_instruction_operands(&block->jump, operands);
+        for (size_t o = 0; o < count; o++) arrput(values, operands[o]);
+
+        for (ptrdiff_t v = 0; v < arrlen(values); v++) {
+            if (is_invariant(iv, values[v]) || shgeti(seen, values[v]->name) != -1) continue;
+            shput(seen, values[v]->name, true);
+            arrput(*uses, *values[v]);
+        }
+        arrfree(values);
+    }
+    shfree(seen);
+}
+
+static bool has_side_effects(const QBEFunction* function, const CfgLoop* loop) {
+    for (ptrdiff_t i = 0; i < arrlen(loop->blocks); i++) {
+        const QBEBlock* block = &function->blocks[loop->blocks[i]];
+        for (ptrdiff_t s = 0; s < arrlen(block->statements); s++) {
+            const QBEStatement* st = &block->statements[s];
+            if (st->type == QST_THROWAWAY || st->assign.instruction.type == QIT_CALL) return true;
+        }
+    }
+    return false;
+}
+
+static void retarget_label(char** label, const char* from, char* to) {
+    if (strcmp(*label, from) == 0) *label = to;
+}
+
+static void index_function(IndVars* iv) {
+    QBEFunction* function = iv->function;
+    iv->temps = temp_ids_build(function);
+    const ptrdiff_t temp_count = arrlen(iv->temps.names);
+    iv->defs = malloc((temp_count + 1) * sizeof(StatementRef));
+    iv->recurrences = calloc(temp_count + 1, sizeof(Recurrence));
+    iv->states = calloc(temp_count + 1, sizeof(RecurrenceState));
+    assert(iv->defs && iv->recurrences && iv->states);
+    for (ptrdiff_t t = 0; t < temp_count; t++) {
+        iv->defs[t] = (StatementRef) { .block = -1, .index = -1 };
+        if (shgeti(iv->names, iv->temps.names[t]) == -1) shput(iv->names, (char*)iv->temps.names[t], true);
+    }
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        const QBEBlock* block = &function->blocks[b];
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            if (block->statements[i].type != QST_ASSIGN) continue;
+            iv->defs[temp_ids_get(&iv->temps, block->statements[i].assign.value.name)] = (StatementRef) { .block = b, .index = i };
+        }
+    }
+}
+
+static void unindex_function(IndVars* iv) {
+    temp_ids_free(&iv->temps);
+    free(iv->defs);
+    free(iv->recurrences);
+    free(iv->states);
+}
+
+// The entry skips over the loop to where the latch left it. If the entry can go there without the loop already,
+// an empty block in place of the loop keeps the phis there apart
+static void delete_loop(IndVars* iv, ptrdiff_t exit) {
+    QBEFunction* function = iv->function;
+    const CfgLoop* loop = iv->loop;
+    const QBEBlock* header = &function->blocks[loop->header];
+    QBEInstruction* jump = &function->blocks[iv->entry].jump;
+    QBEBlock done = { 0 };
+    char* from = function->blocks[iv->entry].name;
+    if (jump->type == QIT_JMP) {
+        jump->jmp.label = function->blocks[exit].name;
+    } else {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "%s.done", header->name);
+        assert(qbe_function_find_block(function, buffer) == -1);
+        done = (QBEBlock) {
+            .name = strdup(buffer),
+            .jump = { .type = QIT_JMP, .jmp = { .label = function->blocks[exit].name } },
+        };
+        retarget_label(&jump->jnz.then, header->name, done.name);
+        retarget_label(&jump->jnz.otherwise, header->name, done.name);
+        from = done.name;
+    }
+    QBEBlock* after = &function->blocks[exit];
+    for (ptrdiff_t i = 0; i < arrlen(after->statements) && is_phi(&after->statements[i]); i++) {
+        QBEPhiArg* args = after->statements[i].assign.instruction.phi.args;
+        for (ptrdiff_t a = 0; a < arrlen(args); a++) retarget_label(&args[a].label, function->blocks[iv->latch].name, from);
+    }
+
+    QBEBlock* blocks = NULL;
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        QBEBlock* block = &function->blocks[b];
+        if (b == loop->header && done.name != NULL) arrput(blocks, done);
+        if (!loop->contains[b]) {
+            arrput(blocks, *block);
+            continue;
+        }
+        qbe_block_free(block);
+        free(block->name);
+    }
+    arrfree(function->blocks);
+    function->blocks = blocks;
+    qbe_function_link(function);
+}
+
+typedef struct {
+    // The multiplication getting replaced
+    char* name;
+    QBEValueType type;
+    QBEValue phi;
+    QBEValue next;
+    QBEValue start;
+    QBEValue step;
+} Reduction;
+
+// Multiplications of something going up by the same amount every iteration become header phis of their own
+// the latch adds that amount to
+static void find_reductions(IndVars* iv, NameSet** needed, Reduction** reductions) {
+    for (ptrdiff_t i = 0; i < arrlen(iv->loop->blocks); i++) {
+        const QBEBlock* block = &iv->function->blocks[iv->loop->blocks[i]];
+        for (ptrdiff_t s = 0; s < arrlen(block->statements); s++) {
+            const QBEStatement* st = &block->statements[s];
+            if (st->type != QST_ASSIGN || st->assign.instruction.type != QIT_MUL) continue;
+            const Recurrence r = recurrence_of(iv, &st->assign.value);
+            if (r.order != 2) continue;
+            const Reduction reduction = {
+                .name = st->assign.value.name,
+                .type = st->assign.type,
+                .phi = new_temp(iv),
+                .next = new_temp(iv),
+                .start = r.c[0],
+                .step = r.c[1],
+            };
+            need(needed, &reduction.start);
+            need(needed, &reduction.step);
+            arrput(*reductions, reduction);
+        }
+    }
+}
+
+static void apply_reductions(IndVars* iv, Reduction* reductions) {
+    QBEFunction* function = iv->function;
+    QBEBlock* header = &function->blocks[iv->loop->header];
+    QBEBlock* latch = &function->blocks[iv->latch];
+    QBESubstitution* substitutions = NULL;
+    for (ptrdiff_t r = 0; r < arrlen(reductions); r++) shput(substitutions, reductions[r].name, reductions[r].phi);
+
+    for (ptrdiff_t i = 0; i < arrlen(iv->loop->blocks); i++) {
+        QBEBlock* block = &function->blocks[iv->loop->blocks[i]];
+        ptrdiff_t kept = 0;
+        for (ptrdiff_t s = 0; s < arrlen(block->statements); s++) {
+            const QBEStatement* st = &block->statements[s];
+            if (st->type == QST_ASSIGN && shgeti(substitutions, st->assign.value.name) != -1) continue;
+            block->statements[kept++] = *st;
+        }
+        if (kept < arrlen(block->statements)) arrsetlen(block->statements, kept);
+    }
+    for (ptrdiff_t r = 0; r < arrlen(reductions); r++) {
+        const Reduction* reduction = &reductions[r];
+        QBEPhiArg* args = NULL;
+        arrput(args, ((QBEPhiArg) { .label = function->blocks[iv->entry].name, .value = reduction->start }));
+        arrput(args, ((QBEPhiArg) { .label = latch->name, .value = reduction->next }));
+        qbe_block_assign_ins_at(header, 0, (QBEInstruction) { .type = QIT_PHI, .phi.args = args }, reduction->type, reduction->phi);
+        const QBEInstruction add = { .type = QIT_ADD, .add = { .left = reduction->phi, .right = reduction->step } };
+        qbe_block_assign_ins(latch, add, reduction->type, reduction->next);
+    }
+    qbe_function_substitute(function, substitutions);
+    shfree(substitutions);
+}
+
+// The only block outside of the loop jumping to its header, -1 if there's more than one
+static ptrdiff_t loop_entry(const QBEFunction* function, const CfgLoop* loop) {
+    const QBEBlock* header = &function->blocks[loop->header];
+    ptrdiff_t entry = -1;
+    for (ptrdiff_t p = 0; p < arrlen(header->preds); p++) {
+        if (loop->contains[header->preds[p]]) continue;
+        if (entry != -1) return -1;
+        entry = header->preds[p];
+    }
+    return entry;
+}
+
+// Where control goes after leaving the loop, -1 unless only the latch leaves it
+static ptrdiff_t loop_exit(const QBEFunction* function, const CfgLoop* loop, ptrdiff_t latch) {
+    ptrdiff_t exit = -1;
+    for (ptrdiff_t i = 0; i < arrlen(loop->blocks); i++) {
+        const QBEBlock* block = &function->blocks[loop->blocks[i]];
+        for (ptrdiff_t s = 0; s < arrlen(block->succs); s++) {
+            if (loop->contains[block->succs[s]]) continue;
+            if (loop->blocks[i] != latch) return -1;
+            exit = block->succs[s];
+        }
+    }
+    return exit;
+}
+
+static bool has_inner_loop(const CfgLoop* loops, ptrdiff_t l) {
+    for (ptrdiff_t m = 0; m < arrlen(loops); m++) {
+        if (m != l && loops[l].contains[loops[m].header]) return true;
+    }
+    return false;
+}
+
+static size_t simplify_loop(IndVars* iv, const CfgLoop* loops, ptrdiff_t l) {
+    QBEFunction* function = iv->function;
+    const CfgLoop* loop = &loops[l];
+    if (loop->header == 0 || arrlen(loop->latches) != 1) return 0;
+    iv->loop = loop;
+    iv->latch = loop->latches[0];
+    iv->entry = loop_entry(function, loop);
+    const ptrdiff_t exit = loop_exit(function, loop, iv->latch);
+    if (iv->entry == -1 || exit == -1) return 0;
+
+    index_function(iv);
+    // Only read when counted, set anyway so -O2 can tell
+    QBEValue count = constant(0);
+    QBEValueType count_type = QVT_WORD;
+    const bool counted = trip_count(iv, &count, &count_type);
+
+    // What comes after the loop gets the values of its last iteration without going through the loop
+    NameSet* needed = NULL;
+    QBESubstitution* exits = NULL;
+    QBEValue* uses = NULL;
+    bool all_replaced = true;
+    outside_uses(iv, &uses);
+    for (ptrdiff_t u = 0; u < arrlen(uses); u++) {
+        const Recurrence r = counted ? recurrence_of(iv, &uses[u]) : (Recurrence) { 0 };
+        if (r.order == 0 || definition(iv, uses[u].name)->assign.type != count_type) {
+            all_replaced = false;
+            continue;
+        }
+        const QBEValue value = evaluate(iv, &r, count_type, count);
+        need(&needed, &value);
+        shput(exits, uses[u].name, value);
+    }
+    arrfree(uses);
+    size_t changes = shlen(exits);
+
+    // Loops that are known to stop and that nothing reads anything from anymore can go. Inner loops
+    // might never stop
+    const bool deletes = counted && all_replaced && !has_side_effects(function, loop) && !has_inner_loop(loops, l);
+    Reduction* reductions = NULL;
+    if (!deletes) find_reductions(iv, &needed, &reductions);
+
+    flush_prologue(iv, &needed);
+    shfree(needed);
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        if (!loop->contains[b]) qbe_block_substitute(&function->blocks[b], exits);
+    }
+    shfree(exits);
+    // The temporary ids point into names that get freed below
+    unindex_function(iv);
+
+    if (deletes) {
+        delete_loop(iv, exit);
+        changes++;
+    } else if (arrlen(reductions) > 0) {
+        apply_reductions(iv, reductions);
+        for (ptrdiff_t r = 0; r < arrlen(reductions); r++) free(reductions[r].name);
+        changes += arrlen(reductions);
+    }
+    arrfree(reductions);
+    return changes;
+}
+
+size_t induction_variable_simplification(QBEFunction* function) {
+    IndVars iv = { .function = function };
+    sh_new_strdup(iv.names);
+    size_t changes = 0;
+    // Rewriting a loop moves blocks and statements around, so the loops get found again after every one
+    // that changed. Changing one makes the next look at it find nothing to do
+    bool done = false;
+    while (!done) {
+        done = true;
+        Cfg cfg = cfg_build(function);
+        CfgLoop* loops = cfg_find_loops(&cfg);
+        for (ptrdiff_t l = 0; l < arrlen(loops); l++) {
+            const size_t loop_changes = simplify_loop(&iv, loops, l);
+            if (loop_changes == 0) continue;
+            changes += loop_changes;
+            done = false;
+            break;
+        }
+        cfg_loops_free(loops);
+        cfg_free(&cfg);
+    }
+    arrfree(iv.prologue);
+    shfree(iv.names);
+    return changes;
+}
+
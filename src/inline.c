@@ -0,0 +1,336 @@
+#include "passes.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../extern/stb_ds.h"
+
+typedef struct {
+    char* key;
+    ptrdiff_t value;
+} FunctionIndex;
+
+typedef struct {
+    char* key;
+    char* value;
+} LabelRename;
+
+typedef struct {
+    QBEModule* module;
+    const PassOptions* options;
+    FunctionIndex* index;
+    // Tarjan's strongly connected components of the call graph
+    ptrdiff_t* order;
+    ptrdiff_t* low;
+    bool* on_stack;
+    ptrdiff_t* stack;
+    ptrdiff_t visited;
+    // Functions calling each other (or themselves) end up in the same component
+    ptrdiff_t* component;
+    // Callees before their callers
+    ptrdiff_t* bottom_up;
+} Inliner;
+
+static bool is_call(const QBEStatement* st) {
+    return st->type == QST_ASSIGN && st->assign.instruction.type == QIT_CALL;
+}
+
+static ptrdiff_t function_index(Inliner* inliner, const char* name) {
+    const ptrdiff_t i = shgeti(inliner->index, name);
+    return i != -1 ? inliner->index[i].value : -1;
+}
+
+static void inliner_visit(Inliner* inliner, ptrdiff_t f) {
+    inliner->order[f] = inliner->low[f] = inliner->visited++;
+    arrput(inliner->stack, f);
+    inliner->on_stack[f] = true;
+
+    const QBEFunction* function = &inliner->module->functions[f];
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        const QBEBlock* block = &function->blocks[b];
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            if (!is_call(&block->statements[i])) continue;
+            const ptrdiff_t callee = function_index(inliner, block->statements[i].assign.instruction.call.name);
+            if (callee == -1) continue;
+            if (inliner->order[callee] == -1) {
+                inliner_visit(inliner, callee);
+                if (inliner->low[callee] < inliner->low[f]) inliner->low[f] = inliner->low[callee];
+            } else if (inliner->on_stack[callee] && inliner->order[callee] < inliner->low[f]) {
+                inliner->low[f] = inliner->order[callee];
+            }
+        }
+    }
+
+    if (inliner->low[f] != inliner->order[f]) return;
+    ptrdiff_t member;
+    do {
+        member = arrpop(inliner->stack);
+        inliner->on_stack[member] = false;
+        inliner->component[member] = f;
+        arrput(inliner->bottom_up, member);
+    } while (member != f);
+}
+
+// Statements and jumps inlining `function` adds to the caller
+static size_t function_size(const QBEFunction* function) {
+    size_t size = 0;
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) size += arrlen(function->blocks[b].statements) + 1;
+    return size;
+}
+
+// What goes away with the call: the call itself, passing the args and returning. Constant args
+// count twice since whatever the callee computes from them can get folded
+static size_t call_benefit(const QBEInstruction* call) {
+    size_t benefit = 2;
+    for (ptrdiff_t a = 0; a < arrlen(call->call.args); a++) benefit += call->call.args[a].value.kind == QVK_CONST ? 2 : 1;
+    return benefit;
+}
+
+static bool returns(const QBEFunction* function) {
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        if (function->blocks[b].jump.type == QIT_RETURN) return true;
+    }
+    return false;
+}
+
+static bool should_inline(const Inliner* inliner, ptrdiff_t caller, ptrdiff_t callee, const QBEInstruction* call) {
+    const QBEFunction* function = &inliner->module->functions[callee];
+    // A callee that never returns has nothing to give the result of the call
+    if (inliner->component[caller] == inliner->component[callee] || function->inline_hint == QIH_NEVER || !returns(function)) {
+        return false;
+    }
+    if (function->inline_hint == QIH_ALWAYS) return true;
+    return function_size(function) <= call_benefit(call) + inliner->options->inline_budget;
+}
+
+// Blocks and temporaries of inlined code are prefixed with `inl<n>.`, the first n no block of `function` uses yet
+static size_t next_inline_id(const QBEFunction* function) {
+    size_t next = 0;
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        size_t id;
+        if (sscanf(function->blocks[b].name, "inl%zu.", &id) == 1 && id >= next) next = id + 1;
+    }
+    return next;
+}
+
+// Sized to fit, nested inlining keeps adding prefixes and cut off names could collide
+static char* prefixed(const char* prefix, const char* name) {
+    const size_t prefix_length = strlen(prefix);
+    const size_t name_length = strlen(name);
+    char* result = malloc(prefix_length + name_length + 1);
+    assert(result);
+    memcpy(result, prefix, prefix_length);
+    memcpy(result + prefix_length, name, name_length + 1);
+    return result;
+}
+
+// Names of the callee to the ones they get in the caller. Params become the args of the call
+typedef struct {
+    QBESubstitution* values;
+    LabelRename* labels;
+} Renames;
+
+// No chains to follow unlike qbe_substitution_resolve, the caller can have temporaries called the same as the callee's
+static QBEValue rename_value(const Renames* renames, QBEValue value) {
+    if (value.kind != QVK_TEMP) return value;
+    QBESubstitution* values = renames->values;
+    const ptrdiff_t i = shgeti(values, value.name);
+    assert(i != -1);
+    return values[i].value;
+}
+
+static char* rename_label(const Renames* renames, const char* label) {
+    LabelRename* labels = renames->labels;
+    const ptrdiff_t i = shgeti(labels, label);
+    assert(i != -1);
+    return labels[i].value;
+}
+
+static QBEStatement clone_statement(const Renames* renames, const QBEStatement* st) {
+    QBEStatement clone = *st;
+    QBEInstruction* ins = &clone.throwaway;
+    if (clone.type == QST_ASSIGN) {
+        clone.assign.value = rename_value(renames, st->assign.value);
+        ins = &clone.assign.instruction;
+    }
+    switch (ins->type) {
+        case QIT_PHI: {
+            QBEPhiArg* args = NULL;
+            for (ptrdiff_t a = 0; a < arrlen(ins->phi.args); a++) {
+                QBEPhiArg arg = {
+                    .label = rename_label(renames, ins->phi.args[a].label),
+                    .value = rename_value(renames, ins->phi.args[a].value),
+                };
+                arrput(args, arg);
+            }
+            ins->phi.args = args;
+            break;
+        }
+        case QIT_CALL: {
+            QBECallArg* args = NULL;
+            for (ptrdiff_t a = 0; a < arrlen(ins->call.args); a++) arrput(args, ins->call.args[a]);
+            ins->call.args = args;
+            break;
+        }
+        case QIT_STORE: ins->store.name = rename_value(renames, (QBEValue) { .kind = QVK_TEMP, .name = ins->store.name }).name; break;
+        case QIT_LOAD: ins->load.name = rename_value(renames, (QBEValue) { .kind = QVK_TEMP, .name = ins->load.name }).name; break;
+        default: {}
+    }
+    QBEValue* operands[QBE_MAX_USES];
+    const size_t count = qbe_instruction_operands(ins, operands);
+    for (size_t o = 0; o < count; o++) *operands[o] = rename_value(renames, *operands[o]);
+    return clone;
+}
+
+static void rename_phi_args(QBEBlock* block, const char* from, char* to) {
+    for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+        QBEStatement* st = &block->statements[i];
+        if (st->type != QST_ASSIGN || st->assign.instruction.type != QIT_PHI) break;
+        for (ptrdiff_t a = 0; a < arrlen(st->assign.instruction.phi.args); a++) {
+            if (strcmp(st->assign.instruction.phi.args[a].label, from) == 0) st->assign.instruction.phi.args[a].label = to;
+        }
+    }
+}
+
+// Replaces the call at `index` of block `b` with a copy of `callee`. Everything after the call moves into a new block
+// the returns of the copy jump to, which starts with a phi of what they return in place of the call.
+// Returns the index of that block
+static ptrdiff_t inline_call(QBEFunction* caller, ptrdiff_t b, ptrdiff_t index, const QBEFunction* callee, size_t id) {
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "inl%zu.", id);
+    assert(qbe_function_find_block(callee, "ret") == -1);
+    QBEStatement call = caller->blocks[b].statements[index];
+    const QBECallArg* args = call.assign.instruction.call.args;
+    assert(arrlen(args) == arrlen(callee->params));
+
+    Renames renames = {0};
+    for (ptrdiff_t p = 0; p < arrlen(callee->params); p++) shput(renames.values, callee->params[p].name, args[p].value);
+    for (ptrdiff_t cb = 0; cb < arrlen(callee->blocks); cb++) {
+        const QBEBlock* block = &callee->blocks[cb];
+        shput(renames.labels, block->name, prefixed(prefix, block->name));
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            if (block->statements[i].type != QST_ASSIGN) continue;
+            char* name = block->statements[i].assign.value.name;
+            shput(renames.values, name, ((QBEValue) { .kind = QVK_TEMP, .name = prefixed(prefix, name) }));
+        }
+    }
+
+    QBEBlock* clones = NULL;
+    // Stack slots go into the entry of the caller, so a loop around the call doesn't allocate again and again
+    QBEStatement* slots = NULL;
+    QBEPhiArg* results = NULL;
+    char* cont = prefixed(prefix, "ret");
+    for (ptrdiff_t cb = 0; cb < arrlen(callee->blocks); cb++) {
+        const QBEBlock* block = &callee->blocks[cb];
+        QBEBlock clone = { .name = rename_label(&renames, block->name) };
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            const QBEStatement st = clone_statement(&renames, &block->statements[i]);
+            if (st.type == QST_ASSIGN && st.assign.instruction.type == QIT_ALLOC8) {
+                arrput(slots, st);
+            } else {
+                arrput(clone.statements, st);
+            }
+        }
+        const QBEInstruction* jump = &block->jump;
+        switch (jump->type) {
+            case QIT_RETURN: {
+                const QBEPhiArg result = { .label = clone.name, .value = rename_value(&renames, jump->ret) };
+                arrput(results, result);
+                clone.jump = (QBEInstruction) { .type = QIT_JMP, .jmp = { .label = cont } };
+                break;
+            }
+            case QIT_JMP: clone.jump = (QBEInstruction) { .type = QIT_JMP, .jmp = { .label = rename_label(&renames, jump->jmp.label) } }; break;
+            case QIT_JNZ: {
+                clone.jump = (QBEInstruction) { .type = QIT_JNZ, .jnz = {
+                    .then = rename_label(&renames, jump->jnz.then),
+                    .otherwise = rename_label(&renames, jump->jnz.otherwise),
+                    .value = rename_value(&renames, jump->jnz.value),
+                } };
+                break;
+            }
+            default: assert(false && "Not a jump");
+        }
+        arrput(clones, clone);
+    }
+    shfree(renames.values);
+    shfree(renames.labels);
+
+    QBEBlock* block = &caller->blocks[b];
+    QBEBlock rest = { .name = cont, .jump = block->jump };
+    qbe_block_assign_ins(&rest, (QBEInstruction) { .type = QIT_PHI, .phi.args = results }, call.assign.type, call.assign.value);
+    for (ptrdiff_t i = index + 1; i < arrlen(block->statements); i++) arrput(rest.statements, block->statements[i]);
+    for (ptrdiff_t s = 0; s < arrlen(block->succs); s++) rename_phi_args(&caller->blocks[block->succs[s]], block->name, cont);
+    arrfree(call.assign.instruction.call.args);
+    arrsetlen(block->statements, index);
+    block->jump = (QBEInstruction) { .type = QIT_JMP, .jmp = { .label = clones[0].name } };
+    arrput(clones, rest);
+
+    // Right after the call so the copy falls through from it
+    const ptrdiff_t at = b + 1;
+    const ptrdiff_t count = arrlen(clones);
+    (void)arraddnptr(caller->blocks, count);
+    memmove(&caller->blocks[at + count], &caller->blocks[at], (arrlen(caller->blocks) - at - count) * sizeof(QBEBlock));
+    memcpy(&caller->blocks[at], clones, count * sizeof(QBEBlock));
+    arrfree(clones);
+
+    const ptrdiff_t slot_count = arrlen(slots);
+    if (slot_count > 0) {
+        QBEBlock* entry = &caller->blocks[0];
+        (void)arraddnptr(entry->statements, slot_count);
+        memmove(&entry->statements[slot_count], entry->statements, (arrlen(entry->statements) - slot_count) * sizeof(QBEStatement));
+        memcpy(entry->statements, slots, slot_count * sizeof(QBEStatement));
+        arrfree(slots);
+    }
+
+    qbe_function_link(caller);
+    return at + count - 1;
+}
+
+static size_t inline_calls(Inliner* inliner, ptrdiff_t f) {
+    QBEFunction* caller = &inliner->module->functions[f];
+    size_t id = next_inline_id(caller);
+    size_t inlined = 0;
+    for (ptrdiff_t b = 0; b < arrlen(caller->blocks); b++) {
+        for (ptrdiff_t i = 0; i < arrlen(caller->blocks[b].statements); i++) {
+            const QBEStatement* st = &caller->blocks[b].statements[i];
+            if (!is_call(st)) continue;
+            const ptrdiff_t callee = function_index(inliner, st->assign.instruction.call.name);
+            if (callee == -1 || !should_inline(inliner, f, callee, &st->assign.instruction)) continue;
+            // The calls of the copy were already looked at when the callee was, so carry on with what
+            // came after the call
+            b = inline_call(caller, b, i, &inliner->module->functions[callee], id++) - 1;
+            inlined++;
+            break;
+        }
+    }
+    return inlined;
+}
+
+size_t inline_functions(QBEModule* module, const PassOptions* options) {
+    Inliner inliner = { .module = module, .options = options };
+    const ptrdiff_t n = arrlen(module->functions);
+    inliner.order = malloc((n + 1) * sizeof(ptrdiff_t));
+    inliner.low = malloc((n + 1) * sizeof(ptrdiff_t));
+    inliner.component = malloc((n + 1) * sizeof(ptrdiff_t));
+    inliner.on_stack = calloc(n + 1, sizeof(bool));
+    assert(inliner.order && inliner.low && inliner.component && inliner.on_stack);
+    for (ptrdiff_t f = 0; f < n; f++) {
+        shput(inliner.index, module->functions[f].name, f);
+        inliner.order[f] = -1;
+    }
+    for (ptrdiff_t f = 0; f < n; f++) {
+        if (inliner.order[f] == -1) inliner_visit(&inliner, f);
+    }
+
+    size_t changes = 0;
+    for (ptrdiff_t i = 0; i < arrlen(inliner.bottom_up); i++) changes += inline_calls(&inliner, inliner.bottom_up[i]);
+
+    shfree(inliner.index);
+    arrfree(inliner.stack);
+    arrfree(inliner.bottom_up);
+    free(inliner.order);
+    free(inliner.low);
+    free(inliner.component);
+    free(inliner.on_stack);
+    return changes;
+}
@@ -0,0 +1,30 @@
+#include "intern.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../extern/stb_ds.h"
+
+char* intern(Interner* interner, const char* str) {
+    if (interner->strings == NULL) sh_new_arena(interner->strings);
+    ptrdiff_t i = shgeti(interner->strings, str);
+    if (i == -1) {
+        shput(interner->strings, str, 0);
+        i = shgeti(interner->strings, str);
+    }
+    return interner->strings[i].key;
+}
+
+char* intern_n(Interner* interner, const char* str, size_t len) {
+    char small[128];
+    char* buffer = len < sizeof(small) ? small : malloc(len + 1);
+    assert(buffer);
+    memcpy(buffer, str, len);
+    buffer[len] = 0;
+    char* result = intern(interner, buffer);
+    if (buffer != small) free(buffer);
+    return result;
+}
+
+void interner_free(Interner* interner) {
+    shfree(interner->strings);
+}
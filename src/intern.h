@@ -0,0 +1,16 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+
+// Every distinct string is stored once, so interned strings can be compared by pointer
+typedef struct {
+    struct { char* key; char value; }* strings;
+} Interner;
+
+char* intern(Interner* interner, const char* str);
+// Same as intern() but for strings that aren't null terminated
+char* intern_n(Interner* interner, const char* str, size_t len);
+void interner_free(Interner* interner);
+
+#endif
@@ -74,11 +74,7 @@ bool lexer_parse_token(Lexer* lexer) {
         const char* begin = lexer->source.current;
         Location loc = lexer->source.loc;
         const char* end = lexer_skip_while(lexer, isidentchar);
-        ptrdiff_t len = end - begin;
-        char* str = arena_alloc(lexer->arena, len + 1);
-        strncpy(str, begin,
-                     len);
-        str[len] = 0;
+        char* str = intern_n(lexer->interner, begin, end - begin);
         Token token = {
             .type = TT_IDENT,
             .loc = loc,
@@ -121,6 +117,21 @@ bool lexer_parse_token(Lexer* lexer) {
             token.as.ident = NULL;
             token.as.keyword = TK_FN;
         }
+        if (strcmp(str, "const") == 0) {
+            token.type = TT_KEYWORD;
+            token.as.ident = NULL;
+            token.as.keyword = TK_CONST;
+        }
+        if (strcmp(str, "inline") == 0) {
+            token.type = TT_KEYWORD;
+            token.as.ident = NULL;
+            token.as.keyword = TK_INLINE;
+        }
+        if (strcmp(str, "noinline") == 0) {
+            token.type = TT_KEYWORD;
+            token.as.ident = NULL;
+            token.as.keyword = TK_NOINLINE;
+        }
         arrput(lexer->tokens, token);
         return true;
     }
@@ -302,6 +313,9 @@ void token_print(Token t) {
                 case TK_TRUE: keyword_display = "true"; break;
                 case TK_FALSE: keyword_display = "false"; break;
                 case TK_FN: keyword_display = "fn"; break;
+                case TK_CONST: keyword_display = "const"; break;
+                case TK_INLINE: keyword_display = "inline"; break;
+                case TK_NOINLINE: keyword_display = "noinline"; break;
             }
             printf("%lu:%lu %s\n", t.loc.row, t.loc.col, keyword_display);
             break;
@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "arena.h"
+#include "intern.h"
 
 // Rust has been permanentely printed
 // into my brain stem
@@ -30,6 +31,9 @@ typedef enum {
     TK_FALSE,
     TK_TRUE,
     TK_FN,
+    TK_CONST,
+    TK_INLINE,
+    TK_NOINLINE,
 } TokenKeyword;
 
 // One indexed location
@@ -63,6 +67,8 @@ typedef struct {
     // This arena should live for the entirety of the int main() lifetime
     // Rust begin embroidered into my brain stem AGAIN
     Arena* arena;
+    // Identifiers are interned so later stages can compare names by pointer
+    Interner* interner;
     LexerError error;
 } Lexer;
 
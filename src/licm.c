@@ -0,0 +1,254 @@
+#include "passes.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../extern/stb_ds.h"
+#include "cfg.h"
+#include "dataflow.h"
+
+static bool is_phi(const QBEStatement* st) {
+    return st->type == QST_ASSIGN && st->assign.instruction.type == QIT_PHI;
+}
+
+// The only block outside of the loop jumping to its header, -1 if there's more than one
+static ptrdiff_t loop_entry(const QBEFunction* function, const CfgLoop* loop) {
+    const QBEBlock* header = &function->blocks[loop->header];
+    ptrdiff_t entry = -1;
+    for (ptrdiff_t p = 0; p < arrlen(header->preds); p++) {
+        if (loop->contains[header->preds[p]]) continue;
+        if (entry != -1) return -1;
+        entry = header->preds[p];
+    }
+    return entry;
+}
+
+static ptrdiff_t loop_preheader(const QBEFunction* function, const CfgLoop* loop) {
+    const ptrdiff_t entry = loop_entry(function, loop);
+    if (entry == -1 || arrlen(function->blocks[entry].succs) != 1) return -1;
+    return entry;
+}
+
+static void retarget_label(char** label, const char* from, char* to) {
+    if (strcmp(*label, from) == 0) *label = to;
+}
+
+// Puts a block in front of the header that every edge coming from outside of the loop goes through
+// instead. Phi args from those edges move into phis of the new block. The function has to be linked again after
+static void insert_preheader(QBEFunction* function, const CfgLoop* loop) {
+    QBEBlock* header = &function->blocks[loop->header];
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%s.pre", header->name);
+    assert(qbe_function_find_block(function, buffer) == -1);
+    QBEBlock preheader = {
+        .name = strdup(buffer),
+        .jump = { .type = QIT_JMP, .jmp = { .label = header->name } },
+    };
+
+    for (ptrdiff_t p = 0; p < arrlen(header->preds); p++) {
+        if (loop->contains[header->preds[p]]) continue;
+        QBEInstruction* jump = &function->blocks[header->preds[p]].jump;
+        if (jump->type == QIT_JMP) retarget_label(&jump->jmp.label, header->name, preheader.name);
+        if (jump->type == QIT_JNZ) {
+            retarget_label(&jump->jnz.then, header->name, preheader.name);
+            retarget_label(&jump->jnz.otherwise, header->name, preheader.name);
+        }
+    }
+
+    for (ptrdiff_t i = 0; i < arrlen(header->statements) && is_phi(&header->statements[i]); i++) {
+        QBEStatement* phi = &header->statements[i];
+        QBEPhiArg* inside = NULL;
+        QBEPhiArg* outside = NULL;
+        QBEPhiArg* args = phi->assign.instruction.phi.args;
+        for (ptrdiff_t a = 0; a < arrlen(args); a++) {
+            const ptrdiff_t pred = qbe_function_find_block(function, args[a].label);
+            if (loop->contains[pred]) {
+                arrput(inside, args[a]);
+            } else {
+                arrput(outside, args[a]);
+            }
+        }
+        arrfree(args);
+
+        QBEPhiArg merged = { .label = preheader.name };
+        if (arrlen(outside) == 1) {
+            merged.value = outside[0].value;
+            arrfree(outside);
+        } else {
+            snprintf(buffer, sizeof(buffer), "%s.pre", phi->assign.value.name);
+            merged.value = (QBEValue) { .kind = QVK_TEMP, .name = strdup(buffer) };
+            qbe_block_assign_ins(&preheader, (QBEInstruction) { .type = QIT_PHI, .phi.args = outside }, phi->assign.type, merged.value);
+        }
+        arrput(inside, merged);
+        phi->assign.instruction.phi.args = inside;
+    }
+
+    // Right in front of the header so it falls through into it
+    const ptrdiff_t at = loop->header;
+    arrput(function->blocks, preheader);
+    memmove(&function->blocks[at + 1], &function->blocks[at], (arrlen(function->blocks) - at - 1) * sizeof(QBEBlock));
+    function->blocks[at] = preheader;
+}
+
+// Gives every loop a preheader, the names of the ones that had to be inserted get put into `inserted`
+static void insert_preheaders(QBEFunction* function, char*** inserted) {
+    // Inserting moves the blocks around, so the loops get found again after every one
+    bool done = false;
+    while (!done) {
+        done = true;
+        Cfg cfg = cfg_build(function);
+        CfgLoop* loops = cfg_find_loops(&cfg);
+        for (ptrdiff_t l = 0; l < arrlen(loops); l++) {
+            // Nothing can go in front of the entry
+            if (loops[l].header == 0 || loop_preheader(function, &loops[l]) != -1) continue;
+            insert_preheader(function, &loops[l]);
+            qbe_function_link(function);
+            // The preheader took the place of the header
+            arrput(*inserted, function->blocks[loops[l].header].name);
+            done = false;
+            break;
+        }
+        cfg_loops_free(loops);
+        cfg_free(&cfg);
+    }
+}
+
+// Inserted preheaders nothing got hoisted into go away again, unless they merge phis
+static void remove_empty_preheaders(QBEFunction* function, char** inserted) {
+    for (ptrdiff_t i = 0; i < arrlen(inserted); i++) {
+        const ptrdiff_t p = qbe_function_find_block(function, inserted[i]);
+        QBEBlock* preheader = &function->blocks[p];
+        if (arrlen(preheader->statements) > 0 || arrlen(preheader->preds) != 1) continue;
+        char* header = preheader->jump.jmp.label;
+        QBEInstruction* jump = &function->blocks[preheader->preds[0]].jump;
+        if (jump->type == QIT_JMP) retarget_label(&jump->jmp.label, preheader->name, header);
+        if (jump->type == QIT_JNZ) {
+            retarget_label(&jump->jnz.then, preheader->name, header);
+            retarget_label(&jump->jnz.otherwise, preheader->name, header);
+        }
+        QBEBlock* header_block = &function->blocks[preheader->succs[0]];
+        for (ptrdiff_t s = 0; s < arrlen(header_block->statements) && is_phi(&header_block->statements[s]); s++) {
+            QBEPhiArg* args = header_block->statements[s].assign.instruction.phi.args;
+            for (ptrdiff_t a = 0; a < arrlen(args); a++) {
+                retarget_label(&args[a].label, preheader->name, function->blocks[preheader->preds[0]].name);
+            }
+        }
+        qbe_block_free(preheader);
+        free(preheader->name);
+        arrdel(function->blocks, p);
+        // The edges are only looked at for the preheaders still to come, which don't depend on this one
+        qbe_function_link(function);
+    }
+}
+
+typedef struct {
+    QBEFunction* function;
+    TempIds temps;
+    // Block defining every temporary, -1 for params
+    ptrdiff_t* def_block;
+    // Slots stored into by the loop being looked at
+    bool* stored;
+} Licm;
+
+static bool is_invariant(const Licm* licm, const CfgLoop* loop, const char* name) {
+    const ptrdiff_t def = licm->def_block[temp_ids_get(&licm->temps, name)];
+    return def == -1 || !loop->contains[def];
+}
+
+static bool can_hoist(const Licm* licm, const CfgLoop* loop, const QBEStatement* st) {
+    if (st->type != QST_ASSIGN) return false;
+    const QBEInstruction* ins = &st->assign.instruction;
+    switch (ins->type) {
+        case QIT_ADD: case QIT_SUB: case QIT_MUL: case QIT_SHL: case QIT_SAR: case QIT_SHR:
+        case QIT_EXT: case QIT_CMP: break;
+        // The loop might never get to the division, so only ones that can't trap
+        case QIT_DIV: case QIT_UDIV: {
+            const QBEValue* divisor = &ins->div.right;
+            if (divisor->kind != QVK_CONST || divisor->const_i == 0) return false;
+            if (ins->type == QIT_DIV && (divisor->const_i == UINT64_MAX || divisor->const_i == UINT32_MAX)) return false;
+            break;
+        }
+        case QIT_LOAD: {
+            if (licm->stored[temp_ids_get(&licm->temps, ins->load.name)]) return false;
+            break;
+        }
+        default: return false;
+    }
+    const char* uses[QBE_MAX_USES];
+    const size_t count = qbe_instruction_uses(ins, uses);
+    for (size_t u = 0; u < count; u++) {
+        if (!is_invariant(licm, loop, uses[u])) return false;
+    }
+    return true;
+}
+
+// Blocks of the loop are visited in reverse postorder, so whatever an instruction uses from inside
+// the loop was already looked at
+static size_t hoist_loop(Licm* licm, const CfgLoop* loop) {
+    QBEFunction* function = licm->function;
+    const ptrdiff_t preheader = loop_preheader(function, loop);
+    if (preheader == -1) return 0;
+
+    memset(licm->stored, 0, arrlen(licm->temps.names) * sizeof(bool));
+    for (ptrdiff_t i = 0; i < arrlen(loop->blocks); i++) {
+        const QBEBlock* block = &function->blocks[loop->blocks[i]];
+        for (ptrdiff_t s = 0; s < arrlen(block->statements); s++) {
+            const QBEStatement* st = &block->statements[s];
+            if (st->type == QST_THROWAWAY && st->throwaway.type == QIT_STORE) {
+                licm->stored[temp_ids_get(&licm->temps, st->throwaway.store.name)] = true;
+            }
+        }
+    }
+
+    size_t hoisted = 0;
+    for (ptrdiff_t i = 0; i < arrlen(loop->blocks); i++) {
+        QBEBlock* block = &function->blocks[loop->blocks[i]];
+        ptrdiff_t kept = 0;
+        for (ptrdiff_t s = 0; s < arrlen(block->statements); s++) {
+            const QBEStatement st = block->statements[s];
+            if (!can_hoist(licm, loop, &st)) {
+                block->statements[kept++] = st;
+                continue;
+            }
+            arrput(function->blocks[preheader].statements, st);
+            licm->def_block[temp_ids_get(&licm->temps, st.assign.value.name)] = preheader;
+            hoisted++;
+        }
+        if (kept < arrlen(block->statements)) arrsetlen(block->statements, kept);
+    }
+    return hoisted;
+}
+
+size_t loop_invariant_code_motion(QBEFunction* function) {
+    char** inserted = NULL;
+    insert_preheaders(function, &inserted);
+    size_t changes = 0;
+
+    Licm licm = { .function = function, .temps = temp_ids_build(function) };
+    const ptrdiff_t temp_count = arrlen(licm.temps.names);
+    licm.def_block = malloc((temp_count + 1) * sizeof(ptrdiff_t));
+    licm.stored = calloc(temp_count + 1, sizeof(bool));
+    assert(licm.def_block && licm.stored);
+    for (ptrdiff_t t = 0; t < temp_count; t++) licm.def_block[t] = -1;
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        const QBEBlock* block = &function->blocks[b];
+        for (ptrdiff_t s = 0; s < arrlen(block->statements); s++) {
+            if (block->statements[s].type != QST_ASSIGN) continue;
+            licm.def_block[temp_ids_get(&licm.temps, block->statements[s].assign.value.name)] = b;
+        }
+    }
+
+    // Inner loops first, what they hoist ends up in the outer loop and can move further out from there
+    Cfg cfg = cfg_build(function);
+    CfgLoop* loops = cfg_find_loops(&cfg);
+    for (ptrdiff_t l = 0; l < arrlen(loops); l++) changes += hoist_loop(&licm, &loops[l]);
+    cfg_loops_free(loops);
+    cfg_free(&cfg);
+    remove_empty_preheaders(function, inserted);
+    arrfree(inserted);
+
+    temp_ids_free(&licm.temps);
+    free(licm.def_block);
+    free(licm.stored);
+    return changes;
+}
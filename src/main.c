@@ -1,8 +1,12 @@
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #define STB_DS_IMPLEMENTATION
 #include "../extern/stb_ds.h"
@@ -13,11 +17,17 @@
 #include "qbe.h"
 #include "codegen.h"
 #include "type_checker.h"
+#include "ast_cache.h"
+#include "passes.h"
 
 #define NOB_IMPLEMENTATION
 #define NOB_STRIP_PREFIX
 #include "../nob.h"
 
+#define DEFAULT_INLINE_BUDGET 40
+// How often watch mode checks the input for changes
+#define WATCH_INTERVAL_MS 200
+
 // Returns a null terminaed string of the file in `name`
 // On any error (except malloc) prints error with perror and returns NULL
 char* read_file(const char* name);
@@ -30,86 +40,191 @@ const char* TokenTypeReadable[TT_COUNT] = {
 typedef struct {
     char* input_name;
     char* output_name;
+    char* cache_dir;
+    int opt_level;
+    // Overrides the passes of the -O level when set
+    char* passes;
+    bool pass_stats;
+    size_t inline_budget;
+    // Recompile whenever the input changes instead of exiting
+    bool watch;
 } Args;
 
 Args parse_from_argv(int argc, char** argv);
-Lexer lex_file(char* content, char* content_file_name, Arena* arena);
+Lexer lex_file(char* content, char* content_file_name, Arena* arena, Interner* interner);
 Parser parse_file(Token* tokens, Arena* arena, char* file_name);
-bool write_and_compile_ir(Codegen* codegen, Statement* statements, char* out_name);
-
-int main(int argc, char** argv) {
-    Args args = parse_from_argv(argc, argv);
-    if (args.input_name == NULL) return 1;
+bool write_and_compile_ir(Codegen* codegen, char* out_name);
 
-    char* file_content = read_file(args.input_name);
+// Compiles one version of the input. In watch mode `items` holds the top level items of the
+// previous version so only the changed ones get parsed again, `interner` outlives every version
+// since the reused items keep pointing at its names
+int compile(const Args* args, char* file_content, Interner* interner, ParserItems* items) {
+    int result = 0;
     Arena arena = arena_new(1024 * 10);
 
-    Lexer lexer = lex_file(file_content, args.input_name, &arena);
-    if (lexer.tokens == NULL) return 1;
+    Lexer lexer = {0};
+    Parser parser = {0};
+    AstCache cache = {0};
+    char* cache_path = NULL;
+    TypeTable types = type_table_new();
+    TypeChecker checker = {0};
+    PassManager passes = { .options = { .inline_budget = args->inline_budget } };
+    Codegen codegen = {0};
+
+    const uint64_t source_hash = ast_cache_hash(file_content);
+    if (args->cache_dir != NULL) {
+        cache_path = ast_cache_path(args->cache_dir, source_hash);
+        if (ast_cache_load(cache_path, source_hash, interner, &cache)) parser.statements = cache.statements;
+    }
 
-    Parser parser = parse_file(lexer.tokens, &arena, args.input_name);
     if (parser.statements == NULL) {
-        free(file_content);
-        arrfree(lexer.tokens);
-        arena_delete(&arena);
-        return 1;
-    } 
-    TypeChecker checker = {
+        lexer = lex_file(file_content, args->input_name, &arena, interner);
+        if (lexer.tokens == NULL) return_defer(1);
+
+        if (items != NULL) {
+            parser = (Parser) {
+                .token_origin = args->input_name,
+                .tokens = lexer.tokens,
+                .arena = &arena,
+            };
+            if (!parser_reparse(&parser, items)) return_defer(1);
+        } else {
+            parser = parse_file(lexer.tokens, &arena, args->input_name);
+        }
+        if (parser.statements == NULL) return_defer(1);
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    checker = (TypeChecker) {
         .ast = parser.statements,
+        .types = &types,
         .err = false,
         .vars = NULL,
+        .symbols = {0},
+        .functions = NULL,
+        .errors = NULL,
+        .thread_count = cores > 0 ? cores : 1,
+        .cache_dir = args->cache_dir,
     };
 
-    if (type_check(&checker)) {
-        fprintf(stderr, "Found type error :)\n");
-        return 1;
+    // A checked cache hit already carries every annotation of the checker
+    if (!cache.is_checked) {
+        const bool type_error = type_check(&checker);
+        // Stored after checking so the next run can skip it, or at least the parsing when it failed
+        if (cache_path != NULL && (cache.statements == NULL || !type_error)) ast_cache_store(cache_path, source_hash, parser.statements, !type_error);
+        if (type_error) {
+            for (ptrdiff_t i = 0; i < arrlen(checker.errors); i++) {
+                checker_error_display(checker.errors[i], file_content, args->input_name);
+            }
+            fprintf(stderr, "Found type error :)\n");
+            return_defer(1);
+        }
     }
 
-    QBEModule mod = qbe_module_new();
-    QBEFunction* main = qbe_module_create_function(&mod, "main", QVT_WORD);
-    QBEBlock* entry = qbe_function_push_block(main, "entry");
+    if (!pass_manager_add(&passes, args->passes != NULL ? args->passes : pass_preset(args->opt_level))) return_defer(1);
 
-    Codegen codegen = {
-        .mod = mod, 
-        .main = main, 
-        .entry = entry, 
+    codegen = (Codegen) {
+        .mod = qbe_module_new(),
+        .types = &types,
         .temp_count = 0, 
         .variables = NULL,
+        .slots = NULL,
+        .live_slots = 0,
+        .slot_scopes = NULL,
+        // Without a pass that makes use of it every variable stays in a stack slot
+        .ssa = pass_manager_wants_ssa(&passes),
     };
 
-    if (!write_and_compile_ir(&codegen, parser.statements, args.output_name)) return 1;
+    generate_code(&codegen, parser.statements);
+    if (arrlen(codegen.errors) > 0) {
+        for (ptrdiff_t i = 0; i < arrlen(codegen.errors); i++) {
+            codegen_error_display(codegen.errors[i], file_content, args->input_name);
+        }
+        return_defer(1);
+    }
+    pass_manager_run(&passes, &codegen.mod);
+    if (args->pass_stats) pass_manager_print_stats(&passes, stderr);
+    if (!write_and_compile_ir(&codegen, args->output_name)) return_defer(1);
 
-    free(file_content);
+defer:
+    free(cache_path);
     arrfree(lexer.tokens);
-    arrfree(parser.statements);
-    for (ptrdiff_t i = 0; i < arrlen(codegen.variables); i++) {
-        free(codegen.variables[i].name);
-        free(codegen.variables[i].ptr_name);
-    }
+    statements_free(parser.statements);
+    ast_cache_free(&cache);
+    type_checker_free(&checker);
+    type_table_free(&types);
     arrfree(codegen.variables);
+    arrfree(codegen.slots);
+    arrfree(codegen.slot_scopes);
+    arrfree(codegen.unshared_slots);
+    hmfree(codegen.unset_variables);
+    arrfree(codegen.errors);
 
     arena_delete(&arena);
-    qbe_module_destroy(&mod);
+    qbe_module_destroy(&codegen.mod);
+    pass_manager_free(&passes);
+    return result;
+}
+
+// Compiles the input again every time it gets written to, until killed
+int watch(const Args* args) {
+    Interner interner = {0};
+    ParserItems items = {0};
+    struct timespec modified = {0};
+    bool compiled = false;
+    uint64_t compiled_hash = 0;
+    while (true) {
+        struct stat info;
+        // Editors that save by renaming leave a short window without the file, just retry
+        if (stat(args->input_name, &info) == 0 &&
+            (info.st_mtim.tv_sec != modified.tv_sec || info.st_mtim.tv_nsec != modified.tv_nsec)) {
+            modified = info.st_mtim;
+            char* file_content = read_file(args->input_name);
+            // A save can touch the file more than once, only new content gets compiled
+            if (file_content != NULL && (!compiled || ast_cache_hash(file_content) != compiled_hash)) {
+                compiled = true;
+                compiled_hash = ast_cache_hash(file_content);
+                const int result = compile(args, file_content, &interner, &items);
+                fprintf(stderr, "[INFO] %s `%s`, watching for changes\n", result == 0 ? "Compiled" : "Failed to compile", args->input_name);
+            }
+            free(file_content);
+        }
+        usleep(WATCH_INTERVAL_MS * 1000);
+    }
+}
+
+int main(int argc, char** argv) {
+    Args args = parse_from_argv(argc, argv);
+    if (args.input_name == NULL) return 1;
+    // Every version compiled by watch() shares the directory
+    if (args.cache_dir != NULL && !mkdir_if_not_exists(args.cache_dir)) args.cache_dir = NULL;
+    if (args.watch) return watch(&args);
 
-	return 0;
+    char* file_content = read_file(args.input_name);
+    if (file_content == NULL) return 1;
+    Interner interner = {0};
+    const int result = compile(&args, file_content, &interner, NULL);
+    free(file_content);
+    interner_free(&interner);
+	return result;
 }
 
-bool write_and_compile_ir(Codegen* codegen, Statement* statements, char* out_name) {
-    generate_code(codegen, statements);
+bool write_and_compile_ir(Codegen* codegen, char* out_name) {
 
     FILE* qbe_ir_file = fopen("main.ssa", "w");
     qbe_module_write(&codegen->mod, qbe_ir_file);
     fclose(qbe_ir_file);
 
+    bool result = true;
     Cmd cmd = {0};
     cmd_append(&cmd, "qbe", "-o", "main.s", "main.ssa");
-    if (!cmd_run_sync_and_reset(&cmd)) return false;
+    if (!cmd_run_sync_and_reset(&cmd)) return_defer(false);
     cmd_append(&cmd, "cc", "-o", out_name, "main.s");
-    if (!cmd_run_sync_and_reset(&cmd)) return false;
+    if (!cmd_run_sync_and_reset(&cmd)) return_defer(false);
     // cmd_append(&cmd, "rm", "main.s", "main.ssa");
     // if (!cmd_run_sync_and_reset(&cmd)) return false;
+defer:
     free(cmd.items);
-    return true;
+    return result;
 }
 
 void usage(const char* prog_name) {
@@ -117,12 +232,21 @@ void usage(const char* prog_name) {
     fprintf(stderr, "    %s <input.nsl> [OPTIONS]\n", prog_name);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -o <output> : specifies the output executable name\n");
+    fprintf(stderr, "    --cache <dir> : reuse the parsed ast of unchanged inputs from <dir>\n");
+    fprintf(stderr, "    -O0, -O1, -O2 : optimization level, defaults to -O1\n");
+    fprintf(stderr, "    --passes=<a,b,...> : run these passes instead of the ones of the -O level, variables only get out of\n");
+    fprintf(stderr, "                         their stack slots if one of sccp, lvn, gvn, licm or indvars is among them\n");
+    fprintf(stderr, "    --pass-stats : print how long every pass took and how many changes it made\n");
+    fprintf(stderr, "    --watch : compile again every time the input changes, only reparsing the top level items that changed\n");
+    fprintf(stderr, "    --inline-budget=<n> : how many instructions bigger than the call it replaces a function can be to get inlined, defaults to %d\n", DEFAULT_INLINE_BUDGET);
 }
 
 
 Args parse_from_argv(int argc, char** argv) {
     Args args = {0};
     args.output_name = "a.out";
+    args.opt_level = 1;
+    args.inline_budget = DEFAULT_INLINE_BUDGET;
     for (int i = 1; i < argc; i++) {
         if (strcmp("-o", argv[i]) == 0) {
             if (i + 1 >= argc) {
@@ -132,6 +256,36 @@ Args parse_from_argv(int argc, char** argv) {
             }
             args.output_name = argv[i + 1];
             i++;
+        } else if (strcmp("--cache", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "ERROR: Cache directory not specified\n");
+                usage(argv[0]);
+                return (Args){0};
+            }
+            args.cache_dir = argv[i + 1];
+            i++;
+        } else if (strncmp("-O", argv[i], 2) == 0) {
+            const bool is_level = isdigit((unsigned char)argv[i][2]) && argv[i][3] == '\0';
+            if (!is_level || pass_preset(argv[i][2] - '0') == NULL) {
+                fprintf(stderr, "ERROR: Unknown optimization level `%s`\n", argv[i]);
+                usage(argv[0]);
+                return (Args){0};
+            }
+            args.opt_level = argv[i][2] - '0';
+        } else if (strncmp("--passes=", argv[i], 9) == 0) {
+            args.passes = argv[i] + 9;
+        } else if (strcmp("--pass-stats", argv[i]) == 0) {
+            args.pass_stats = true;
+        } else if (strcmp("--watch", argv[i]) == 0) {
+            args.watch = true;
+        } else if (strncmp("--inline-budget=", argv[i], 16) == 0) {
+            char* end;
+            args.inline_budget = strtoull(argv[i] + 16, &end, 10);
+            if (end == argv[i] + 16 || *end != '\0') {
+                fprintf(stderr, "ERROR: Invalid inline budget `%s`\n", argv[i] + 16);
+                usage(argv[0]);
+                return (Args){0};
+            }
         } else {
             args.input_name = argv[i];
         }
@@ -145,7 +299,7 @@ Args parse_from_argv(int argc, char** argv) {
     return args;
 }
 
-Lexer lex_file(char* content, char* content_file_name, Arena* arena) {
+Lexer lex_file(char* content, char* content_file_name, Arena* arena, Interner* interner) {
     Lexer lexer = {
         .source = {
             .first = content,
@@ -153,7 +307,8 @@ Lexer lex_file(char* content, char* content_file_name, Arena* arena) {
             .loc = {.col = 1, .row = 1},
         },
         .tokens = NULL, 
-        .arena = arena
+        .arena = arena,
+        .interner = interner,
     };
     
     while (!lexer_is_finished(&lexer)) {
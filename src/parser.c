@@ -1,6 +1,7 @@
 #include "parser.h"
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include "../extern/stb_ds.h"
 #include "arena.h"
@@ -35,6 +36,27 @@ bool parser_expect(Parser* parser, TokenType t, char* err_msg) {
     return true;
 }
 
+// `expr` becomes a call of `name`, the `(` of the args is the current token
+Expr* parser_call(Parser* parser, Expr* expr, char* name) {
+    parser_next(parser);
+    expr->type = ET_CALL;
+    expr->as.call.name = name;
+    expr->as.call.args = NULL;
+    while (!parser_is_finished(parser) && parser_peek(parser).type != TT_CLOSEPAREN) {
+        Expr* arg = parser_expr(parser, 0);
+        if (arg == NULL) {
+            fprintf(stderr, "Failed to parse function call argument\n");
+            return NULL;
+        }
+        arrput(expr->as.call.args, arg);
+        if (parser_is_finished(parser) || parser_peek(parser).type != TT_COMMA) break;
+        parser_next(parser);
+    }
+    if (!parser_expect(parser, TT_CLOSEPAREN, "Expected `)` after function call arguments")) return NULL;
+    parser_next(parser);
+    return expr;
+}
+
 Expr* parser_primary(Parser* parser) {
     Token t = parser_peek(parser);
     switch (t.type) {
@@ -61,9 +83,11 @@ Expr* parser_primary(Parser* parser) {
                 fprintf(stderr, "Failed to parse variable name expression value\n");
                 return false;
             }
-            expr->type = ET_VARIABLE;
-            expr->as.variable = t.as.ident;
             parser_next(parser);
+            if (!parser_is_finished(parser) && parser_peek(parser).type == TT_OPENPAREN) return parser_call(parser, expr, t.as.ident);
+            expr->type = ET_VARIABLE;
+            expr->as.variable.name = t.as.ident;
+            expr->as.variable.symbol = -1;
             return expr;
         }
         case TT_KEYWORD: {
@@ -130,10 +154,10 @@ bool parser_statement(Parser* parser, Statement** statements) {
     switch (t.type) {
         case TT_KEYWORD: {
             if (t.as.keyword == TK_RETURN) { if (!parser_return_statement(parser, statements)) { return false; } return true; }
-            if (t.as.keyword == TK_LET) {if (!parser_let_statement(parser, statements)) { return false; } return true; }
+            if (t.as.keyword == TK_LET || t.as.keyword == TK_CONST) {if (!parser_let_statement(parser, statements)) { return false; } return true; }
             if (t.as.keyword == TK_IF) {if (!parser_if_statement(parser, statements)) { return false; } return true; }
             if (t.as.keyword == TK_WHILE) {if (!parser_while_statement(parser, statements)) { return false; } return true; }
-            if (t.as.keyword == TK_FN) {if (!parser_fn_statement(parser, statements)) { return false; } return true; }
+            if (t.as.keyword == TK_FN || t.as.keyword == TK_INLINE || t.as.keyword == TK_NOINLINE) {if (!parser_fn_statement(parser, statements)) { return false; } return true; }
             break;
         }
         case TT_IDENT: {
@@ -156,6 +180,7 @@ bool parser_statement(Parser* parser, Statement** statements) {
                 .as.var_assign = {
                     .new_val = new_value,
                     .var = var_name,
+                    .symbol = -1,
                 }
             };
             arrput(*statements, st);
@@ -172,7 +197,8 @@ bool parser_statement(Parser* parser, Statement** statements) {
 }
 
 bool parser_let_statement(Parser* parser, Statement** statements) {
-    Location loc = parser_next(parser).loc; 
+    Token keyword = parser_next(parser);
+    Location loc = keyword.loc; 
     if (!parser_expect(parser, TT_IDENT, "Expected identifier after let")) return false;
     Token name = parser_next(parser);
     
@@ -182,13 +208,18 @@ bool parser_let_statement(Parser* parser, Statement** statements) {
     if (!parser_expect(parser, TT_IDENT, "Expected type after colon")) return false;
     Token type = parser_next(parser);
     
-    if (!parser_expect(parser, TT_EQUAL, "Expected equals sign after type")) return false;
-    parser_next(parser);
-    
-    Expr* expr = parser_expr(parser, 0);
-    if (expr == NULL) {
-        fprintf(stderr, "Failed to parse variable definition value expression\n");
-        return false;
+    const bool is_const = keyword.as.keyword == TK_CONST;
+    // Variables can get their first value later on, constants can't
+    Expr* expr = NULL;
+    if (is_const || parser_is_finished(parser) || parser_peek(parser).type != TT_SEMICOLON) {
+        if (!parser_expect(parser, TT_EQUAL, "Expected equals sign after type")) return false;
+        parser_next(parser);
+
+        expr = parser_expr(parser, 0);
+        if (expr == NULL) {
+            fprintf(stderr, "Failed to parse variable definition value expression\n");
+            return false;
+        }
     }
     
     if (!parser_expect(parser, TT_SEMICOLON, "Expected semicolon after variable definition")) return false;
@@ -200,7 +231,9 @@ bool parser_let_statement(Parser* parser, Statement** statements) {
         .as.var_def = {
             .name = name.as.ident,
             .type = type.as.ident,
-            .value = expr
+            .value = expr,
+            .symbol = -1,
+            .is_const = is_const,
         }
     };  
     arrput(*statements, st);
@@ -304,12 +337,23 @@ bool parser_fn_args(Parser* parser, FnArg** args) {
         if (parser_peek(parser).type != TT_COMMA) {
             break;
         } 
+        parser_next(parser);
     }
     return true;
 }
 
 bool parser_fn_statement(Parser* parser, Statement** statements) {
-    Location loc = parser_next(parser).loc;
+    Token first = parser_next(parser);
+    Location loc = first.loc;
+    FnInlineHint inline_hint = FIH_DEFAULT;
+    if (first.as.keyword == TK_INLINE || first.as.keyword == TK_NOINLINE) {
+        inline_hint = first.as.keyword == TK_INLINE ? FIH_INLINE : FIH_NOINLINE;
+        if (!parser_expect(parser, TT_KEYWORD, "Expected `fn` after inline attribute")) return false;
+        if (parser_next(parser).as.keyword != TK_FN) {
+            fprintf(stderr, "Expected `fn` after inline attribute\n");
+            return false;
+        }
+    }
 
     if (!parser_expect(parser, TT_IDENT, "Expected function name after `fn`")) return false;
     char* fn_name = parser_next(parser).as.ident;
@@ -339,10 +383,232 @@ bool parser_fn_statement(Parser* parser, Statement** statements) {
             .name = fn_name,
             .ret_type = ret_type,
             .body = sts,
-            .args = args
+            .args = args,
+            .inline_hint = inline_hint,
         }
     };
     arrput(*statements, fn);
 
     return true;
 }
+
+static uint64_t fingerprint_bytes(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t parser_fingerprint(const Parser* parser, ptrdiff_t begin, ptrdiff_t end) {
+    uint64_t hash = 14695981039346656037ULL;
+    const ptrdiff_t first_row = parser->tokens[begin].loc.row;
+    for (ptrdiff_t i = begin; i < end; i++) {
+        const Token* t = &parser->tokens[i];
+        const ptrdiff_t row = t->loc.row - first_row;
+        hash = fingerprint_bytes(hash, &t->type, sizeof(t->type));
+        hash = fingerprint_bytes(hash, &row, sizeof(row));
+        hash = fingerprint_bytes(hash, &t->loc.col, sizeof(t->loc.col));
+        switch (t->type) {
+            case TT_NUMBER: hash = fingerprint_bytes(hash, &t->as.number, sizeof(t->as.number)); break;
+            case TT_OPERATOR: hash = fingerprint_bytes(hash, &t->as.operator, sizeof(t->as.operator)); break;
+            case TT_IDENT: hash = fingerprint_bytes(hash, t->as.ident, strlen(t->as.ident)); break;
+            case TT_KEYWORD: hash = fingerprint_bytes(hash, &t->as.keyword, sizeof(t->as.keyword)); break;
+            default: break;
+        }
+    }
+    return hash;
+}
+
+// Finds where the top level item starting at `begin` ends without parsing it:
+// after a `;` or after the `}` that closes its outermost block
+static ptrdiff_t parser_item_end(const Parser* parser, ptrdiff_t begin) {
+    ptrdiff_t depth = 0;
+    for (ptrdiff_t i = begin; i < arrlen(parser->tokens); i++) {
+        switch (parser->tokens[i].type) {
+            case TT_OPENCURLY: depth++; break;
+            case TT_CLOSECURLY: {
+                depth--;
+                if (depth <= 0) return i + 1;
+                break;
+            }
+            case TT_SEMICOLON: {
+                if (depth == 0) return i + 1;
+                break;
+            }
+            default: break;
+        }
+    }
+    return arrlen(parser->tokens);
+}
+
+static Expr* expr_copy(const Expr* expr, Arena* arena) {
+    Expr* copy = arena_alloc(arena, sizeof(Expr));
+    *copy = *expr;
+    switch (expr->type) {
+        case ET_BINARY: {
+            copy->as.binary.left = expr_copy(expr->as.binary.left, arena);
+            copy->as.binary.right = expr_copy(expr->as.binary.right, arena);
+            break;
+        }
+        case ET_CALL: {
+            copy->as.call.args = NULL;
+            for (ptrdiff_t i = 0; i < arrlen(expr->as.call.args); i++) arrput(copy->as.call.args, expr_copy(expr->as.call.args[i], arena));
+            break;
+        }
+        default: break;
+    }
+    return copy;
+}
+
+static Statement statement_copy(const Statement* st, ptrdiff_t row_delta, Arena* arena);
+
+static Statement* body_copy(const Statement* body, ptrdiff_t row_delta, Arena* arena) {
+    Statement* copy = NULL;
+    for (ptrdiff_t i = 0; i < arrlen(body); i++) arrput(copy, statement_copy(&body[i], row_delta, arena));
+    return copy;
+}
+
+// Deep copy of `st` with every row moved by `row_delta`, names are interned so they're shared
+static Statement statement_copy(const Statement* st, ptrdiff_t row_delta, Arena* arena) {
+    Statement copy = *st;
+    copy.loc.row += row_delta;
+    switch (st->type) {
+        case ST_RETURN: copy.as.ret = expr_copy(st->as.ret, arena); break;
+        case ST_VARIABLE_DEFINE: {
+            if (st->as.var_def.value != NULL) copy.as.var_def.value = expr_copy(st->as.var_def.value, arena);
+            break;
+        }
+        case ST_SET_VARIABLE: copy.as.var_assign.new_val = expr_copy(st->as.var_assign.new_val, arena); break;
+        case ST_IF: {
+            copy.as.if_st.cond = expr_copy(st->as.if_st.cond, arena);
+            copy.as.if_st.body = body_copy(st->as.if_st.body, row_delta, arena);
+            break;
+        }
+        case ST_WHILE: {
+            copy.as.while_st.cond = expr_copy(st->as.while_st.cond, arena);
+            copy.as.while_st.body = body_copy(st->as.while_st.body, row_delta, arena);
+            break;
+        }
+        case ST_FN_DEFINITION: {
+            copy.as.fn_def.args = NULL;
+            for (ptrdiff_t i = 0; i < arrlen(st->as.fn_def.args); i++) arrput(copy.as.fn_def.args, st->as.fn_def.args[i]);
+            copy.as.fn_def.body = body_copy(st->as.fn_def.body, row_delta, arena);
+            break;
+        }
+        case ST_ERROR: break;
+    }
+    return copy;
+}
+
+static void expr_free(Expr* expr) {
+    switch (expr->type) {
+        case ET_BINARY: {
+            expr_free(expr->as.binary.left);
+            expr_free(expr->as.binary.right);
+            break;
+        }
+        case ET_CALL: {
+            for (ptrdiff_t i = 0; i < arrlen(expr->as.call.args); i++) expr_free(expr->as.call.args[i]);
+            arrfree(expr->as.call.args);
+            break;
+        }
+        default: break;
+    }
+}
+
+static void statement_free(Statement* st) {
+    switch (st->type) {
+        case ST_RETURN: expr_free(st->as.ret); break;
+        case ST_VARIABLE_DEFINE: {
+            if (st->as.var_def.value != NULL) expr_free(st->as.var_def.value);
+            break;
+        }
+        case ST_SET_VARIABLE: expr_free(st->as.var_assign.new_val); break;
+        case ST_IF: {
+            expr_free(st->as.if_st.cond);
+            statements_free(st->as.if_st.body);
+            break;
+        }
+        case ST_WHILE: {
+            expr_free(st->as.while_st.cond);
+            statements_free(st->as.while_st.body);
+            break;
+        }
+        case ST_FN_DEFINITION: {
+            arrfree(st->as.fn_def.args);
+            statements_free(st->as.fn_def.body);
+            break;
+        }
+        case ST_ERROR: break;
+    }
+}
+
+void statements_free(Statement* statements) {
+    for (ptrdiff_t i = 0; i < arrlen(statements); i++) statement_free(&statements[i]);
+    arrfree(statements);
+}
+
+bool parser_reparse(Parser* parser, ParserItems* items) {
+    // fingerprint -> first unused previous item with it, `next_same` chains the duplicates
+    struct { uint64_t key; ptrdiff_t value; }* previous = NULL;
+    ptrdiff_t* next_same = NULL;
+    hmdefault(previous, -1);
+    for (ptrdiff_t i = arrlen(items->items) - 1; i >= 0; i--) {
+        arrput(next_same, hmget(previous, items->items[i].fingerprint));
+        hmput(previous, items->items[i].fingerprint, i);
+    }
+
+    // The previous items are only read, reused ones get copied so the old version can be dropped as a whole
+    ParserItems new_items = { .arena = arena_new(items->arena.cap > 0 ? items->arena.cap : 1024 * 10) };
+    while (!parser_is_finished(parser)) {
+        const ptrdiff_t begin = parser->pos;
+        const ptrdiff_t end = parser_item_end(parser, begin);
+        const uint64_t fingerprint = parser_fingerprint(parser, begin, end);
+        const ptrdiff_t first_row = parser->tokens[begin].loc.row;
+
+        const ptrdiff_t reused = hmget(previous, fingerprint);
+        if (reused != -1) {
+            // next_same was filled back to front
+            hmput(previous, fingerprint, next_same[arrlen(items->items) - 1 - reused]);
+            const Statement* old = &items->items[reused].statement;
+            ParserItem item = {
+                .fingerprint = fingerprint,
+                .statement = statement_copy(old, 0, &new_items.arena),
+            };
+            arrput(new_items.items, item);
+            arrput(parser->statements, statement_copy(old, first_row, parser->arena));
+            parser->pos = end;
+            continue;
+        }
+
+        if (!parser_statement(parser, &parser->statements)) {
+            fprintf(stderr, "Failed to parse file due to invalid statement\n");
+            statements_free(parser->statements);
+            parser->statements = NULL;
+            parser_items_free(&new_items);
+            arrfree(next_same);
+            hmfree(previous);
+            return false;
+        }
+        ParserItem item = {
+            .fingerprint = parser_fingerprint(parser, begin, parser->pos),
+            .statement = statement_copy(&arrlast(parser->statements), -first_row, &new_items.arena),
+        };
+        arrput(new_items.items, item);
+    }
+
+    arrfree(next_same);
+    hmfree(previous);
+    parser_items_free(items);
+    *items = new_items;
+    return true;
+}
+
+void parser_items_free(ParserItems* items) {
+    for (ptrdiff_t i = 0; i < arrlen(items->items); i++) statement_free(&items->items[i].statement);
+    arrfree(items->items);
+    arena_delete(&items->arena);
+    *items = (ParserItems) {0};
+}
@@ -3,6 +3,7 @@
 
 #include "lexer.h"
 #include "arena.h"
+#include "types.h"
 
 #include <stdint.h>
 
@@ -10,16 +11,18 @@ typedef enum {
     ET_NUMBER,
     ET_BOOL,
     ET_VARIABLE,
-    ET_BINARY
+    ET_BINARY,
+    // <name>(<args>)
+    ET_CALL,
 } ExprType;
 
-typedef enum {
-    EVT_INT,
-    EVT_BOOL,
-} ExprValueType;
-
 typedef struct Expr {
     ExprType type;
+    // Filled in by the type checker
+    TypeId value_type;
+    // Filled in by the constant evaluator, `constant` is sign/zero extended from `value_type`
+    bool is_constant;
+    uint64_t constant;
     union {
         uint64_t number;
         struct {
@@ -27,15 +30,23 @@ typedef struct Expr {
             char op;
             struct Expr* right;
         } binary;
-        char* variable;
+        struct {
+            char* name;
+            // Id of the variable inside of its function, resolved by the type checker
+            ptrdiff_t symbol;
+        } variable;
         bool boolean;
+        struct {
+            char* name;
+            struct Expr** args;
+        } call;
     } as;
 } Expr;
 
 typedef enum {
     // return <expr>;
     ST_RETURN,
-    // let/const <name>: <type> = <expr>;
+    // let/const <name>: <type> = <expr>; or let <name>: <type>;
     ST_VARIABLE_DEFINE,
 	// if <cond> { <body> }
 	ST_IF,
@@ -43,7 +54,7 @@ typedef enum {
     ST_SET_VARIABLE,
     // while <cond> { <body> }
     ST_WHILE,
-    // fn <name>() <ret_type> {...}
+    // [inline|noinline] fn <name>(<arg> <type>, ...) <ret_type> {...}
     ST_FN_DEFINITION,
     ST_ERROR
 } StatementType;
@@ -51,8 +62,19 @@ typedef enum {
 typedef struct {
     char* name;
     char* type;
+    // Resolved by the type checker
+    TypeId value_type;
 } FnArg;
 
+// Calls can't pass more args than this
+#define FN_MAX_ARGS 8
+
+typedef enum {
+    FIH_DEFAULT, // Left to the inliner's cost model
+    FIH_INLINE,
+    FIH_NOINLINE,
+} FnInlineHint;
+
 typedef struct Statement {
     StatementType type;
     Location loc;
@@ -61,11 +83,21 @@ typedef struct Statement {
         struct {
             char* name;
             char* type;
+            // NULL for variables defined without a value
             Expr* value;
+            bool is_const;
+            // Resolved by the type checker
+            ptrdiff_t symbol;
+            TypeId value_type;
+            // Every use of the variable got replaced by its value by the constant evaluator
+            bool is_folded;
         } var_def;
         struct {
             char* var;
             Expr* new_val;
+            // Resolved by the type checker
+            ptrdiff_t symbol;
+            TypeId value_type;
         } var_assign;
         struct {
             Expr* cond;
@@ -78,8 +110,14 @@ typedef struct Statement {
         struct {
             char* name;
             char* ret_type;
+            // Resolved by the type checker
+            TypeId ret_value_type;
             struct Statement* body;
+            // Args get the first symbol ids of the function
             FnArg* args;
+            // Amount of symbols defined in the function, filled in by the type checker
+            ptrdiff_t symbol_count;
+            FnInlineHint inline_hint;
         } fn_def;
     } as;
 } Statement;
@@ -101,6 +139,7 @@ typedef struct {
 bool parser_is_finished(Parser* parser); 
 Token parser_peek(const Parser* parser);
 Token parser_next(Parser* parser);
+Expr* parser_call(Parser* parser, Expr* expr, char* name);
 Expr* parser_primary(Parser* parser);
 Expr* parser_expr(Parser* parser, int min_prec);
 bool parser_statement(Parser* parser, Statement** statements);
@@ -112,4 +151,28 @@ bool parser_fn_statement(Parser* parser, Statement** statements);
 int parser_current_token_precedence(const Parser* parser);
 void parser_error_display(ParserError error, char* file_content, char* input_name);
 
+// A top level statement of a previous parse, keyed by a fingerprint of its tokens
+// (relative to its first row so moving it up or down the file doesn't change it).
+// `statement` is a private copy with rows relative to its first row, nothing outside of
+// ParserItems points into it so the checker annotating the parsed AST never touches it
+typedef struct {
+    uint64_t fingerprint;
+    Statement statement;
+} ParserItem;
+
+typedef struct {
+    ParserItem* items;
+    // Backs the exprs of `items`
+    Arena arena;
+} ParserItems;
+
+// Parses the whole token stream into parser->statements, copying the statements of `items`
+// whose tokens didn't change since the previous version and only parsing the rest.
+// On success `items` is replaced with the items of the new version,
+// on failure it's left untouched so the next version can still reuse it.
+bool parser_reparse(Parser* parser, ParserItems* items);
+void parser_items_free(ParserItems* items);
+// Frees the bodies, args and call args of `statements` and then the array itself, exprs live in an arena
+void statements_free(Statement* statements);
+
 #endif
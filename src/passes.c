@@ -0,0 +1,95 @@
+#include "passes.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../extern/stb_ds.h"
+
+static const Pass passes[] = {
+    { "simplify-cfg", simplify_cfg, NULL, false },
+    { "dce", dead_code_elimination, NULL, false },
+    { "lvn", local_value_numbering, NULL, true },
+    { "gvn", global_value_numbering, NULL, true },
+    { "licm", loop_invariant_code_motion, NULL, true },
+    { "inline", NULL, inline_functions, false },
+    { "peephole", peephole, NULL, false },
+    { "sccp", sparse_conditional_constant_propagation, NULL, true },
+    { "indvars", induction_variable_simplification, NULL, true },
+};
+
+const char* pass_preset(int level) {
+    switch (level) {
+        case 0: return "peephole";
+        case 1: return "peephole,simplify-cfg,inline,sccp,simplify-cfg,lvn,licm,indvars,dce,simplify-cfg";
+        case 2: return "peephole,simplify-cfg,inline,sccp,simplify-cfg,gvn,licm,indvars,dce,simplify-cfg";
+    }
+    return NULL;
+}
+
+static const Pass* pass_find(const char* name, size_t length) {
+    for (size_t i = 0; i < sizeof(passes) / sizeof(passes[0]); i++) {
+        if (strlen(passes[i].name) == length && strncmp(passes[i].name, name, length) == 0) return &passes[i];
+    }
+    return NULL;
+}
+
+bool pass_manager_add(PassManager* manager, const char* names) {
+    bool ok = true;
+    while (*names != '\0') {
+        const char* end = strchr(names, ',');
+        const size_t length = end != NULL ? (size_t)(end - names) : strlen(names);
+        if (length > 0) {
+            const Pass* pass = pass_find(names, length);
+            if (pass == NULL) {
+                fprintf(stderr, "ERROR: Unknown pass `%.*s`\n", (int)length, names);
+                ok = false;
+            } else {
+                PassRun run = { .pass = pass };
+                arrput(manager->pipeline, run);
+            }
+        }
+        names += length;
+        if (*names == ',') names++;
+    }
+    return ok;
+}
+
+bool pass_manager_wants_ssa(const PassManager* manager) {
+    for (ptrdiff_t p = 0; p < arrlen(manager->pipeline); p++) {
+        if (manager->pipeline[p].pass->wants_ssa) return true;
+    }
+    return false;
+}
+
+static double seconds_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void pass_manager_run(PassManager* manager, QBEModule* module) {
+    for (ptrdiff_t p = 0; p < arrlen(manager->pipeline); p++) {
+        PassRun* run = &manager->pipeline[p];
+        const double start = seconds_now();
+        if (run->pass->run_module != NULL) {
+            run->changes += run->pass->run_module(module, &manager->options);
+            run->seconds += seconds_now() - start;
+            continue;
+        }
+        for (ptrdiff_t f = 0; f < arrlen(module->functions); f++) {
+            run->changes += run->pass->run(&module->functions[f]);
+        }
+        run->seconds += seconds_now() - start;
+    }
+}
+
+void pass_manager_print_stats(const PassManager* manager, FILE* file) {
+    fprintf(file, "%-16s %10s %12s\n", "pass", "changes", "time (ms)");
+    for (ptrdiff_t p = 0; p < arrlen(manager->pipeline); p++) {
+        const PassRun* run = &manager->pipeline[p];
+        fprintf(file, "%-16s %10zu %12.3f\n", run->pass->name, run->changes, run->seconds * 1000);
+    }
+}
+
+void pass_manager_free(PassManager* manager) {
+    arrfree(manager->pipeline);
+}
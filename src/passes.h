@@ -0,0 +1,74 @@
+#ifndef PASSES_H
+#define PASSES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "qbe.h"
+
+typedef struct {
+    // How much bigger than what a call saves a function can be and still get inlined
+    size_t inline_budget;
+} PassOptions;
+
+// An optimization over a single function (`run`) or over the whole module at once (`run_module`),
+// only one of them is set. Functions are linked when they get passed in and have to be left linked,
+// returns how many changes it made
+typedef struct {
+    const char* name;
+    size_t (*run)(QBEFunction* function);
+    size_t (*run_module)(QBEModule* module, const PassOptions* options);
+    // Only finds anything once variables live in temporaries instead of stack slots
+    bool wants_ssa;
+} Pass;
+
+typedef struct {
+    const Pass* pass;
+    // Summed over every function of the module
+    size_t changes;
+    double seconds;
+} PassRun;
+
+typedef struct {
+    // Passes run in this order, each one over every function before the next one starts
+    PassRun* pipeline;
+    PassOptions options;
+} PassManager;
+
+// Comma separated passes -O<level> runs, NULL for levels that don't exist
+const char* pass_preset(int level);
+// Appends the comma separated passes in `names` to the pipeline.
+// Unknown names get reported, returns false if there were any
+bool pass_manager_add(PassManager* manager, const char* names);
+// Whether any pass of the pipeline wants the code it gets in SSA form
+bool pass_manager_wants_ssa(const PassManager* manager);
+void pass_manager_run(PassManager* manager, QBEModule* module);
+void pass_manager_print_stats(const PassManager* manager, FILE* file);
+void pass_manager_free(PassManager* manager);
+
+// Folds branches on constants, drops blocks nothing reaches and merges blocks into their only pred
+size_t simplify_cfg(QBEFunction* function);
+// Mark and sweep from the jumps, stores only stay if they can reach a live load of their slot
+size_t dead_code_elimination(QBEFunction* function);
+// Replaces instructions computing a value some temporary already holds, redundant loads included.
+// The local one only looks inside single blocks, the global one at everything dominating them
+size_t local_value_numbering(QBEFunction* function);
+size_t global_value_numbering(QBEFunction* function);
+// Gives every loop a preheader and moves what the loop computes the same way every iteration into it,
+// loads included as long as the loop doesn't store into their slot
+size_t loop_invariant_code_motion(QBEFunction* function);
+// One sweep over adjacent statements: forwards stores and loads into the loads right after them and drops
+// comparisons of a comparison with 0. Jumps skip over blocks that only jump on. Cheap enough for -O0
+size_t peephole(QBEFunction* function);
+// Finds the temporaries that are constant on every path that can actually run, following only the branches
+// that can be taken. They get replaced by their values and the blocks no branch can reach get removed
+size_t sparse_conditional_constant_propagation(QBEFunction* function);
+// Works out how the temporaries of counted loops change from one iteration to the next. Multiplications of
+// counters become additions, values read after the loop get computed from the trip count without it and loops
+// nothing reads anything from anymore go away
+size_t induction_variable_simplification(QBEFunction* function);
+// Inlines calls into their callers bottom-up over the call graph. Functions marked `inline` always get
+// inlined, `noinline` ones and recursive ones never, the rest only if they fit `inline_budget`
+size_t inline_functions(QBEModule* module, const PassOptions* options);
+
+#endif
@@ -0,0 +1,200 @@
+#include "passes.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../extern/stb_ds.h"
+
+static const QBEInstruction* statement_instruction(const QBEStatement* st) {
+    return st->type == QST_ASSIGN ? &st->assign.instruction : &st->throwaway;
+}
+
+static bool is_phi(const QBEStatement* st) {
+    return st->type == QST_ASSIGN && st->assign.instruction.type == QIT_PHI;
+}
+
+static bool is_full_width(QBEMemoryType type) {
+    return type == QMT_WORD || type == QMT_LONG;
+}
+
+// Loading what was just stored gives back the stored value, as long as the load doesn't extend it
+static bool store_load(const QBEStatement* first, const QBEStatement* second, QBEValue* value) {
+    const QBEInstruction* store = &first->throwaway;
+    const QBEInstruction* load = &second->assign.instruction;
+    if (strcmp(store->store.name, load->load.name) != 0 || store->store.type != load->load.type || !is_full_width(load->load.type)) {
+        return false;
+    }
+    *value = store->store.value;
+    return true;
+}
+
+static bool load_load(const QBEStatement* first, const QBEStatement* second, QBEValue* value) {
+    const QBEInstruction* a = &first->assign.instruction;
+    const QBEInstruction* b = &second->assign.instruction;
+    if (strcmp(a->load.name, b->load.name) != 0 || a->load.type != b->load.type || a->load.is_signed != b->load.is_signed) {
+        return false;
+    }
+    *value = first->assign.value;
+    return true;
+}
+
+// Comparisons give 0 or 1, so comparing one against 0 with !=, > or unsigned > gives the same thing again
+static bool cmp_cmp(const QBEStatement* first, const QBEStatement* second, QBEValue* value) {
+    const QBEInstruction* cmp = &second->assign.instruction;
+    if (cmp->cmp.type != first->assign.type || cmp->cmp.r.kind != QVK_CONST || cmp->cmp.r.const_i != 0) return false;
+    if (cmp->cmp.cmp != QCT_NE && cmp->cmp.cmp != QCT_GT && cmp->cmp.cmp != QCT_UGT) return false;
+    if (!qbe_value_equal(&cmp->cmp.l, &first->assign.value)) return false;
+    *value = first->assign.value;
+    return true;
+}
+
+// A pair of adjacent statements where the second one (always an assignment) computes a value the first one
+// already has at hand
+typedef struct {
+    QBEInstructionType first;
+    QBEInstructionType second;
+    bool (*match)(const QBEStatement* first, const QBEStatement* second, QBEValue* value);
+} PeepholeRule;
+
+static const PeepholeRule rules[] = {
+    { QIT_STORE, QIT_LOAD, store_load },
+    { QIT_LOAD, QIT_LOAD, load_load },
+    { QIT_CMP, QIT_CMP, cmp_cmp },
+};
+
+static bool peephole_match(const QBEStatement* first, const QBEStatement* second, QBEValue* value) {
+    if (second->type != QST_ASSIGN) return false;
+    for (size_t r = 0; r < sizeof(rules) / sizeof(rules[0]); r++) {
+        if (statement_instruction(first)->type != rules[r].first || second->assign.instruction.type != rules[r].second) continue;
+        if (rules[r].match(first, second, value)) return true;
+    }
+    return false;
+}
+
+// Drops the statements matching a rule, the first statement of the pair stays around for the next one
+// so a store followed by several loads forwards into all of them
+static size_t peephole_block(QBEBlock* block, QBESubstitution** substitutions, char*** replaced) {
+    ptrdiff_t kept = 0;
+    for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+        QBEStatement* st = &block->statements[i];
+        QBEValue* operands[QBE_MAX_USES];
+        const size_t count = qbe_instruction_operands(st->type == QST_ASSIGN ? &st->assign.instruction : &st->throwaway, operands);
+        for (size_t o = 0; o < count; o++) *operands[o] = qbe_substitution_resolve(*substitutions, *operands[o]);
+
+        QBEValue value;
+        if (kept > 0 && peephole_match(&block->statements[kept - 1], st, &value)) {
+            shput(*substitutions, st->assign.value.name, value);
+            arrput(*replaced, st->assign.value.name);
+            continue;
+        }
+        block->statements[kept++] = *st;
+    }
+    const size_t changes = arrlen(block->statements) - kept;
+    if (kept < arrlen(block->statements)) arrsetlen(block->statements, kept);
+    return changes;
+}
+
+static bool is_empty(const QBEBlock* block) {
+    return arrlen(block->statements) == 0 && block->jump.type == QIT_JMP;
+}
+
+static bool jumps_to(const QBEInstruction* jump, const char* label) {
+    if (jump->type == QIT_JMP) return strcmp(jump->jmp.label, label) == 0;
+    if (jump->type == QIT_JNZ) return strcmp(jump->jnz.then, label) == 0 || strcmp(jump->jnz.otherwise, label) == 0;
+    return false;
+}
+
+// Skips over blocks that do nothing but jump somewhere else. The phis of where the jump ends up get an arg
+// for `from` with what they had for the block it skipped, which doesn't work when `from` already jumps there.
+// Follows succs, which keep the edges from before any label changed. An empty block that got threaded
+// already still leads to the same place that way
+static size_t thread_label(QBEFunction* function, ptrdiff_t from, ptrdiff_t through, char** label, bool* skipped) {
+    size_t changes = 0;
+    // Bounded so a cycle of empty blocks doesn't go on forever
+    for (ptrdiff_t hops = 0; hops < arrlen(function->blocks); hops++) {
+        const QBEBlock* empty = &function->blocks[through];
+        if (through == from || !is_empty(empty)) break;
+        const ptrdiff_t to = empty->succs[0];
+        QBEBlock* target = &function->blocks[to];
+        if (to == through) break;
+        const bool has_phis = arrlen(target->statements) > 0 && is_phi(&target->statements[0]);
+        if (has_phis && jumps_to(&function->blocks[from].jump, target->name)) break;
+        for (ptrdiff_t i = 0; i < arrlen(target->statements) && is_phi(&target->statements[i]); i++) {
+            QBEInstruction* phi = &target->statements[i].assign.instruction;
+            for (ptrdiff_t a = 0; a < arrlen(phi->phi.args); a++) {
+                if (strcmp(phi->phi.args[a].label, empty->name) != 0) continue;
+                const QBEPhiArg arg = { .label = function->blocks[from].name, .value = phi->phi.args[a].value };
+                arrput(phi->phi.args, arg);
+                break;
+            }
+        }
+        *label = target->name;
+        skipped[through] = true;
+        through = to;
+        changes++;
+    }
+    return changes;
+}
+
+// Skipped blocks nothing jumps to anymore go away, along with the phi args for them. The args go first,
+// succs stop matching the blocks once they move
+static void remove_skipped(QBEFunction* function, const bool* skipped) {
+    for (ptrdiff_t b = 1; b < arrlen(function->blocks); b++) {
+        const QBEBlock* block = &function->blocks[b];
+        if (!skipped[b] || arrlen(block->preds) > 0) continue;
+        QBEBlock* succ = &function->blocks[block->succs[0]];
+        for (ptrdiff_t i = 0; i < arrlen(succ->statements) && is_phi(&succ->statements[i]); i++) {
+            QBEPhiArg* args = succ->statements[i].assign.instruction.phi.args;
+            for (ptrdiff_t a = arrlen(args) - 1; a >= 0; a--) {
+                if (strcmp(args[a].label, block->name) == 0) arrdel(args, a);
+            }
+            succ->statements[i].assign.instruction.phi.args = args;
+        }
+    }
+    ptrdiff_t kept = 0;
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        QBEBlock* block = &function->blocks[b];
+        if (b == 0 || !skipped[b] || arrlen(block->preds) > 0) {
+            function->blocks[kept++] = *block;
+            continue;
+        }
+        qbe_block_free(block);
+    }
+    arrsetlen(function->blocks, kept);
+}
+
+static size_t thread_jumps(QBEFunction* function) {
+    bool* skipped = calloc(arrlen(function->blocks) + 1, sizeof(bool));
+    assert(skipped);
+    size_t changes = 0;
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        QBEBlock* block = &function->blocks[b];
+        QBEInstruction* jump = &block->jump;
+        // A jnz has then first in succs, and only one entry when both sides go to the same block
+        if (jump->type == QIT_JMP) changes += thread_label(function, b, block->succs[0], &jump->jmp.label, skipped);
+        if (jump->type == QIT_JNZ) {
+            changes += thread_label(function, b, block->succs[0], &jump->jnz.then, skipped);
+            changes += thread_label(function, b, block->succs[arrlen(block->succs) - 1], &jump->jnz.otherwise, skipped);
+        }
+    }
+    if (changes > 0) {
+        qbe_function_link(function);
+        remove_skipped(function, skipped);
+        qbe_function_link(function);
+    }
+    free(skipped);
+    return changes;
+}
+
+size_t peephole(QBEFunction* function) {
+    QBESubstitution* substitutions = NULL;
+    char** replaced = NULL;
+    size_t changes = 0;
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) changes += peephole_block(&function->blocks[b], &substitutions, &replaced);
+    // Later blocks were rewritten during the sweep already, but not phis and jumps or blocks that came before
+    qbe_function_substitute(function, substitutions);
+    shfree(substitutions);
+    for (ptrdiff_t i = 0; i < arrlen(replaced); i++) free(replaced[i]);
+    arrfree(replaced);
+    return changes + thread_jumps(function);
+}
@@ -3,8 +3,27 @@
 #include "../extern/stb_ds.h"
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 
+void qbe_block_free(QBEBlock* block) {
+    for (ptrdiff_t s = 0; s < arrlen(block->statements); s++) {
+        QBEStatement* st = &block->statements[s];
+        switch (st->type) {
+            case QST_ASSIGN: {
+                free(st->assign.value.name);
+                if (st->assign.instruction.type == QIT_PHI) arrfree(st->assign.instruction.phi.args);
+                if (st->assign.instruction.type == QIT_CALL) arrfree(st->assign.instruction.call.args);
+                break;
+            }
+            default: {}
+        }
+    }
+    arrfree(block->statements);
+    arrfree(block->succs);
+    arrfree(block->preds);
+}
+
 QBEModule qbe_module_new() {
     return (QBEModule) {
         .functions = NULL
@@ -14,21 +33,10 @@ QBEModule qbe_module_new() {
 void qbe_module_destroy(QBEModule* module) {
     for (ptrdiff_t f = 0; f < arrlen(module->functions); f++) {
         QBEFunction* func = &module->functions[f];
-        for (ptrdiff_t b = 0; b < arrlen(func->blocks); b++) {
-            QBEBlock* block = &func->blocks[b];
-            for (ptrdiff_t s = 0; s < arrlen(block->statements); s++) {
-                QBEStatement* st = &block->statements[s];
-                switch (st->type) {
-                    case QST_ASSIGN: {
-                        free(st->assign.value.name);
-                        break;
-                    }
-                    default: {}
-                }
-            }
-            arrfree(block->statements);
-        }
+        for (ptrdiff_t b = 0; b < arrlen(func->blocks); b++) qbe_block_free(&func->blocks[b]);
         arrfree(func->blocks);
+        for (ptrdiff_t p = 0; p < arrlen(func->params); p++) free(func->params[p].name);
+        arrfree(func->params);
     }
     arrfree(module->functions);
 }
@@ -38,6 +46,7 @@ QBEFunction* qbe_module_create_function(QBEModule* module, char* name, QBEValueT
     QBEFunction func = {
         .name = name,
         .return_type = return_type,
+        .params = NULL,
         .blocks = NULL
     };
     arrput(module->functions, func);
@@ -54,6 +63,61 @@ QBEBlock* qbe_function_push_block(QBEFunction* function, char* name) {
     return &function->blocks[loc];
 }
 
+ptrdiff_t qbe_function_find_block(const QBEFunction* function, const char* name) {
+    for (ptrdiff_t i = 0; i < arrlen(function->blocks); i++) {
+        if (strcmp(function->blocks[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+typedef struct {
+    char* key;
+    ptrdiff_t value;
+} QBEBlockIndex;
+
+static void qbe_function_add_edge(QBEFunction* function, QBEBlockIndex* blocks, ptrdiff_t from, const char* label) {
+    const ptrdiff_t i = shgeti(blocks, label);
+    assert(i != -1 && "Jump to an undefined label");
+    const ptrdiff_t to = blocks[i].value;
+    // Both sides of a jnz can go to the same block
+    for (ptrdiff_t s = 0; s < arrlen(function->blocks[from].succs); s++) {
+        if (function->blocks[from].succs[s] == to) return;
+    }
+    arrput(function->blocks[from].succs, to);
+    arrput(function->blocks[to].preds, from);
+}
+
+void qbe_function_link(QBEFunction* function) {
+    QBEBlockIndex* blocks = NULL;
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        arrfree(function->blocks[b].succs);
+        arrfree(function->blocks[b].preds);
+        shput(blocks, function->blocks[b].name, b);
+    }
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        const QBEInstruction* jump = &function->blocks[b].jump;
+        switch (jump->type) {
+            case QIT_JMP: qbe_function_add_edge(function, blocks, b, jump->jmp.label); break;
+            case QIT_JNZ: {
+                qbe_function_add_edge(function, blocks, b, jump->jnz.then);
+                qbe_function_add_edge(function, blocks, b, jump->jnz.otherwise);
+                break;
+            }
+            case QIT_RETURN: break;
+            default: assert(false && "Block doesn't end with a jump");
+        }
+    }
+    shfree(blocks);
+}
+
+void qbe_function_push_param(QBEFunction* function, char* name, QBEValueType type) {
+    const QBEParam param = {
+        .name = name,
+        .type = type
+    };
+    arrput(function->params, param);
+}
+
 void qbe_block_push_ins(QBEBlock* block, QBEInstruction ins) {
     const QBEStatement st = {
         .type = QST_THROWAWAY,
@@ -74,12 +138,141 @@ void qbe_block_assign_ins(QBEBlock* block, QBEInstruction ins, QBEValueType type
     arrput(block->statements, st);
 }
 
-void qbe_block_push_label(QBEBlock* block, char* name) {
+void qbe_block_assign_ins_at(QBEBlock* block, ptrdiff_t index, QBEInstruction ins, QBEValueType type, QBEValue val) {
     const QBEStatement st = {
-        .type = QST_LABEL,
-		.name = name
+        .type = QST_ASSIGN,
+        .assign = {
+            .value = val,
+            .type = type,
+            .instruction = ins
+        }
     };
     arrput(block->statements, st);
+    memmove(&block->statements[index + 1], &block->statements[index], sizeof(QBEStatement) * (arrlen(block->statements) - index - 1));
+    block->statements[index] = st;
+}
+
+
+static size_t qbe_value_use(const QBEValue* value, const char* uses[QBE_MAX_USES], size_t count) {
+    if (value->kind == QVK_TEMP) uses[count++] = value->name;
+    return count;
+}
+
+size_t qbe_statement_uses(const QBEStatement* statement, const char* uses[QBE_MAX_USES]) {
+    switch (statement->type) {
+        case QST_ASSIGN: return qbe_instruction_uses(&statement->assign.instruction, uses);
+        case QST_THROWAWAY: return qbe_instruction_uses(&statement->throwaway, uses);
+    }
+    return 0;
+}
+
+size_t qbe_instruction_uses(const QBEInstruction* ins, const char* uses[QBE_MAX_USES]) {
+    size_t count = 0;
+    switch (ins->type) {
+        case QIT_RETURN: return qbe_value_use(&ins->ret, uses, count);
+        case QIT_ADD: case QIT_SUB: case QIT_MUL: case QIT_DIV: case QIT_UDIV:
+        case QIT_SHL: case QIT_SAR: case QIT_SHR: {
+            // All of the binary instructions share the same layout
+            count = qbe_value_use(&ins->add.left, uses, count);
+            return qbe_value_use(&ins->add.right, uses, count);
+        }
+        case QIT_ALLOC8: return 0;
+        case QIT_STORE: {
+            count = qbe_value_use(&ins->store.value, uses, count);
+            uses[count++] = ins->store.name;
+            return count;
+        }
+        case QIT_LOAD: {
+            uses[count++] = ins->load.name;
+            return count;
+        }
+        case QIT_EXT: return qbe_value_use(&ins->ext.value, uses, count);
+        case QIT_CMP: {
+            count = qbe_value_use(&ins->cmp.l, uses, count);
+            return qbe_value_use(&ins->cmp.r, uses, count);
+        }
+        case QIT_JMP: return 0;
+        case QIT_JNZ: return qbe_value_use(&ins->jnz.value, uses, count);
+        case QIT_PHI: return 0;
+        case QIT_CALL: {
+            assert(arrlen(ins->call.args) <= QBE_MAX_USES);
+            for (ptrdiff_t i = 0; i < arrlen(ins->call.args); i++) count = qbe_value_use(&ins->call.args[i].value, uses, count);
+            return count;
+        }
+    }
+    return count;
+}
+
+bool qbe_value_equal(const QBEValue* a, const QBEValue* b) {
+    if (a->kind != b->kind) return false;
+    switch (a->kind) {
+        case QVK_CONST: return a->const_i == b->const_i;
+        case QVK_TEMP: return strcmp(a->name, b->name) == 0;
+    }
+    return false;
+}
+
+size_t qbe_instruction_operands(QBEInstruction* ins, QBEValue* operands[QBE_MAX_USES]) {
+    switch (ins->type) {
+        case QIT_RETURN: operands[0] = &ins->ret; return 1;
+        case QIT_ADD: case QIT_SUB: case QIT_MUL: case QIT_DIV: case QIT_UDIV:
+        case QIT_SHL: case QIT_SAR: case QIT_SHR: {
+            operands[0] = &ins->add.left;
+            operands[1] = &ins->add.right;
+            return 2;
+        }
+        case QIT_STORE: operands[0] = &ins->store.value; return 1;
+        case QIT_EXT: operands[0] = &ins->ext.value; return 1;
+        case QIT_CMP: {
+            operands[0] = &ins->cmp.l;
+            operands[1] = &ins->cmp.r;
+            return 2;
+        }
+        case QIT_JNZ: operands[0] = &ins->jnz.value; return 1;
+        case QIT_CALL: {
+            assert(arrlen(ins->call.args) <= QBE_MAX_USES);
+            for (ptrdiff_t i = 0; i < arrlen(ins->call.args); i++) operands[i] = &ins->call.args[i].value;
+            return arrlen(ins->call.args);
+        }
+        case QIT_ALLOC8: case QIT_LOAD: case QIT_JMP: case QIT_PHI: return 0;
+    }
+    return 0;
+}
+
+QBEValue qbe_substitution_resolve(QBESubstitution* substitutions, QBEValue value) {
+    // shgeti on an empty map allocates one
+    if (shlen(substitutions) == 0) return value;
+    while (value.kind == QVK_TEMP) {
+        const ptrdiff_t i = shgeti(substitutions, value.name);
+        if (i == -1) break;
+        value = substitutions[i].value;
+    }
+    return value;
+}
+
+static void qbe_instruction_substitute(QBEInstruction* ins, QBESubstitution* substitutions) {
+    if (ins->type == QIT_PHI) {
+        for (ptrdiff_t a = 0; a < arrlen(ins->phi.args); a++) {
+            ins->phi.args[a].value = qbe_substitution_resolve(substitutions, ins->phi.args[a].value);
+        }
+        return;
+    }
+    QBEValue* operands[QBE_MAX_USES];
+    const size_t count = qbe_instruction_operands(ins, operands);
+    for (size_t i = 0; i < count; i++) *operands[i] = qbe_substitution_resolve(substitutions, *operands[i]);
+}
+
+void qbe_block_substitute(QBEBlock* block, QBESubstitution* substitutions) {
+    if (shlen(substitutions) == 0) return;
+    for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+        QBEStatement* st = &block->statements[i];
+        qbe_instruction_substitute(st->type == QST_ASSIGN ? &st->assign.instruction : &st->throwaway, substitutions);
+    }
+    qbe_instruction_substitute(&block->jump, substitutions);
+}
+
+void qbe_function_substitute(QBEFunction* function, QBESubstitution* substitutions) {
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) qbe_block_substitute(&function->blocks[b], substitutions);
 }
 
 void qbe_module_write(const QBEModule* module, FILE* file) {
@@ -88,25 +281,31 @@ void qbe_module_write(const QBEModule* module, FILE* file) {
     }
 }
 void qbe_function_write(const QBEFunction* function, FILE* file) {
-    fprintf(file, "export function w $%s() {\n", function->name);
+    fprintf(file, "export function %s $%s(", function->return_type == QVT_LONG ? "l" : "w", function->name);
+    for (ptrdiff_t i = 0; i < arrlen(function->params); i++) {
+        if (i != 0) fprintf(file, ", ");
+        switch (function->params[i].type) {
+            case QVT_WORD: fprintf(file, "w "); break;
+            case QVT_LONG: fprintf(file, "l "); break;
+        }
+        fprintf(file, "%%%s", function->params[i].name);
+    }
+    fprintf(file, ") {\n");
     for (ptrdiff_t i = 0; i < arrlen(function->blocks); i++) {
-        qbe_block_write(&function->blocks[i], file);
+        qbe_block_write(&function->blocks[i], i + 1 < arrlen(function->blocks) ? &function->blocks[i + 1] : NULL, file);
     }
     fprintf(file, "}\n");
 }
 
-void qbe_block_write(const QBEBlock* block, FILE* file) {
+void qbe_block_write(const QBEBlock* block, const QBEBlock* next, FILE* file) {
     fprintf(file, "@%s\n", block->name);
     for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
         qbe_statement_write(&block->statements[i], file);
     }
+    if (block->jump.type == QIT_JMP && next != NULL && strcmp(block->jump.jmp.label, next->name) == 0) return;
+    qbe_instruction_write(&block->jump, file);
 }
 void qbe_statement_write(const QBEStatement* statement, FILE* file) {
-	if (statement->type == QST_LABEL) {
-		fprintf(file, "@%s\n", statement->name);
-		return;
-	}
-
     if (statement->type == QST_ASSIGN) {
         assert(statement->assign.value.kind == QVK_TEMP);
         fprintf(file, "%%%s =", statement->assign.value.name);
@@ -126,25 +325,34 @@ void qbe_statement_write(const QBEStatement* statement, FILE* file) {
     }
 }
 
-void qbe_write_left_right(const QBEValue* left, const QBEValue* right, FILE* file) {
-    switch (left->kind) {
-        case QVK_CONST: fprintf(file, "%lu, ", left->const_i); break;
-        case QVK_TEMP: fprintf(file, "%%%s, ", left->name); break;
+static void qbe_value_write(const QBEValue* value, FILE* file) {
+    switch (value->kind) {
+        case QVK_CONST: fprintf(file, "%ld", (int64_t)value->const_i); break;
+        case QVK_TEMP: fprintf(file, "%%%s", value->name); break;
     }
-    switch (right->kind) {
-        case QVK_CONST: fprintf(file, "%lu", right->const_i); break;
-        case QVK_TEMP: fprintf(file, "%%%s", right->name); break;
+}
+
+static const char* qbe_memory_type_suffix(QBEMemoryType type) {
+    switch (type) {
+        case QMT_BYTE: return "b";
+        case QMT_HALF: return "h";
+        case QMT_WORD: return "w";
+        case QMT_LONG: return "l";
     }
+    return "";
+}
+
+void qbe_write_left_right(const QBEValue* left, const QBEValue* right, FILE* file) {
+    qbe_value_write(left, file);
+    fprintf(file, ", ");
+    qbe_value_write(right, file);
 }
 
 void qbe_instruction_write(const QBEInstruction* instruction, FILE* file) {
     switch (instruction->type) {
         case QIT_RETURN: {
             fprintf(file, "ret ");
-            switch (instruction->ret.kind) {
-                case QVK_CONST: fprintf(file, "%lu", instruction->ret.const_i); break;
-                case QVK_TEMP: fprintf(file, "%%%s", instruction->ret.name); break;
-            }
+            qbe_value_write(&instruction->ret, file);
             fprintf(file, "\n");
             break;
         }
@@ -172,25 +380,61 @@ void qbe_instruction_write(const QBEInstruction* instruction, FILE* file) {
             fprintf(file, "\n");
             break;
         }
+        case QIT_UDIV: {
+            fprintf(file, "udiv ");
+            qbe_write_left_right(&instruction->udiv.left, &instruction->udiv.right, file);
+            fprintf(file, "\n");
+            break;
+        }
+        case QIT_SHL: {
+            fprintf(file, "shl ");
+            qbe_write_left_right(&instruction->shl.left, &instruction->shl.right, file);
+            fprintf(file, "\n");
+            break;
+        }
+        case QIT_SAR: {
+            fprintf(file, "sar ");
+            qbe_write_left_right(&instruction->sar.left, &instruction->sar.right, file);
+            fprintf(file, "\n");
+            break;
+        }
+        case QIT_SHR: {
+            fprintf(file, "shr ");
+            qbe_write_left_right(&instruction->shr.left, &instruction->shr.right, file);
+            fprintf(file, "\n");
+            break;
+        }
         case QIT_ALLOC8: {
             fprintf(file, "alloc8 ");
             fprintf(file, "%lu", instruction->alloc8.size);
             fprintf(file, "\n");
             break;
         }
-        case QIT_STOREW: {
-            fprintf(file, "storew ");
-            switch (instruction->storew.value.kind) {
-                case QVK_CONST: fprintf(file, "%lu, ", instruction->storew.value.const_i); break;
-                case QVK_TEMP: fprintf(file, "%%%s, ", instruction->storew.value.name); break;
+        case QIT_STORE: {
+            fprintf(file, "store%s ", qbe_memory_type_suffix(instruction->store.type));
+            qbe_value_write(&instruction->store.value, file);
+            fprintf(file, ", %%%s", instruction->store.name);
+            fprintf(file, "\n");
+            break;
+        }
+        case QIT_LOAD: {
+            switch (instruction->load.type) {
+                case QMT_BYTE: case QMT_HALF: {
+                    fprintf(file, "load%s%s ", instruction->load.is_signed ? "s" : "u", qbe_memory_type_suffix(instruction->load.type));
+                    break;
+                }
+                case QMT_WORD: case QMT_LONG: {
+                    fprintf(file, "load%s ", qbe_memory_type_suffix(instruction->load.type));
+                    break;
+                }
             }
-            fprintf(file, "%%%s", instruction->storew.name);
+            fprintf(file, "%%%s", instruction->load.name);
             fprintf(file, "\n");
             break;
         }
-        case QIT_LOADW: {
-            fprintf(file, "loadw ");
-            fprintf(file, "%%%s", instruction->loadw.name);
+        case QIT_EXT: {
+            fprintf(file, "ext%s%s ", instruction->ext.is_signed ? "s" : "u", qbe_memory_type_suffix(instruction->ext.type));
+            qbe_value_write(&instruction->ext.value, file);
             fprintf(file, "\n");
             break;
         }
@@ -209,6 +453,14 @@ void qbe_instruction_write(const QBEInstruction* instruction, FILE* file) {
                     fprintf(file, "slt");
                     break;
                 }
+                case QCT_UGT: {
+                    fprintf(file, "ugt");
+                    break;
+                }
+                case QCT_ULT: {
+                    fprintf(file, "ult");
+                    break;
+                }
             }
             switch (instruction->cmp.type) {
                 case QVT_WORD: {
@@ -230,11 +482,28 @@ void qbe_instruction_write(const QBEInstruction* instruction, FILE* file) {
         }
         case QIT_JNZ: {
             fprintf(file, "jnz ");
-            switch (instruction->jnz.value.kind) {
-                case QVK_CONST: fprintf(file, "%lu, ", instruction->jnz.value.const_i); break;
-                case QVK_TEMP: fprintf(file, "%%%s, ", instruction->jnz.value.name); break;
+            qbe_value_write(&instruction->jnz.value, file);
+            fprintf(file, ", @%s, @%s\n", instruction->jnz.then, instruction->jnz.otherwise);
+            break;
+        }
+        case QIT_PHI: {
+            fprintf(file, "phi ");
+            for (ptrdiff_t i = 0; i < arrlen(instruction->phi.args); i++) {
+                if (i != 0) fprintf(file, ", ");
+                fprintf(file, "@%s ", instruction->phi.args[i].label);
+                qbe_value_write(&instruction->phi.args[i].value, file);
+            }
+            fprintf(file, "\n");
+            break;
+        }
+        case QIT_CALL: {
+            fprintf(file, "call $%s(", instruction->call.name);
+            for (ptrdiff_t i = 0; i < arrlen(instruction->call.args); i++) {
+                if (i != 0) fprintf(file, ", ");
+                fprintf(file, "%s ", instruction->call.args[i].type == QVT_LONG ? "l" : "w");
+                qbe_value_write(&instruction->call.args[i].value, file);
             }
-            fprintf(file, "@%s, @%s\n", instruction->jnz.then, instruction->jnz.otherwise);
+            fprintf(file, ")\n");
             break;
         }
     } 
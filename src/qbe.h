@@ -1,6 +1,7 @@
 #ifndef QBE_H
 #define QBE_H
 #include "arena.h"
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -11,20 +12,37 @@ typedef enum {
     QIT_SUB,
     QIT_MUL,
     QIT_DIV,
+    QIT_UDIV,
+    QIT_SHL,
+    QIT_SAR, // Arithmetic shift right, copies the sign bit
+    QIT_SHR, // Logical shift right
     QIT_ALLOC8,
-    QIT_STOREW,
-    QIT_LOADW,
+    QIT_STORE,
+    QIT_LOAD,
+    QIT_EXT,
     QIT_CMP,
     QIT_JMP,
     QIT_JNZ,
+    QIT_PHI,
+    QIT_CALL,
 } QBEInstructionType;
 
 typedef enum {
     QCT_NE,
     QCT_GT,
     QCT_LT,
+    QCT_UGT,
+    QCT_ULT,
 } QBEComparisonType;
 
+// Width of a value in memory
+typedef enum {
+    QMT_BYTE,
+    QMT_HALF,
+    QMT_WORD,
+    QMT_LONG,
+} QBEMemoryType;
+
 typedef enum {
     QVT_WORD,
     QVT_LONG,
@@ -43,6 +61,16 @@ typedef struct {
     };
 } QBEValue;
 
+typedef struct {
+    char* label;
+    QBEValue value;
+} QBEPhiArg;
+
+typedef struct {
+    QBEValueType type;
+    QBEValue value;
+} QBECallArg;
+
 typedef struct {
     QBEInstructionType type;
     union {
@@ -50,17 +78,27 @@ typedef struct {
         struct {
             QBEValue left;
             QBEValue right;
-        } add, sub, mul, div;
+        } add, sub, mul, div, udiv, shl, sar, shr;
         struct {
             size_t size;
         } alloc8;
         struct {
+            QBEMemoryType type;
             QBEValue value;
             char* name;
-        } storew;
+        } store;
         struct {
+            QBEMemoryType type;
+            // Sign or zero extension of bytes and halfs
+            bool is_signed;
             char* name;
-        } loadw;
+        } load;
+        // Extends the low `type` bits of value
+        struct {
+            QBEMemoryType type;
+            bool is_signed;
+            QBEValue value;
+        } ext;
         struct {
             char* label;
         } jmp;
@@ -74,13 +112,21 @@ typedef struct {
             QBEComparisonType cmp;
             QBEValue l, r;
         } cmp;
+        // Value of the phi is the arg of the block control came from, owns the `args` array
+        struct {
+            QBEPhiArg* args;
+        } phi;
+        // Owns the `args` array, not the name
+        struct {
+            char* name;
+            QBECallArg* args;
+        } call;
     };
 } QBEInstruction;
 
 typedef enum {
     QST_ASSIGN, // %value w= instr
     QST_THROWAWAY, // instr
-	QST_LABEL // @label
 } QBEStatementType;
 
 typedef struct {
@@ -92,19 +138,37 @@ typedef struct {
             QBEValueType type;
             QBEInstruction instruction;
         } assign;
-		char* name;
     };
 } QBEStatement;
 
+// Basic block, phis come first and control only leaves it through `jump` at the end
 typedef struct {
     char* name;
     QBEStatement* statements;
+    // ret, jmp or jnz. A zero initialized one returns 0
+    QBEInstruction jump;
+    // Indices into the blocks of the function, qbe_function_link fills them in from the jumps
+    ptrdiff_t* succs;
+    ptrdiff_t* preds;
 } QBEBlock;
 
+typedef struct {
+    char* name;
+    QBEValueType type;
+} QBEParam;
+
+typedef enum {
+    QIH_DEFAULT,
+    QIH_ALWAYS,
+    QIH_NEVER,
+} QBEInlineHint;
+
 typedef struct {
     char* name;
     QBEValueType return_type;
+    QBEParam* params;
     QBEBlock* blocks;
+    QBEInlineHint inline_hint;
 } QBEFunction;
 
 typedef struct {
@@ -115,17 +179,52 @@ QBEModule qbe_module_new();
 void qbe_module_destroy(QBEModule* module);
 QBEFunction* qbe_module_create_function(QBEModule* module, char* name, QBEValueType return_type);
 
+// Blocks get written in the order they're pushed, the first one is the entry
 QBEBlock* qbe_function_push_block(QBEFunction* function, char* name);
+// Returns -1 if the function has no block called `name`
+ptrdiff_t qbe_function_find_block(const QBEFunction* function, const char* name);
+// Recomputes the succs and preds of every block from their jumps, has to be called again
+// after anything changes a jump
+void qbe_function_link(QBEFunction* function);
+// Frees the statements (and the temporaries they define) and the edges of `block`, not its name
+void qbe_block_free(QBEBlock* block);
+// Takes ownership of `name`
+void qbe_function_push_param(QBEFunction* function, char* name, QBEValueType type);
 // Pushes instruction throwing away its return value
 void qbe_block_push_ins(QBEBlock* block, QBEInstruction ins);
 // Pushes instruction that stores its return value into val (has to be a temporary value)
 void qbe_block_assign_ins(QBEBlock* block, QBEInstruction ins, QBEValueType type, QBEValue val);
+// Same as qbe_block_assign_ins but inserts the statement at `index` instead of appending it
+void qbe_block_assign_ins_at(QBEBlock* block, ptrdiff_t index, QBEInstruction ins, QBEValueType type, QBEValue val);
+
+// Most temporaries a single instruction reads, calls read one per arg so this caps the args of a call
+#define QBE_MAX_USES 8
+// Stores the names of the temporaries `instruction` reads (stack slot addresses included) into `uses`,
+// returns how many there are. Phi args aren't included, they're read at the end of their blocks instead
+size_t qbe_instruction_uses(const QBEInstruction* instruction, const char* uses[QBE_MAX_USES]);
+size_t qbe_statement_uses(const QBEStatement* statement, const char* uses[QBE_MAX_USES]);
+bool qbe_value_equal(const QBEValue* a, const QBEValue* b);
+// Stores pointers to the value operands of `instruction` into `operands` (so no slot names and no phi args),
+// returns how many there are
+size_t qbe_instruction_operands(QBEInstruction* instruction, QBEValue* operands[QBE_MAX_USES]);
+
+// Temporaries that got replaced and the values replacing them, keyed by name
+typedef struct {
+    char* key;
+    QBEValue value;
+} QBESubstitution;
 
-void qbe_block_push_label(QBEBlock* block, char* name);
+// Follows the chain of substitutions starting at `value`
+QBEValue qbe_substitution_resolve(QBESubstitution* substitutions, QBEValue value);
+// Rewrites every use of a substituted temporary in `function`, phi args included
+void qbe_function_substitute(QBEFunction* function, QBESubstitution* substitutions);
+// Same thing for a single block
+void qbe_block_substitute(QBEBlock* block, QBESubstitution* substitutions);
 
 void qbe_module_write(const QBEModule* module, FILE* file);
 void qbe_function_write(const QBEFunction* function, FILE* file);
-void qbe_block_write(const QBEBlock* block, FILE* file);
+// The jump is left out when it just goes to `next`, the block written after this one (can be NULL)
+void qbe_block_write(const QBEBlock* block, const QBEBlock* next, FILE* file);
 void qbe_statement_write(const QBEStatement* statement, FILE* file);
 void qbe_instruction_write(const QBEInstruction* instruction, FILE* file);
 
@@ -0,0 +1,344 @@
+#include "passes.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../extern/stb_ds.h"
+#include "dataflow.h"
+
+typedef enum {
+    LK_UNKNOWN, // Nothing executable defined it yet
+    LK_CONST,
+    LK_VARYING,
+} LatticeKind;
+
+typedef struct {
+    LatticeKind kind;
+    uint64_t value;
+} Lattice;
+
+typedef struct {
+    QBEFunction* function;
+    TempIds temps;
+    Lattice* lattice;
+    // Statements (and jumps, their index is the statement count of the block) using every temporary
+    StatementRef** users;
+    bool* executable;
+    // One flag per succ of every block
+    bool** edges;
+    ptrdiff_t* changed;
+    // Statements to visit since their block just became executable, a queue starting at `next_reached`
+    StatementRef* reached;
+    ptrdiff_t next_reached;
+} Sccp;
+
+static bool is_phi(const QBEStatement* st) {
+    return st->type == QST_ASSIGN && st->assign.instruction.type == QIT_PHI;
+}
+
+static Lattice meet(Lattice a, Lattice b) {
+    if (a.kind == LK_UNKNOWN) return b;
+    if (b.kind == LK_UNKNOWN) return a;
+    if (a.kind == LK_CONST && b.kind == LK_CONST && a.value == b.value) return a;
+    return (Lattice) { .kind = LK_VARYING };
+}
+
+static Lattice value_lattice(const Sccp* sccp, const QBEValue* value) {
+    if (value->kind == QVK_CONST) return (Lattice) { .kind = LK_CONST, .value = value->const_i };
+    return sccp->lattice[temp_ids_get(&sccp->temps, value->name)];
+}
+
+// Words are kept sign extended, the way codegen writes negative i32 constants
+static uint64_t wrap(QBEValueType type, uint64_t value) {
+    return type == QVT_WORD ? (uint64_t)(int64_t)(int32_t)value : value;
+}
+
+static uint64_t extend(QBEMemoryType type, bool is_signed, uint64_t value) {
+    switch (type) {
+        case QMT_BYTE: return is_signed ? (uint64_t)(int64_t)(int8_t)value : (uint8_t)value;
+        case QMT_HALF: return is_signed ? (uint64_t)(int64_t)(int16_t)value : (uint16_t)value;
+        case QMT_WORD: return is_signed ? (uint64_t)(int64_t)(int32_t)value : (uint32_t)value;
+        case QMT_LONG: return value;
+    }
+    return value;
+}
+
+// Computes what an instruction gives for constant operands (in the order of qbe_instruction_operands).
+// Divisions that trap are left for the program to run into
+static bool fold(QBEValueType type, const QBEInstruction* ins, const uint64_t* operands, uint64_t* result) {
+    const bool word = type == QVT_WORD;
+    const unsigned width = word ? 32 : 64;
+    const uint64_t l = operands[0];
+    const uint64_t r = operands[1];
+    switch (ins->type) {
+        case QIT_ADD: *result = l + r; break;
+        case QIT_SUB: *result = l - r; break;
+        case QIT_MUL: *result = l * r; break;
+        case QIT_DIV: {
+            const int64_t a = word ? (int32_t)l : (int64_t)l;
+            const int64_t b = word ? (int32_t)r : (int64_t)r;
+            if (b == 0 || b == -1) return false;
+            *result = (uint64_t)(a / b);
+            break;
+        }
+        case QIT_UDIV: {
+            const uint64_t a = word ? (uint32_t)l : l;
+            const uint64_t b = word ? (uint32_t)r : r;
+            if (b == 0) return false;
+            *result = a / b;
+            break;
+        }
+        // Like QBE only the low bits of the shift amount count
+        case QIT_SHL: *result = l << (r & (width - 1)); break;
+        case QIT_SAR: *result = (uint64_t)((word ? (int32_t)l : (int64_t)l) >> (r & (width - 1))); break;
+        case QIT_SHR: *result = (word ? (uint32_t)l : l) >> (r & (width - 1)); break;
+        case QIT_EXT: *result = extend(ins->ext.type, ins->ext.is_signed, l); break;
+        case QIT_CMP: {
+            const bool word_cmp = ins->cmp.type == QVT_WORD;
+            const int64_t sl = word_cmp ? (int32_t)l : (int64_t)l;
+            const int64_t sr = word_cmp ? (int32_t)r : (int64_t)r;
+            const uint64_t ul = word_cmp ? (uint32_t)l : l;
+            const uint64_t ur = word_cmp ? (uint32_t)r : r;
+            switch (ins->cmp.cmp) {
+                case QCT_NE: *result = ul != ur; break;
+                case QCT_GT: *result = sl > sr; break;
+                case QCT_LT: *result = sl < sr; break;
+                case QCT_UGT: *result = ul > ur; break;
+                case QCT_ULT: *result = ul < ur; break;
+            }
+            break;
+        }
+        default: return false;
+    }
+    *result = wrap(type, *result);
+    return true;
+}
+
+static Lattice evaluate_phi(const Sccp* sccp, ptrdiff_t b, const QBEInstruction* phi) {
+    const QBEFunction* function = sccp->function;
+    Lattice result = { .kind = LK_UNKNOWN };
+    for (ptrdiff_t a = 0; a < arrlen(phi->phi.args); a++) {
+        const ptrdiff_t pred = qbe_function_find_block(function, phi->phi.args[a].label);
+        bool executable = false;
+        for (ptrdiff_t s = 0; s < arrlen(function->blocks[pred].succs); s++) {
+            if (function->blocks[pred].succs[s] == b) executable = sccp->edges[pred][s];
+        }
+        if (executable) result = meet(result, value_lattice(sccp, &phi->phi.args[a].value));
+    }
+    return result;
+}
+
+static Lattice evaluate(const Sccp* sccp, ptrdiff_t b, const QBEStatement* st) {
+    const QBEInstruction* ins = &st->assign.instruction;
+    if (ins->type == QIT_PHI) return evaluate_phi(sccp, b, ins);
+    // Memory isn't tracked and calls could return anything
+    if (ins->type == QIT_LOAD || ins->type == QIT_CALL || ins->type == QIT_ALLOC8) return (Lattice) { .kind = LK_VARYING };
+
+    QBEInstruction copy = *ins;
+    QBEValue* operands[QBE_MAX_USES];
+    uint64_t values[QBE_MAX_USES] = {0};
+    const size_t count = qbe_instruction_operands(&copy, operands);
+    bool unknown = false;
+    for (size_t o = 0; o < count; o++) {
+        const Lattice operand = value_lattice(sccp, operands[o]);
+        if (operand.kind == LK_VARYING) return operand;
+        if (operand.kind == LK_UNKNOWN) unknown = true;
+        values[o] = operand.value;
+    }
+    if (unknown) return (Lattice) { .kind = LK_UNKNOWN };
+    Lattice result = { .kind = LK_CONST };
+    if (!fold(st->assign.type, ins, values, &result.value)) result.kind = LK_VARYING;
+    return result;
+}
+
+static void mark_edge(Sccp* sccp, ptrdiff_t b, ptrdiff_t s) {
+    if (sccp->edges[b][s]) return;
+    sccp->edges[b][s] = true;
+    const ptrdiff_t to = sccp->function->blocks[b].succs[s];
+    const QBEBlock* block = &sccp->function->blocks[to];
+    // The first edge into a block brings all of it along, later ones only change its phis
+    if (sccp->executable[to]) {
+        for (ptrdiff_t i = 0; i < arrlen(block->statements) && is_phi(&block->statements[i]); i++) {
+            arrput(sccp->reached, ((StatementRef) { to, i }));
+        }
+        return;
+    }
+    sccp->executable[to] = true;
+    for (ptrdiff_t i = 0; i <= arrlen(block->statements); i++) arrput(sccp->reached, ((StatementRef) { to, i }));
+}
+
+static void visit_jump(Sccp* sccp, ptrdiff_t b) {
+    const QBEBlock* block = &sccp->function->blocks[b];
+    if (block->jump.type == QIT_JMP) mark_edge(sccp, b, 0);
+    if (block->jump.type != QIT_JNZ) return;
+    const Lattice cond = value_lattice(sccp, &block->jump.jnz.value);
+    if (cond.kind == LK_UNKNOWN) return;
+    for (ptrdiff_t s = 0; s < arrlen(block->succs); s++) {
+        const char* name = sccp->function->blocks[block->succs[s]].name;
+        const bool taken = cond.kind == LK_VARYING
+            || strcmp(name, cond.value != 0 ? block->jump.jnz.then : block->jump.jnz.otherwise) == 0;
+        if (taken) mark_edge(sccp, b, s);
+    }
+}
+
+static void visit(Sccp* sccp, StatementRef ref) {
+    const QBEBlock* block = &sccp->function->blocks[ref.block];
+    if (ref.index == arrlen(block->statements)) {
+        visit_jump(sccp, ref.block);
+        return;
+    }
+    const QBEStatement* st = &block->statements[ref.index];
+    if (st->type != QST_ASSIGN) return;
+    const ptrdiff_t id = temp_ids_get(&sccp->temps, st->assign.value.name);
+    const Lattice old = sccp->lattice[id];
+    const Lattice new = meet(old, evaluate(sccp, ref.block, st));
+    if (new.kind == old.kind && new.value == old.value) return;
+    sccp->lattice[id] = new;
+    arrput(sccp->changed, id);
+}
+
+static void add_user(Sccp* sccp, const char* name, StatementRef ref) {
+    arrput(sccp->users[temp_ids_get(&sccp->temps, name)], ref);
+}
+
+static void find_users(Sccp* sccp) {
+    const QBEFunction* function = sccp->function;
+    const char* uses[QBE_MAX_USES];
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        const QBEBlock* block = &function->blocks[b];
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            const QBEStatement* st = &block->statements[i];
+            const StatementRef ref = { b, i };
+            const size_t count = qbe_statement_uses(st, uses);
+            for (size_t u = 0; u < count; u++) add_user(sccp, uses[u], ref);
+            if (!is_phi(st)) continue;
+            for (ptrdiff_t a = 0; a < arrlen(st->assign.instruction.phi.args); a++) {
+                const QBEValue* value = &st->assign.instruction.phi.args[a].value;
+                if (value->kind == QVK_TEMP) add_user(sccp, value->name, ref);
+            }
+        }
+        const size_t count = qbe_instruction_uses(&block->jump, uses);
+        for (size_t u = 0; u < count; u++) add_user(sccp, uses[u], (StatementRef) { b, arrlen(block->statements) });
+    }
+}
+
+static void remove_phi_args(QBEBlock* block, const char* label) {
+    for (ptrdiff_t i = 0; i < arrlen(block->statements) && is_phi(&block->statements[i]); i++) {
+        QBEPhiArg* args = block->statements[i].assign.instruction.phi.args;
+        for (ptrdiff_t a = arrlen(args) - 1; a >= 0; a--) {
+            if (strcmp(args[a].label, label) == 0) arrdel(args, a);
+        }
+        block->statements[i].assign.instruction.phi.args = args;
+    }
+}
+
+// Temporaries known to be constant get replaced by their value, branches on them become jumps
+// and the blocks nothing executable reaches go away
+static size_t sccp_rewrite(Sccp* sccp) {
+    QBEFunction* function = sccp->function;
+    QBESubstitution* substitutions = NULL;
+    char** replaced = NULL;
+    size_t changes = 0;
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        QBEBlock* block = &function->blocks[b];
+        if (!sccp->executable[b]) continue;
+        ptrdiff_t kept = 0;
+        for (ptrdiff_t i = 0; i < arrlen(block->statements); i++) {
+            QBEStatement* st = &block->statements[i];
+            const Lattice lattice = st->type == QST_ASSIGN ? sccp->lattice[temp_ids_get(&sccp->temps, st->assign.value.name)] : (Lattice) {0};
+            if (lattice.kind != LK_CONST) {
+                block->statements[kept++] = *st;
+                continue;
+            }
+            shput(substitutions, st->assign.value.name, ((QBEValue) { .kind = QVK_CONST, .const_i = lattice.value }));
+            arrput(replaced, st->assign.value.name);
+            if (is_phi(st)) arrfree(st->assign.instruction.phi.args);
+        }
+        if (kept < arrlen(block->statements)) arrsetlen(block->statements, kept);
+
+        QBEInstruction* jump = &block->jump;
+        if (jump->type != QIT_JNZ) continue;
+        const Lattice cond = value_lattice(sccp, &jump->jnz.value);
+        if (cond.kind != LK_CONST) continue;
+        char* taken = cond.value != 0 ? jump->jnz.then : jump->jnz.otherwise;
+        const char* dropped = cond.value != 0 ? jump->jnz.otherwise : jump->jnz.then;
+        if (strcmp(taken, dropped) != 0) remove_phi_args(&function->blocks[qbe_function_find_block(function, dropped)], block->name);
+        *jump = (QBEInstruction) { .type = QIT_JMP, .jmp = { .label = taken } };
+        changes++;
+    }
+
+    // Before anything moves, succs are still indices into the original order
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        const QBEBlock* block = &function->blocks[b];
+        if (sccp->executable[b]) continue;
+        for (ptrdiff_t s = 0; s < arrlen(block->succs); s++) remove_phi_args(&function->blocks[block->succs[s]], block->name);
+    }
+    ptrdiff_t kept = 0;
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        QBEBlock* block = &function->blocks[b];
+        if (sccp->executable[b]) {
+            function->blocks[kept++] = *block;
+            continue;
+        }
+        qbe_block_free(block);
+        changes++;
+    }
+    arrsetlen(function->blocks, kept);
+    qbe_function_link(function);
+
+    qbe_function_substitute(function, substitutions);
+    changes += arrlen(replaced);
+    shfree(substitutions);
+    for (ptrdiff_t i = 0; i < arrlen(replaced); i++) free(replaced[i]);
+    arrfree(replaced);
+    return changes;
+}
+
+size_t sparse_conditional_constant_propagation(QBEFunction* function) {
+    Sccp sccp = { .function = function, .temps = temp_ids_build(function) };
+    const ptrdiff_t temp_count = arrlen(sccp.temps.names);
+    const ptrdiff_t n = arrlen(function->blocks);
+    sccp.lattice = calloc(temp_count + 1, sizeof(Lattice));
+    sccp.users = calloc(temp_count + 1, sizeof(StatementRef*));
+    sccp.executable = calloc(n + 1, sizeof(bool));
+    sccp.edges = calloc(n + 1, sizeof(bool*));
+    assert(sccp.lattice && sccp.users && sccp.executable && sccp.edges);
+    for (ptrdiff_t b = 0; b < n; b++) {
+        sccp.edges[b] = calloc(arrlen(function->blocks[b].succs) + 1, sizeof(bool));
+        assert(sccp.edges[b]);
+    }
+    // Params could be anything
+    for (ptrdiff_t p = 0; p < arrlen(function->params); p++) {
+        const ptrdiff_t id = temp_ids_get(&sccp.temps, function->params[p].name);
+        if (id != -1) sccp.lattice[id].kind = LK_VARYING;
+    }
+    find_users(&sccp);
+
+    sccp.executable[0] = true;
+    for (ptrdiff_t i = 0; i <= arrlen(function->blocks[0].statements); i++) arrput(sccp.reached, ((StatementRef) { 0, i }));
+    // Statements reached through a new edge go first, so values only change once their block is in
+    while (sccp.next_reached < arrlen(sccp.reached) || arrlen(sccp.changed) > 0) {
+        if (sccp.next_reached < arrlen(sccp.reached)) {
+            // In order, so a block sees the values of its earlier statements
+            visit(&sccp, sccp.reached[sccp.next_reached++]);
+            continue;
+        }
+        const ptrdiff_t id = arrpop(sccp.changed);
+        for (ptrdiff_t u = 0; u < arrlen(sccp.users[id]); u++) {
+            if (sccp.executable[sccp.users[id][u].block]) visit(&sccp, sccp.users[id][u]);
+        }
+    }
+
+    const size_t changes = sccp_rewrite(&sccp);
+    temp_ids_free(&sccp.temps);
+    for (ptrdiff_t t = 0; t < temp_count; t++) arrfree(sccp.users[t]);
+    for (ptrdiff_t b = 0; b < n; b++) free(sccp.edges[b]);
+    free(sccp.users);
+    free(sccp.lattice);
+    free(sccp.executable);
+    free(sccp.edges);
+    arrfree(sccp.changed);
+    arrfree(sccp.reached);
+    return changes;
+}
@@ -0,0 +1,429 @@
+#include "sema_cache.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../extern/stb_ds.h"
+
+typedef struct {
+    SemaCacheExpr* exprs;
+    SemaCacheStatement* statements;
+    uint32_t* args;
+    // Compound type ids depend on the order they got interned in, so they can't be cached
+    bool cacheable;
+} SemaCacheWriter;
+
+typedef struct {
+    const SemaCacheHeader* header;
+    const SemaCacheExpr* exprs;
+    const SemaCacheStatement* statements;
+    const uint32_t* args;
+    uint32_t expr_index, statement_index, arg_index;
+} SemaCacheReader;
+
+static uint64_t fingerprint_bytes(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t fingerprint_string(uint64_t hash, const char* str) {
+    return fingerprint_bytes(hash, str, strlen(str) + 1);
+}
+
+static uint64_t fingerprint_signature(uint64_t hash, const Statement* fn) {
+    hash = fingerprint_string(hash, fn->as.fn_def.ret_type);
+    const uint64_t arg_count = arrlen(fn->as.fn_def.args);
+    hash = fingerprint_bytes(hash, &arg_count, sizeof(arg_count));
+    for (ptrdiff_t i = 0; i < arrlen(fn->as.fn_def.args); i++) {
+        hash = fingerprint_string(hash, fn->as.fn_def.args[i].name);
+        hash = fingerprint_string(hash, fn->as.fn_def.args[i].type);
+    }
+    return hash;
+}
+
+// What a call gets checked against, nothing goes in for functions that don't exist
+static uint64_t fingerprint_callee(uint64_t hash, const char* name, const Statement* ast) {
+    for (ptrdiff_t i = 0; i < arrlen(ast); i++) {
+        if (ast[i].type == ST_FN_DEFINITION && strcmp(ast[i].as.fn_def.name, name) == 0) return fingerprint_signature(hash, &ast[i]);
+    }
+    return hash;
+}
+
+static uint64_t fingerprint_expr(uint64_t hash, const Expr* expr, const Statement* ast) {
+    const uint32_t type = expr->type;
+    hash = fingerprint_bytes(hash, &type, sizeof(type));
+    switch (expr->type) {
+        case ET_NUMBER: return fingerprint_bytes(hash, &expr->as.number, sizeof(expr->as.number));
+        case ET_BOOL: return fingerprint_bytes(hash, &expr->as.boolean, sizeof(expr->as.boolean));
+        case ET_VARIABLE: return fingerprint_string(hash, expr->as.variable.name);
+        case ET_BINARY: {
+            hash = fingerprint_bytes(hash, &expr->as.binary.op, sizeof(expr->as.binary.op));
+            hash = fingerprint_expr(hash, expr->as.binary.left, ast);
+            return fingerprint_expr(hash, expr->as.binary.right, ast);
+        }
+        case ET_CALL: {
+            hash = fingerprint_string(hash, expr->as.call.name);
+            hash = fingerprint_callee(hash, expr->as.call.name, ast);
+            const uint64_t arg_count = arrlen(expr->as.call.args);
+            hash = fingerprint_bytes(hash, &arg_count, sizeof(arg_count));
+            for (ptrdiff_t i = 0; i < arrlen(expr->as.call.args); i++) hash = fingerprint_expr(hash, expr->as.call.args[i], ast);
+            return hash;
+        }
+    }
+    return hash;
+}
+
+static uint64_t fingerprint_body(uint64_t hash, const Statement* body, const Statement* ast);
+
+static uint64_t fingerprint_statement(uint64_t hash, const Statement* st, const Statement* ast) {
+    const uint32_t type = st->type;
+    hash = fingerprint_bytes(hash, &type, sizeof(type));
+    switch (st->type) {
+        case ST_RETURN: return fingerprint_expr(hash, st->as.ret, ast);
+        case ST_VARIABLE_DEFINE: {
+            hash = fingerprint_string(hash, st->as.var_def.name);
+            hash = fingerprint_string(hash, st->as.var_def.type);
+            hash = fingerprint_bytes(hash, &st->as.var_def.is_const, sizeof(st->as.var_def.is_const));
+            const bool has_value = st->as.var_def.value != NULL;
+            hash = fingerprint_bytes(hash, &has_value, sizeof(has_value));
+            return has_value ? fingerprint_expr(hash, st->as.var_def.value, ast) : hash;
+        }
+        case ST_SET_VARIABLE: {
+            hash = fingerprint_string(hash, st->as.var_assign.var);
+            return fingerprint_expr(hash, st->as.var_assign.new_val, ast);
+        }
+        case ST_IF: {
+            hash = fingerprint_expr(hash, st->as.if_st.cond, ast);
+            return fingerprint_body(hash, st->as.if_st.body, ast);
+        }
+        case ST_WHILE: {
+            hash = fingerprint_expr(hash, st->as.while_st.cond, ast);
+            return fingerprint_body(hash, st->as.while_st.body, ast);
+        }
+        case ST_FN_DEFINITION: {
+            hash = fingerprint_string(hash, st->as.fn_def.name);
+            hash = fingerprint_signature(hash, st);
+            return fingerprint_body(hash, st->as.fn_def.body, ast);
+        }
+        case ST_ERROR: break;
+    }
+    return hash;
+}
+
+// The length goes in first so moving a statement into or out of a body changes the fingerprint
+static uint64_t fingerprint_body(uint64_t hash, const Statement* body, const Statement* ast) {
+    const uint64_t count = arrlen(body);
+    hash = fingerprint_bytes(hash, &count, sizeof(count));
+    for (ptrdiff_t i = 0; i < arrlen(body); i++) hash = fingerprint_statement(hash, &body[i], ast);
+    return hash;
+}
+
+uint64_t sema_cache_fingerprint(const Statement* fn, const Statement* ast) {
+    const uint32_t version = SEMA_CACHE_VERSION;
+    uint64_t hash = fingerprint_bytes(14695981039346656037ULL, &version, sizeof(version));
+    return fingerprint_statement(hash, fn, ast);
+}
+
+char* sema_cache_path(const char* dir, uint64_t fingerprint) {
+    size_t len = strlen(dir) + 32;
+    char* path = malloc(len);
+    assert(path);
+    snprintf(path, len, "%s/%016lx.sem", dir, fingerprint);
+    return path;
+}
+
+static uint32_t writer_type(SemaCacheWriter* w, TypeId type) {
+    if (type >= TYPE_BUILTIN_COUNT) w->cacheable = false;
+    return type;
+}
+
+static void writer_expr(SemaCacheWriter* w, const Expr* expr) {
+    SemaCacheExpr e = {
+        .value_type = writer_type(w, expr->value_type),
+        .is_constant = expr->is_constant,
+        .symbol = expr->type == ET_VARIABLE ? expr->as.variable.symbol : -1,
+        .constant = expr->is_constant ? expr->constant : 0,
+    };
+    arrput(w->exprs, e);
+    if (expr->type == ET_BINARY) {
+        writer_expr(w, expr->as.binary.left);
+        writer_expr(w, expr->as.binary.right);
+    }
+    if (expr->type == ET_CALL) {
+        for (ptrdiff_t i = 0; i < arrlen(expr->as.call.args); i++) writer_expr(w, expr->as.call.args[i]);
+    }
+}
+
+static void writer_body(SemaCacheWriter* w, const Statement* body);
+
+static void writer_statement(SemaCacheWriter* w, const Statement* st) {
+    SemaCacheStatement s = { .symbol = -1 };
+    switch (st->type) {
+        case ST_RETURN: {
+            arrput(w->statements, s);
+            writer_expr(w, st->as.ret);
+            return;
+        }
+        case ST_VARIABLE_DEFINE: {
+            s.symbol = st->as.var_def.symbol;
+            s.value_type = writer_type(w, st->as.var_def.value_type);
+            s.is_folded = st->as.var_def.is_folded;
+            arrput(w->statements, s);
+            if (st->as.var_def.value != NULL) writer_expr(w, st->as.var_def.value);
+            return;
+        }
+        case ST_SET_VARIABLE: {
+            s.symbol = st->as.var_assign.symbol;
+            s.value_type = writer_type(w, st->as.var_assign.value_type);
+            arrput(w->statements, s);
+            writer_expr(w, st->as.var_assign.new_val);
+            return;
+        }
+        case ST_IF: {
+            arrput(w->statements, s);
+            writer_expr(w, st->as.if_st.cond);
+            writer_body(w, st->as.if_st.body);
+            return;
+        }
+        case ST_WHILE: {
+            arrput(w->statements, s);
+            writer_expr(w, st->as.while_st.cond);
+            writer_body(w, st->as.while_st.body);
+            return;
+        }
+        case ST_FN_DEFINITION: {
+            s.symbol = st->as.fn_def.symbol_count;
+            s.value_type = writer_type(w, st->as.fn_def.ret_value_type);
+            arrput(w->statements, s);
+            for (ptrdiff_t i = 0; i < arrlen(st->as.fn_def.args); i++) {
+                arrput(w->args, writer_type(w, st->as.fn_def.args[i].value_type));
+            }
+            writer_body(w, st->as.fn_def.body);
+            return;
+        }
+        case ST_ERROR: {
+            arrput(w->statements, s);
+            return;
+        }
+    }
+}
+
+static void writer_body(SemaCacheWriter* w, const Statement* body) {
+    for (ptrdiff_t i = 0; i < arrlen(body); i++) writer_statement(w, &body[i]);
+}
+
+// How many entries writing a function produces. Only looks at the shape of the AST, so it works on functions
+// that weren't checked yet
+typedef struct {
+    size_t exprs;
+    size_t statements;
+    size_t args;
+} SemaCacheCounts;
+
+static void count_expr(SemaCacheCounts* counts, const Expr* expr) {
+    counts->exprs++;
+    if (expr->type == ET_BINARY) {
+        count_expr(counts, expr->as.binary.left);
+        count_expr(counts, expr->as.binary.right);
+    }
+    if (expr->type == ET_CALL) {
+        for (ptrdiff_t i = 0; i < arrlen(expr->as.call.args); i++) count_expr(counts, expr->as.call.args[i]);
+    }
+}
+
+static void count_body(SemaCacheCounts* counts, const Statement* body);
+
+static void count_statement(SemaCacheCounts* counts, const Statement* st) {
+    counts->statements++;
+    switch (st->type) {
+        case ST_RETURN: count_expr(counts, st->as.ret); break;
+        case ST_VARIABLE_DEFINE: if (st->as.var_def.value != NULL) count_expr(counts, st->as.var_def.value); break;
+        case ST_SET_VARIABLE: count_expr(counts, st->as.var_assign.new_val); break;
+        case ST_IF: {
+            count_expr(counts, st->as.if_st.cond);
+            count_body(counts, st->as.if_st.body);
+            break;
+        }
+        case ST_WHILE: {
+            count_expr(counts, st->as.while_st.cond);
+            count_body(counts, st->as.while_st.body);
+            break;
+        }
+        case ST_FN_DEFINITION: {
+            counts->args += arrlen(st->as.fn_def.args);
+            count_body(counts, st->as.fn_def.body);
+            break;
+        }
+        case ST_ERROR: break;
+    }
+}
+
+static void count_body(SemaCacheCounts* counts, const Statement* body) {
+    for (ptrdiff_t i = 0; i < arrlen(body); i++) count_statement(counts, &body[i]);
+}
+
+bool sema_cache_store(const char* path, uint64_t fingerprint, const Statement* fn) {
+    SemaCacheWriter w = { .cacheable = true };
+    writer_statement(&w, fn);
+
+    SemaCacheHeader header = {
+        .magic = SEMA_CACHE_MAGIC,
+        .version = SEMA_CACHE_VERSION,
+        .expr_count = arrlen(w.exprs),
+        .fingerprint = fingerprint,
+        .statement_count = arrlen(w.statements),
+        .arg_count = arrlen(w.args),
+    };
+
+    // Functions are checked (and stored) in parallel, so every writer gets its own temporary file
+    size_t tmp_len = strlen(path) + 8;
+    char* tmp_path = malloc(tmp_len);
+    assert(tmp_path);
+    snprintf(tmp_path, tmp_len, "%s.XXXXXX", path);
+
+    bool ok = false;
+    int fd = w.cacheable ? mkstemp(tmp_path) : -1;
+    // mkstemp creates the file only readable by us, the other cache entries aren't
+    if (fd >= 0) fchmod(fd, 0644);
+    FILE* file = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (file == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            remove(tmp_path);
+        }
+        if (w.cacheable) perror("failed to create semantic cache file");
+    } else {
+        ok = fwrite(&header, sizeof(header), 1, file) == 1;
+        if (ok && header.expr_count) ok = fwrite(w.exprs, sizeof(SemaCacheExpr), header.expr_count, file) == header.expr_count;
+        if (ok && header.statement_count) ok = fwrite(w.statements, sizeof(SemaCacheStatement), header.statement_count, file) == header.statement_count;
+        if (ok && header.arg_count) ok = fwrite(w.args, sizeof(uint32_t), header.arg_count, file) == header.arg_count;
+        if (fclose(file) != 0) ok = false;
+        if (ok) ok = rename(tmp_path, path) == 0;
+        if (!ok) {
+            fprintf(stderr, "Failed to write semantic cache file %s\n", path);
+            remove(tmp_path);
+        }
+    }
+
+    free(tmp_path);
+    arrfree(w.exprs);
+    arrfree(w.statements);
+    arrfree(w.args);
+    return ok;
+}
+
+static void reader_expr(SemaCacheReader* r, Expr* expr) {
+    const SemaCacheExpr* e = &r->exprs[r->expr_index++];
+    expr->value_type = e->value_type;
+    expr->is_constant = e->is_constant;
+    expr->constant = e->constant;
+    if (expr->type == ET_VARIABLE) expr->as.variable.symbol = e->symbol;
+    if (expr->type == ET_BINARY) {
+        reader_expr(r, expr->as.binary.left);
+        reader_expr(r, expr->as.binary.right);
+    }
+    if (expr->type == ET_CALL) {
+        for (ptrdiff_t i = 0; i < arrlen(expr->as.call.args); i++) reader_expr(r, expr->as.call.args[i]);
+    }
+}
+
+static void reader_body(SemaCacheReader* r, Statement* body);
+
+static void reader_statement(SemaCacheReader* r, Statement* st) {
+    const SemaCacheStatement* s = &r->statements[r->statement_index++];
+    switch (st->type) {
+        case ST_RETURN: {
+            reader_expr(r, st->as.ret);
+            return;
+        }
+        case ST_VARIABLE_DEFINE: {
+            st->as.var_def.symbol = s->symbol;
+            st->as.var_def.value_type = s->value_type;
+            st->as.var_def.is_folded = s->is_folded;
+            if (st->as.var_def.value != NULL) reader_expr(r, st->as.var_def.value);
+            return;
+        }
+        case ST_SET_VARIABLE: {
+            st->as.var_assign.symbol = s->symbol;
+            st->as.var_assign.value_type = s->value_type;
+            reader_expr(r, st->as.var_assign.new_val);
+            return;
+        }
+        case ST_IF: {
+            reader_expr(r, st->as.if_st.cond);
+            reader_body(r, st->as.if_st.body);
+            return;
+        }
+        case ST_WHILE: {
+            reader_expr(r, st->as.while_st.cond);
+            reader_body(r, st->as.while_st.body);
+            return;
+        }
+        case ST_FN_DEFINITION: {
+            st->as.fn_def.symbol_count = s->symbol;
+            st->as.fn_def.ret_value_type = s->value_type;
+            for (ptrdiff_t i = 0; i < arrlen(st->as.fn_def.args); i++) {
+                st->as.fn_def.args[i].value_type = r->args[r->arg_index++];
+            }
+            reader_body(r, st->as.fn_def.body);
+            return;
+        }
+        case ST_ERROR: return;
+    }
+}
+
+static void reader_body(SemaCacheReader* r, Statement* body) {
+    for (ptrdiff_t i = 0; i < arrlen(body); i++) reader_statement(r, &body[i]);
+}
+
+bool sema_cache_load(const char* path, uint64_t fingerprint, Statement* fn) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return false;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size < (long)sizeof(SemaCacheHeader)) {
+        fclose(file);
+        return false;
+    }
+    char* content = malloc(size);
+    assert(content);
+    const bool read = fread(content, 1, size, file) == (size_t)size;
+    fclose(file);
+
+    // Recounting the function is cheap and makes sure applying the entry can't run out of bounds
+    SemaCacheCounts counts = {0};
+    count_statement(&counts, fn);
+
+    const SemaCacheHeader* header = (const SemaCacheHeader*)content;
+    const size_t expected_size = sizeof(SemaCacheHeader) +
+                                 (size_t)header->expr_count * sizeof(SemaCacheExpr) +
+                                 (size_t)header->statement_count * sizeof(SemaCacheStatement) +
+                                 (size_t)header->arg_count * sizeof(uint32_t);
+    const bool hit = read &&
+                     memcmp(header->magic, SEMA_CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+                     header->version == SEMA_CACHE_VERSION &&
+                     header->fingerprint == fingerprint &&
+                     (size_t)size == expected_size &&
+                     header->expr_count == counts.exprs &&
+                     header->statement_count == counts.statements &&
+                     header->arg_count == counts.args;
+
+    if (hit) {
+        SemaCacheReader r = {
+            .header = header,
+            .exprs = (const SemaCacheExpr*)(header + 1),
+        };
+        r.statements = (const SemaCacheStatement*)(r.exprs + header->expr_count);
+        r.args = (const uint32_t*)(r.statements + header->statement_count);
+        reader_statement(&r, fn);
+    }
+    free(content);
+    return hit;
+}
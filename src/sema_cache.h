@@ -0,0 +1,47 @@
+#ifndef SEMA_CACHE_H
+#define SEMA_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "parser.h"
+
+// On disk results of checking a single function, keyed by a fingerprint of the function.
+// Only functions without errors get cached, so an entry is just the annotations
+// the type checker and the constant evaluator leave on the AST.
+#define SEMA_CACHE_MAGIC "NSLSEM\0"
+#define SEMA_CACHE_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t expr_count;
+    uint64_t fingerprint;
+    uint32_t statement_count;
+    uint32_t arg_count;
+} SemaCacheHeader;
+
+// Expressions and statements are stored in the order they appear in the function (pre-order)
+typedef struct {
+    uint32_t value_type;
+    uint32_t is_constant;
+    int64_t symbol;
+    uint64_t constant;
+} SemaCacheExpr;
+
+// `symbol` is the symbol count and `value_type` the return type for function definitions
+typedef struct {
+    int64_t symbol;
+    uint32_t value_type;
+    uint32_t is_folded;
+} SemaCacheStatement;
+
+// Covers everything checking `fn` depends on: its own signature and body, but not locations.
+// The signatures of the functions it calls get looked up in the top level statements `ast`
+uint64_t sema_cache_fingerprint(const Statement* fn, const Statement* ast);
+// Returns a malloc'd path of the cache entry for `fingerprint` inside of `dir`
+char* sema_cache_path(const char* dir, uint64_t fingerprint);
+bool sema_cache_store(const char* path, uint64_t fingerprint, const Statement* fn);
+// Annotates `fn` with the cached results, returns false on a miss and leaves `fn` untouched then
+bool sema_cache_load(const char* path, uint64_t fingerprint, Statement* fn);
+
+#endif
@@ -0,0 +1,191 @@
+#include "passes.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../extern/stb_ds.h"
+
+static bool is_phi(const QBEStatement* st) {
+    return st->type == QST_ASSIGN && st->assign.instruction.type == QIT_PHI;
+}
+
+// The edge from the block called `label` into `block` went away
+static void remove_phi_args(QBEBlock* block, const char* label) {
+    for (ptrdiff_t i = 0; i < arrlen(block->statements) && is_phi(&block->statements[i]); i++) {
+        QBEPhiArg* args = block->statements[i].assign.instruction.phi.args;
+        for (ptrdiff_t a = arrlen(args) - 1; a >= 0; a--) {
+            if (strcmp(args[a].label, label) == 0) arrdel(args, a);
+        }
+        block->statements[i].assign.instruction.phi.args = args;
+    }
+}
+
+static void rename_phi_args(QBEBlock* block, const char* from, char* to) {
+    for (ptrdiff_t i = 0; i < arrlen(block->statements) && is_phi(&block->statements[i]); i++) {
+        QBEPhiArg* args = block->statements[i].assign.instruction.phi.args;
+        for (ptrdiff_t a = 0; a < arrlen(args); a++) {
+            if (strcmp(args[a].label, from) == 0) args[a].label = to;
+        }
+    }
+}
+
+static ptrdiff_t succ_called(const QBEFunction* function, ptrdiff_t b, const char* label) {
+    const QBEBlock* block = &function->blocks[b];
+    for (ptrdiff_t s = 0; s < arrlen(block->succs); s++) {
+        if (strcmp(function->blocks[block->succs[s]].name, label) == 0) return block->succs[s];
+    }
+    assert(false && "Function isn't linked");
+    return -1;
+}
+
+// A jnz on a constant or with the same label on both sides becomes a jmp
+static size_t fold_branches(QBEFunction* function) {
+    size_t changes = 0;
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        QBEInstruction* jump = &function->blocks[b].jump;
+        if (jump->type != QIT_JNZ) continue;
+        char* taken;
+        const char* dropped;
+        if (jump->jnz.value.kind == QVK_CONST) {
+            taken = jump->jnz.value.const_i != 0 ? jump->jnz.then : jump->jnz.otherwise;
+            dropped = jump->jnz.value.const_i != 0 ? jump->jnz.otherwise : jump->jnz.then;
+        } else if (strcmp(jump->jnz.then, jump->jnz.otherwise) == 0) {
+            taken = jump->jnz.then;
+            dropped = taken;
+        } else {
+            continue;
+        }
+        if (strcmp(taken, dropped) != 0) remove_phi_args(&function->blocks[succ_called(function, b, dropped)], function->blocks[b].name);
+        *jump = (QBEInstruction) { .type = QIT_JMP, .jmp = { .label = taken } };
+        changes++;
+    }
+    if (changes > 0) qbe_function_link(function);
+    return changes;
+}
+
+// Frees the blocks marked in `removed` and closes the gaps they leave, the function has to be linked again after
+static void remove_blocks(QBEFunction* function, const bool* removed) {
+    ptrdiff_t kept = 0;
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        if (removed[b]) {
+            qbe_block_free(&function->blocks[b]);
+            continue;
+        }
+        function->blocks[kept++] = function->blocks[b];
+    }
+    arrsetlen(function->blocks, kept);
+}
+
+static size_t remove_unreachable(QBEFunction* function) {
+    const ptrdiff_t n = arrlen(function->blocks);
+    bool* reachable = calloc(n + 1, sizeof(bool));
+    assert(reachable);
+    ptrdiff_t* stack = NULL;
+    reachable[0] = true;
+    arrput(stack, 0);
+    while (arrlen(stack) > 0) {
+        const ptrdiff_t b = arrpop(stack);
+        for (ptrdiff_t s = 0; s < arrlen(function->blocks[b].succs); s++) {
+            const ptrdiff_t succ = function->blocks[b].succs[s];
+            if (reachable[succ]) continue;
+            reachable[succ] = true;
+            arrput(stack, succ);
+        }
+    }
+    arrfree(stack);
+
+    size_t changes = 0;
+    for (ptrdiff_t b = 0; b < n; b++) {
+        if (reachable[b]) continue;
+        for (ptrdiff_t s = 0; s < arrlen(function->blocks[b].succs); s++) {
+            remove_phi_args(&function->blocks[function->blocks[b].succs[s]], function->blocks[b].name);
+        }
+        changes++;
+    }
+    if (changes > 0) {
+        // `reachable` flipped into the blocks to remove
+        for (ptrdiff_t b = 0; b < n; b++) reachable[b] = !reachable[b];
+        remove_blocks(function, reachable);
+        qbe_function_link(function);
+    }
+    free(reachable);
+    return changes;
+}
+
+// Phis of blocks with a single pred just stand for their only arg
+static size_t remove_trivial_phis(QBEFunction* function, QBESubstitution** substitutions, char*** names) {
+    size_t changes = 0;
+    for (ptrdiff_t b = 0; b < arrlen(function->blocks); b++) {
+        QBEBlock* block = &function->blocks[b];
+        if (arrlen(block->preds) != 1) continue;
+        ptrdiff_t count = 0;
+        while (count < arrlen(block->statements) && is_phi(&block->statements[count])) {
+            QBEStatement* phi = &block->statements[count];
+            assert(arrlen(phi->assign.instruction.phi.args) == 1);
+            shput(*substitutions, phi->assign.value.name, phi->assign.instruction.phi.args[0].value);
+            // Still a key of the substitutions
+            arrput(*names, phi->assign.value.name);
+            arrfree(phi->assign.instruction.phi.args);
+            count++;
+        }
+        if (count == 0) continue;
+        memmove(block->statements, block->statements + count, (arrlen(block->statements) - count) * sizeof(QBEStatement));
+        arrsetlen(block->statements, arrlen(block->statements) - count);
+        changes += count;
+    }
+    return changes;
+}
+
+// A block that only jumps to a block with no other pred takes over its statements and jump
+static size_t merge_blocks(QBEFunction* function) {
+    const ptrdiff_t n = arrlen(function->blocks);
+    bool* removed = calloc(n + 1, sizeof(bool));
+    assert(removed);
+    size_t changes = 0;
+    for (ptrdiff_t b = 0; b < n; b++) {
+        if (removed[b]) continue;
+        QBEBlock* block = &function->blocks[b];
+        while (block->jump.type == QIT_JMP) {
+            const ptrdiff_t c = block->succs[0];
+            QBEBlock* next = &function->blocks[c];
+            if (c == b || c == 0 || arrlen(next->preds) != 1) break;
+            // Single pred blocks don't have phis left
+            for (ptrdiff_t i = 0; i < arrlen(next->statements); i++) arrput(block->statements, next->statements[i]);
+            arrfree(next->statements);
+            block->jump = next->jump;
+            for (ptrdiff_t s = 0; s < arrlen(next->succs); s++) {
+                QBEBlock* succ = &function->blocks[next->succs[s]];
+                rename_phi_args(succ, next->name, block->name);
+                for (ptrdiff_t p = 0; p < arrlen(succ->preds); p++) {
+                    if (succ->preds[p] == c) succ->preds[p] = b;
+                }
+            }
+            arrfree(block->succs);
+            block->succs = next->succs;
+            next->succs = NULL;
+            removed[c] = true;
+            changes++;
+        }
+    }
+    if (changes > 0) {
+        remove_blocks(function, removed);
+        qbe_function_link(function);
+    }
+    free(removed);
+    return changes;
+}
+
+size_t simplify_cfg(QBEFunction* function) {
+    QBESubstitution* substitutions = NULL;
+    char** names = NULL;
+    size_t changes = fold_branches(function);
+    changes += remove_unreachable(function);
+    changes += remove_trivial_phis(function, &substitutions, &names);
+    changes += merge_blocks(function);
+
+    qbe_function_substitute(function, substitutions);
+    shfree(substitutions);
+    for (ptrdiff_t i = 0; i < arrlen(names); i++) free(names[i]);
+    arrfree(names);
+    return changes;
+}
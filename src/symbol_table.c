@@ -0,0 +1,81 @@
+#include "symbol_table.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "../extern/stb_ds.h"
+
+static size_t symbol_hash(const char* name, size_t slot_count) {
+    return (size_t)(((uintptr_t)name >> 3) * 11400714819323198485ULL) & (slot_count - 1);
+}
+
+static size_t symbol_table_probe(const SymbolTable* table, const char* name) {
+    size_t slot = symbol_hash(name, table->slot_count);
+    while (table->slots[slot] != -1 && table->entries[table->slots[slot]].name != name) {
+        slot = (slot + 1) & (table->slot_count - 1);
+    }
+    return slot;
+}
+
+// Clearing a slot on pop without tombstones is only fine because names leave the table in the
+// reverse order they entered it, so rehashing has to insert names in the order of their
+// outermost definition. Shadowing definitions just reuse the slot afterwards.
+static void symbol_table_grow(SymbolTable* table) {
+    free(table->slots);
+    table->slot_count = table->slot_count == 0 ? 16 : table->slot_count * 2;
+    table->slots = malloc(sizeof(ptrdiff_t) * table->slot_count);
+    assert(table->slots);
+    for (size_t i = 0; i < table->slot_count; i++) table->slots[i] = -1;
+
+    for (ptrdiff_t i = 0; i < arrlen(table->entries); i++) {
+        SymbolEntry* entry = &table->entries[i];
+        if (entry->shadowed == -1) {
+            entry->slot = symbol_table_probe(table, entry->name);
+        } else {
+            entry->slot = table->entries[entry->shadowed].slot;
+        }
+        table->slots[entry->slot] = i;
+    }
+}
+
+void symbol_table_push_scope(SymbolTable* table) {
+    arrput(table->scopes, arrlen(table->entries));
+}
+
+void symbol_table_pop_scope(SymbolTable* table) {
+    assert(arrlen(table->scopes) > 0);
+    const ptrdiff_t mark = arrpop(table->scopes);
+    while (arrlen(table->entries) > mark) {
+        const SymbolEntry entry = arrpop(table->entries);
+        table->slots[entry.slot] = entry.shadowed;
+        if (entry.shadowed == -1) table->used_slots--;
+    }
+}
+
+void symbol_table_define(SymbolTable* table, const char* name, ptrdiff_t id) {
+    if ((table->used_slots + 1) * 2 > table->slot_count) symbol_table_grow(table);
+
+    const size_t slot = symbol_table_probe(table, name);
+    SymbolEntry entry = {
+        .name = name,
+        .id = id,
+        .shadowed = table->slots[slot],
+        .slot = slot,
+    };
+    if (entry.shadowed == -1) table->used_slots++;
+    table->slots[slot] = arrlen(table->entries);
+    arrput(table->entries, entry);
+}
+
+ptrdiff_t symbol_table_lookup(const SymbolTable* table, const char* name) {
+    if (table->slot_count == 0) return -1;
+    const ptrdiff_t entry = table->slots[symbol_table_probe(table, name)];
+    if (entry == -1) return -1;
+    return table->entries[entry].id;
+}
+
+void symbol_table_free(SymbolTable* table) {
+    arrfree(table->entries);
+    arrfree(table->scopes);
+    free(table->slots);
+    *table = (SymbolTable) {0};
+}
@@ -0,0 +1,33 @@
+#ifndef SYMBOL_TABLE_H
+#define SYMBOL_TABLE_H
+
+#include <stddef.h>
+
+typedef struct {
+    const char* name;
+    ptrdiff_t id;
+    // Entry of the symbol with the same name this one shadows, -1 if none
+    ptrdiff_t shadowed;
+    size_t slot;
+} SymbolEntry;
+
+// Scoped symbol table keyed by interned names (compared by pointer).
+// Lookups go through an open addressing table that always points at the innermost
+// definition of a name, popping a scope restores whatever its definitions shadowed.
+typedef struct {
+    SymbolEntry* entries;
+    ptrdiff_t* slots;
+    size_t slot_count;
+    size_t used_slots;
+    // Length of `entries` when each scope was pushed
+    ptrdiff_t* scopes;
+} SymbolTable;
+
+void symbol_table_push_scope(SymbolTable* table);
+void symbol_table_pop_scope(SymbolTable* table);
+void symbol_table_define(SymbolTable* table, const char* name, ptrdiff_t id);
+// Returns the id of the innermost definition of `name` or -1
+ptrdiff_t symbol_table_lookup(const SymbolTable* table, const char* name);
+void symbol_table_free(SymbolTable* table);
+
+#endif
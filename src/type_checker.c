@@ -1,158 +1,428 @@
 #include "type_checker.h"
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "../extern/stb_ds.h"
+#include "const_eval.h"
+#include "sema_cache.h"
+#include "lexer.h"
 #include "parser.h"
 
 
-static void type_check_st(TypeChecker* checker, Statement st);
-static CheckerType type_check_expr(TypeChecker* checker, Expr* expr);
+static void type_check_st(TypeChecker* checker, Statement* st);
+static TypeId type_check_expr(TypeChecker* checker, Expr* expr);
+static TypeId type_check_expr_inner(TypeChecker* checker, Expr* expr);
+static void type_check_fn(TypeChecker* checker, Statement* st);
 
-bool type_check(TypeChecker* checker) {
-    for (ptrdiff_t i = 0; i < arrlen(checker->ast); i++) type_check_st(checker, checker->ast[i]);
-    return checker->err;
+// Bodies of the top level functions, picked up by the workers one by one
+typedef struct {
+    Statement** fns;
+    TypeChecker* results;
+    atomic_size_t next;
+} CheckerPool;
+
+typedef struct {
+    CheckerError error;
+    size_t order;
+} OrderedError;
+
+void checker_error(TypeChecker* checker, Location loc, const char* message) {
+    CheckerError error = {
+        .message = message,
+        .loc = loc,
+    };
+    arrput(checker->errors, error);
+    checker->err = true;
 }
 
-CheckerVariable fn_arg_to_checker_var(FnArg arg) {
-    if (strcmp(arg.type, "i32") == 0) {
-        return (CheckerVariable) {
-            .type = CT_INT,
-            .name = arg.name
+static void collect_signatures(TypeChecker* checker) {
+    for (ptrdiff_t i = 0; i < arrlen(checker->ast); i++) {
+        const Statement* st = &checker->ast[i];
+        if (st->type != ST_FN_DEFINITION) continue;
+
+        for (ptrdiff_t j = 0; j < arrlen(checker->functions); j++) {
+            if (strcmp(checker->functions[j].name, st->as.fn_def.name) == 0) {
+                checker_error(checker, st->loc, "Function is already defined");
+                break;
+            }
+        }
+        if (arrlen(st->as.fn_def.args) > FN_MAX_ARGS) checker_error(checker, st->loc, "Function takes too many arguments");
+        // Unknown types get reported once the body is checked
+        CheckerFunction fn = {
+            .name = st->as.fn_def.name,
+            .ret = type_from_name(checker->types, st->as.fn_def.ret_type),
         };
+        for (ptrdiff_t j = 0; j < arrlen(st->as.fn_def.args); j++) {
+            arrput(fn.args, type_from_name(checker->types, st->as.fn_def.args[j].type));
+        }
+        arrput(checker->functions, fn);
+    }
+}
+
+static void* checker_worker(void* arg) {
+    CheckerPool* pool = arg;
+    while (true) {
+        const size_t i = atomic_fetch_add(&pool->next, 1);
+        if (i >= (size_t)arrlen(pool->fns)) return NULL;
+        type_check_fn(&pool->results[i], pool->fns[i]);
+    }
+}
+
+static int ordered_error_compare(const void* a, const void* b) {
+    const OrderedError* l = a;
+    const OrderedError* r = b;
+    if (l->error.loc.row != r->error.loc.row) return l->error.loc.row < r->error.loc.row ? -1 : 1;
+    if (l->error.loc.col != r->error.loc.col) return l->error.loc.col < r->error.loc.col ? -1 : 1;
+    return l->order < r->order ? -1 : l->order > r->order;
+}
+
+static void sort_errors(TypeChecker* checker) {
+    OrderedError* ordered = NULL;
+    for (ptrdiff_t i = 0; i < arrlen(checker->errors); i++) {
+        OrderedError e = { .error = checker->errors[i], .order = i };
+        arrput(ordered, e);
+    }
+    if (ordered != NULL) qsort(ordered, arrlen(ordered), sizeof(OrderedError), ordered_error_compare);
+    for (ptrdiff_t i = 0; i < arrlen(ordered); i++) checker->errors[i] = ordered[i].error;
+    arrfree(ordered);
+}
+
+// Function bodies only depend on the signatures collected up front, so every top level
+// function gets checked on its own worker with its own variables, symbols and errors.
+// The top level statements are checked on the calling thread meanwhile.
+bool type_check(TypeChecker* checker) {
+    collect_signatures(checker);
+
+    CheckerPool pool = {0};
+    atomic_init(&pool.next, 0);
+    for (ptrdiff_t i = 0; i < arrlen(checker->ast); i++) {
+        if (checker->ast[i].type == ST_FN_DEFINITION) arrput(pool.fns, &checker->ast[i]);
     }
-    if (strcmp(arg.type, "bool") == 0) {
-        return (CheckerVariable) {
-            .type = CT_BOOL,
-            .name = arg.name
+    pool.results = calloc(arrlen(pool.fns) + 1, sizeof(TypeChecker));
+    assert(pool.results);
+    for (ptrdiff_t i = 0; i < arrlen(pool.fns); i++) {
+        pool.results[i] = (TypeChecker) {
+            .ast = checker->ast,
+            .types = checker->types,
+            .functions = checker->functions,
+            .cache_dir = checker->cache_dir,
         };
     }
-    assert(false);
+
+    pthread_t* threads = NULL;
+    size_t worker_count = checker->thread_count > 1 ? checker->thread_count - 1 : 0;
+    if (worker_count > (size_t)arrlen(pool.fns)) worker_count = arrlen(pool.fns);
+    for (size_t i = 0; i < worker_count; i++) {
+        pthread_t thread;
+        // Whatever isn't picked up by a worker gets checked on this thread below
+        if (pthread_create(&thread, NULL, checker_worker, &pool) != 0) break;
+        arrput(threads, thread);
+    }
+
+    // The top level statements end up in `main`
+    checker->ret_type = TYPE_I32;
+    const ptrdiff_t error_count = arrlen(checker->errors);
+    for (ptrdiff_t i = 0; i < arrlen(checker->ast); i++) {
+        if (checker->ast[i].type != ST_FN_DEFINITION) type_check_st(checker, &checker->ast[i]);
+    }
+    if (arrlen(checker->errors) == error_count) const_eval(checker, checker->ast, arrlen(checker->vars));
+    checker_worker(&pool);
+    for (ptrdiff_t i = 0; i < arrlen(threads); i++) pthread_join(threads[i], NULL);
+
+    for (ptrdiff_t i = 0; i < arrlen(pool.fns); i++) {
+        for (ptrdiff_t j = 0; j < arrlen(pool.results[i].errors); j++) {
+            arrput(checker->errors, pool.results[i].errors[j]);
+        }
+        checker->err |= pool.results[i].err;
+        arrfree(pool.results[i].errors);
+    }
+    sort_errors(checker);
+
+    arrfree(threads);
+    arrfree(pool.fns);
+    free(pool.results);
+    return checker->err;
 }
 
-static void type_check_st(TypeChecker* checker, Statement st) {
-    switch (st.type) {
-        case ST_FN_DEFINITION: {
-            CheckerVariable* saved = checker->vars;
-            checker->vars = NULL;
-            for (ptrdiff_t i = 0; i < arrlen(st.as.fn_def.args); i++) {
-                arrput(checker->vars, fn_arg_to_checker_var(st.as.fn_def.args[i]));
-            }
-            for (ptrdiff_t i = 0; i < arrlen(st.as.fn_def.body); i++) {
-                type_check_st(checker, st.as.fn_def.body[i]);
+void type_checker_free(TypeChecker* checker) {
+    for (ptrdiff_t i = 0; i < arrlen(checker->functions); i++) arrfree(checker->functions[i].args);
+    arrfree(checker->functions);
+    arrfree(checker->errors);
+    arrfree(checker->vars);
+    symbol_table_free(&checker->symbols);
+}
+
+void checker_error_display(CheckerError error, char* file_content, char* input_name) {
+    fprintf(stderr, "[checker::error] %s:%lu:%lu: %s\n",
+            input_name, error.loc.row, error.loc.col, error.message);
+
+    long offset = get_offset_in_buffer(file_content, error.loc);
+    if (offset < 0) return;
+    char* line_start = file_content + offset - error.loc.col + 1;
+    char* line_end = file_content + offset;
+    while (*line_end && *line_end != '\n') line_end++;
+
+    fwrite(line_start, 1, line_end - line_start, stderr);
+    fputc('\n', stderr);
+    ptrdiff_t line_offset = error.loc.col - 1;
+    fprintf(stderr, "%*s^\n", (int)line_offset, "");
+}
+
+static ptrdiff_t checker_define(TypeChecker* checker, CheckerVariable v) {
+    const ptrdiff_t id = arrlen(checker->vars);
+    symbol_table_define(&checker->symbols, v.name, id);
+    arrput(checker->vars, v);
+    return id;
+}
+
+static TypeId checker_resolve_type(TypeChecker* checker, const char* name, const char* message) {
+    TypeId type = type_from_name(checker->types, name);
+    if (type == TYPE_ERROR) checker_error(checker, checker->loc, message);
+    return type;
+}
+
+// Gives integer literals (and arithmetic only made out of them) the integer type their context expects
+static bool checker_settle_literal(TypeChecker* checker, Expr* expr, TypeId type) {
+    if (expr->value_type != TYPE_INT_LITERAL || type == TYPE_INT_LITERAL) return true;
+    expr->value_type = type;
+    switch (expr->type) {
+        case ET_NUMBER: {
+            if (!type_fits_literal(checker->types, type, expr->as.number)) {
+                checker_error(checker, checker->loc, "Integer literal doesn't fit into its type");
+                return false;
             }
+            return true;
+        }
+        case ET_BINARY: {
+            return checker_settle_literal(checker, expr->as.binary.left, type) &&
+                   checker_settle_literal(checker, expr->as.binary.right, type);
+        }
+        // Only literals and arithmetic on them have the literal type
+        case ET_BOOL: case ET_VARIABLE: case ET_CALL: break;
+    }
+    assert(false && "Unreachable");
+    return false;
+}
+
+// Checks that `expr` can be used where a `type` is expected
+static bool checker_expect(TypeChecker* checker, Expr* expr, TypeId type, const char* message) {
+    if (expr->value_type == TYPE_INT_LITERAL && type_is_integer(checker->types, type)) {
+        return checker_settle_literal(checker, expr, type);
+    }
+    if (expr->value_type != type) {
+        checker_error(checker, checker->loc, message);
+        return false;
+    }
+    return true;
+}
 
-            arrfree(checker->vars);
-            checker->vars = saved;
+static void type_check_fn(TypeChecker* checker, Statement* st) {
+    uint64_t fingerprint = 0;
+    char* cache_path = NULL;
+    if (checker->cache_dir != NULL) {
+        fingerprint = sema_cache_fingerprint(st, checker->ast);
+        cache_path = sema_cache_path(checker->cache_dir, fingerprint);
+        if (sema_cache_load(cache_path, fingerprint, st)) {
+            free(cache_path);
+            return;
+        }
+    }
+
+    CheckerVariable* saved = checker->vars;
+    SymbolTable saved_symbols = checker->symbols;
+    TypeId saved_ret_type = checker->ret_type;
+    const ptrdiff_t error_count = arrlen(checker->errors);
+    checker->vars = NULL;
+    checker->symbols = (SymbolTable) {0};
+    checker->loc = st->loc;
+    checker->ret_type = checker_resolve_type(checker, st->as.fn_def.ret_type, "Unknown function return type");
+    st->as.fn_def.ret_value_type = checker->ret_type;
+    for (ptrdiff_t i = 0; i < arrlen(st->as.fn_def.args); i++) {
+        FnArg* fn_arg = &st->as.fn_def.args[i];
+        fn_arg->value_type = checker_resolve_type(checker, fn_arg->type, "Unknown function argument type");
+        CheckerVariable arg = {
+            .name = fn_arg->name,
+            .type = fn_arg->value_type,
+        };
+        checker_define(checker, arg);
+    }
+    for (ptrdiff_t i = 0; i < arrlen(st->as.fn_def.body); i++) {
+        type_check_st(checker, &st->as.fn_def.body[i]);
+    }
+    if (arrlen(checker->errors) == error_count) const_eval(checker, st->as.fn_def.body, arrlen(checker->vars));
+
+    st->as.fn_def.symbol_count = arrlen(checker->vars);
+    if (cache_path != NULL && arrlen(checker->errors) == error_count) sema_cache_store(cache_path, fingerprint, st);
+    free(cache_path);
+    arrfree(checker->vars);
+    symbol_table_free(&checker->symbols);
+    checker->vars = saved;
+    checker->symbols = saved_symbols;
+    checker->ret_type = saved_ret_type;
+}
+
+static void type_check_st(TypeChecker* checker, Statement* st) {
+    checker->loc = st->loc;
+    switch (st->type) {
+        case ST_FN_DEFINITION: {
+            type_check_fn(checker, st);
             return;
         }
         case ST_VARIABLE_DEFINE: {
-            CheckerType expression_type = type_check_expr(checker, st.as.var_def.value);
-            if (expression_type == CT_ERROR) {
-                checker->err = true;
-                return;
-            }
-            switch (expression_type) {
-                case CT_INT: {
-                    if (strcmp("i32", st.as.var_def.type) != 0) {
-                        checker->err = true;
-                        return;
-                    }
-                    break;
-                }
-                case CT_BOOL: {
-                    if (strcmp("bool", st.as.var_def.type) != 0) {
-                        checker->err = true;
-                        return;
-                    }
-                    break;
-                }
-                case CT_ERROR: {
-                    assert(false && "Unreachable");
-                }
+            TypeId type = checker_resolve_type(checker, st->as.var_def.type, "Unknown variable type");
+            if (type == TYPE_ERROR) return;
+            if (st->as.var_def.value != NULL) {
+                if (type_check_expr(checker, st->as.var_def.value) == TYPE_ERROR) return;
+                if (!checker_expect(checker, st->as.var_def.value, type, "Variable value doesn't match the type of the variable")) return;
             }
             CheckerVariable v = {
-                .type = expression_type,
-                .name = st.as.var_def.name
+                .type = type,
+                .name = st->as.var_def.name,
+                .is_const = st->as.var_def.is_const,
             };
-            arrput(checker->vars, v);
+            st->as.var_def.symbol = checker_define(checker, v);
+            st->as.var_def.value_type = type;
 
             break;
         }
         case ST_WHILE: {
-            CheckerType expression_type = type_check_expr(checker, st.as.while_st.cond);
-            if (expression_type != CT_BOOL) {
-                checker->err = true;
-                return;
-            }
-            for (ptrdiff_t i = 0; i < arrlen(st.as.while_st.body); i++) {
-                type_check_st(checker, st.as.while_st.body[i]);
+            if (type_check_expr(checker, st->as.while_st.cond) == TYPE_ERROR) return;
+            if (!checker_expect(checker, st->as.while_st.cond, TYPE_BOOL, "`while` condition has to be a bool")) return;
+            symbol_table_push_scope(&checker->symbols);
+            for (ptrdiff_t i = 0; i < arrlen(st->as.while_st.body); i++) {
+                type_check_st(checker, &st->as.while_st.body[i]);
             }
+            symbol_table_pop_scope(&checker->symbols);
             return;
         }
         case ST_IF: {
-            CheckerType expression_type = type_check_expr(checker, st.as.if_st.cond);
-            if (expression_type != CT_BOOL) {
-                checker->err = true;
-                return;
-            }
-            for (ptrdiff_t i = 0; i < arrlen(st.as.if_st.body); i++) {
-                type_check_st(checker, st.as.if_st.body[i]);
+            if (type_check_expr(checker, st->as.if_st.cond) == TYPE_ERROR) return;
+            if (!checker_expect(checker, st->as.if_st.cond, TYPE_BOOL, "`if` condition has to be a bool")) return;
+            symbol_table_push_scope(&checker->symbols);
+            for (ptrdiff_t i = 0; i < arrlen(st->as.if_st.body); i++) {
+                type_check_st(checker, &st->as.if_st.body[i]);
             }
+            symbol_table_pop_scope(&checker->symbols);
             return;
         }
         case ST_SET_VARIABLE: {
-            CheckerVariable v = {0};
-            for (ptrdiff_t i = 0; i < arrlen(checker->vars); i++) {
-                if (strcmp(checker->vars[i].name, st.as.var_assign.var) == 0) v = checker->vars[i];
-            }
-            if (v.name == NULL) {
-                checker->err = true;
+            const ptrdiff_t id = symbol_table_lookup(&checker->symbols, st->as.var_assign.var);
+            if (id == -1) {
+                checker_error(checker, st->loc, "Assignment to an undefined variable");
                 return;
             }
-            CheckerType expression_type = type_check_expr(checker, st.as.var_assign.new_val);
-            if (v.type != expression_type) {
-                checker->err = true;
+            CheckerVariable v = checker->vars[id];
+            if (v.is_const) {
+                checker_error(checker, st->loc, "Assignment to a constant");
                 return;
             }
+            if (type_check_expr(checker, st->as.var_assign.new_val) == TYPE_ERROR) return;
+            if (!checker_expect(checker, st->as.var_assign.new_val, v.type, "Assigned value doesn't match the type of the variable")) return;
+            st->as.var_assign.symbol = id;
+            st->as.var_assign.value_type = v.type;
+            return;
+        }
+        case ST_RETURN: {
+            if (type_check_expr(checker, st->as.ret) == TYPE_ERROR) return;
+            if (checker->ret_type == TYPE_ERROR) return;
+            checker_expect(checker, st->as.ret, checker->ret_type, "Returned value doesn't match the return type of the function");
             return;
         }
-        case ST_ERROR: case ST_RETURN: {
+        case ST_ERROR: {
             return;
         }
     }
 }
 
-static CheckerType type_check_expr(TypeChecker* checker, Expr* expr) {
+static TypeId type_check_expr(TypeChecker* checker, Expr* expr) {
+    TypeId type = type_check_expr_inner(checker, expr);
+    expr->value_type = type;
+    return type;
+}
+
+static TypeId type_check_expr_inner(TypeChecker* checker, Expr* expr) {
     switch (expr->type) {
         case ET_NUMBER: {
-            return CT_INT;
+            return TYPE_INT_LITERAL;
         }
         case ET_BOOL: {
-            return CT_BOOL;
+            return TYPE_BOOL;
         }
         case ET_BINARY: {
-            CheckerType left = type_check_expr(checker, expr->as.binary.left); if (left == CT_ERROR) return CT_ERROR;
-            CheckerType right = type_check_expr(checker, expr->as.binary.right); if (right == CT_ERROR) return CT_ERROR;
-            if (left != right) {
-                return CT_ERROR;
+            TypeId left = type_check_expr(checker, expr->as.binary.left); if (left == TYPE_ERROR) return TYPE_ERROR;
+            TypeId right = type_check_expr(checker, expr->as.binary.right); if (right == TYPE_ERROR) return TYPE_ERROR;
+
+            // Literals take the type of the other side, two literals stay a literal
+            TypeId operand = left == TYPE_INT_LITERAL ? right : left;
+            if ((operand != TYPE_INT_LITERAL && !type_is_integer(checker->types, operand))) {
+                checker_error(checker, checker->loc, "Operands of arithmetic and comparisons have to be integers");
+                return TYPE_ERROR;
+            }
+            if (left != TYPE_INT_LITERAL && right != TYPE_INT_LITERAL && left != right) {
+                checker_error(checker, checker->loc, "Operands of a binary expression have to be of the same type");
+                return TYPE_ERROR;
             }
+            if (!checker_settle_literal(checker, expr->as.binary.left, operand)) return TYPE_ERROR;
+            if (!checker_settle_literal(checker, expr->as.binary.right, operand)) return TYPE_ERROR;
             switch (expr->as.binary.op) {
                 case '+': case '-': case '*': case '/': {
-                    return CT_INT;
+                    return operand;
                 }
                 case '>': case '<': {
-                    return CT_BOOL;
+                    // Comparing two literals
+                    if (operand == TYPE_INT_LITERAL) {
+                        if (!checker_settle_literal(checker, expr->as.binary.left, TYPE_I32)) return TYPE_ERROR;
+                        if (!checker_settle_literal(checker, expr->as.binary.right, TYPE_I32)) return TYPE_ERROR;
+                    }
+                    return TYPE_BOOL;
                 }
             }
-            return CT_ERROR;
+            checker_error(checker, checker->loc, "Unknown binary operator");
+            return TYPE_ERROR;
         }
         case ET_VARIABLE: {
-            for (ptrdiff_t i = 0; i < arrlen(checker->vars); i++) {
-                if (strcmp(checker->vars[i].name, expr->as.variable) == 0) return checker->vars[i].type;
+            const ptrdiff_t id = symbol_table_lookup(&checker->symbols, expr->as.variable.name);
+            if (id == -1) {
+                checker_error(checker, checker->loc, "Use of an undefined variable");
+                return TYPE_ERROR;
+            }
+            expr->as.variable.symbol = id;
+            return checker->vars[id].type;
+        }
+        case ET_CALL: {
+            const CheckerFunction* fn = NULL;
+            for (ptrdiff_t i = 0; i < arrlen(checker->functions); i++) {
+                if (strcmp(checker->functions[i].name, expr->as.call.name) == 0) {
+                    fn = &checker->functions[i];
+                    break;
+                }
+            }
+            if (fn == NULL) {
+                checker_error(checker, checker->loc, "Call to an undefined function");
+                return TYPE_ERROR;
+            }
+            if (arrlen(expr->as.call.args) != arrlen(fn->args)) {
+                checker_error(checker, checker->loc, "Wrong number of arguments in function call");
+                return TYPE_ERROR;
+            }
+            bool ok = true;
+            for (ptrdiff_t i = 0; i < arrlen(expr->as.call.args); i++) {
+                Expr* arg = expr->as.call.args[i];
+                if (type_check_expr(checker, arg) == TYPE_ERROR) {
+                    ok = false;
+                    continue;
+                }
+                // Unknown argument types get reported by the callee
+                if (fn->args[i] == TYPE_ERROR) continue;
+                ok &= checker_expect(checker, arg, fn->args[i], "Argument doesn't match the type of the function's parameter");
             }
-            return CT_ERROR;
+            if (!ok) return TYPE_ERROR;
+            return fn->ret;
         }
     }
-    return CT_ERROR;
+    return TYPE_ERROR;
 }
@@ -3,23 +3,52 @@
 
 #include "arena.h"
 #include "parser.h"
-
-typedef enum {
-    CT_INT,
-    CT_BOOL,
-    CT_ERROR,
-} CheckerType;
+#include "symbol_table.h"
+#include "types.h"
 
 typedef struct {
     char* name;
-    CheckerType type;
+    TypeId type;
+    bool is_const;
 } CheckerVariable;
 
 typedef struct {
-    const Statement* ast;
+    char* name;
+    TypeId* args;
+    TypeId ret;
+} CheckerFunction;
+
+typedef struct {
+    const char* message;
+    Location loc;
+} CheckerError;
+
+typedef struct {
+    // Gets annotated with the resolved symbols and types
+    Statement* ast;
+    const TypeTable* types;
+    // Every variable defined so far in the current function, indexed by symbol id
     CheckerVariable* vars;
+    // Maps names in scope to their id in `vars`
+    SymbolTable symbols;
+    // Signatures of every top level function, collected before any body gets checked
+    CheckerFunction* functions;
+    // Sorted by location once type_check returns
+    CheckerError* errors;
+    // Location of the statement being checked, expressions report their errors there
+    Location loc;
+    // Return type of the function being checked
+    TypeId ret_type;
+    // Function bodies are checked on up to this many threads
+    size_t thread_count;
+    // Results of checking functions get cached in here when it's set
+    const char* cache_dir;
     bool err;
 } TypeChecker;
 
+// Returns true if any error was found
 bool type_check(TypeChecker* checker);
+void checker_error(TypeChecker* checker, Location loc, const char* message);
+void checker_error_display(CheckerError error, char* file_content, char* input_name);
+void type_checker_free(TypeChecker* checker);
 #endif
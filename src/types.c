@@ -0,0 +1,132 @@
+#include "types.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../extern/stb_ds.h"
+
+static void type_table_builtin(TypeTable* table, TypeId id, TypeKind kind, char* name, size_t size, bool is_signed) {
+    assert(arrlen(table->types) == id);
+    (void)id;
+    Type type = {
+        .kind = kind,
+        .name = name,
+        .size = size,
+        .align = size == 0 ? 1 : size,
+        .is_signed = is_signed,
+    };
+    arrput(table->types, type);
+}
+
+TypeTable type_table_new(void) {
+    TypeTable table = {0};
+    type_table_builtin(&table, TYPE_ERROR, TYK_ERROR, "<error>", 0, false);
+    type_table_builtin(&table, TYPE_BOOL, TYK_BOOL, "bool", 1, false);
+    type_table_builtin(&table, TYPE_I8, TYK_INT, "i8", 1, true);
+    type_table_builtin(&table, TYPE_I16, TYK_INT, "i16", 2, true);
+    type_table_builtin(&table, TYPE_I32, TYK_INT, "i32", 4, true);
+    type_table_builtin(&table, TYPE_I64, TYK_INT, "i64", 8, true);
+    type_table_builtin(&table, TYPE_U8, TYK_INT, "u8", 1, false);
+    type_table_builtin(&table, TYPE_U16, TYK_INT, "u16", 2, false);
+    type_table_builtin(&table, TYPE_U32, TYK_INT, "u32", 4, false);
+    type_table_builtin(&table, TYPE_U64, TYK_INT, "u64", 8, false);
+    type_table_builtin(&table, TYPE_INT_LITERAL, TYK_INT_LITERAL, "{integer}", 8, false);
+    return table;
+}
+
+void type_table_free(TypeTable* table) {
+    for (ptrdiff_t i = TYPE_BUILTIN_COUNT; i < arrlen(table->types); i++) free(table->types[i].name);
+    arrfree(table->types);
+    hmfree(table->compound);
+}
+
+const Type* type_get(const TypeTable* table, TypeId id) {
+    assert(id < (TypeId)arrlen(table->types));
+    return &table->types[id];
+}
+
+TypeId type_from_name(const TypeTable* table, const char* name) {
+    for (TypeId id = TYPE_ERROR + 1; id < TYPE_INT_LITERAL; id++) {
+        if (strcmp(table->types[id].name, name) == 0) return id;
+    }
+    return TYPE_ERROR;
+}
+
+static TypeId type_table_intern(TypeTable* table, Type type) {
+    TypeKey key = {
+        .kind = type.kind,
+        .inner = type.inner,
+        .length = type.length,
+    };
+    ptrdiff_t i = hmgeti(table->compound, key);
+    if (i != -1) return table->compound[i].value;
+
+    const TypeId id = arrlen(table->types);
+    arrput(table->types, type);
+    hmput(table->compound, key, id);
+    return id;
+}
+
+TypeId type_pointer_to(TypeTable* table, TypeId pointee) {
+    const char* pointee_name = type_get(table, pointee)->name;
+    char* name = malloc(strlen(pointee_name) + 2);
+    assert(name);
+    sprintf(name, "*%s", pointee_name);
+    Type type = {
+        .kind = TYK_POINTER,
+        .name = name,
+        .size = 8,
+        .align = 8,
+        .inner = pointee,
+    };
+    const TypeId id = type_table_intern(table, type);
+    if (table->types[id].name != name) free(name);
+    return id;
+}
+
+TypeId type_array_of(TypeTable* table, TypeId element, size_t length) {
+    const Type* inner = type_get(table, element);
+    size_t len = strlen(inner->name) + 32;
+    char* name = malloc(len);
+    assert(name);
+    snprintf(name, len, "[%zu]%s", length, inner->name);
+    Type type = {
+        .kind = TYK_ARRAY,
+        .name = name,
+        .size = inner->size * length,
+        .align = inner->align,
+        .inner = element,
+        .length = length,
+    };
+    const TypeId id = type_table_intern(table, type);
+    if (table->types[id].name != name) free(name);
+    return id;
+}
+
+bool type_is_integer(const TypeTable* table, TypeId id) {
+    return type_get(table, id)->kind == TYK_INT;
+}
+
+bool type_is_signed(const TypeTable* table, TypeId id) {
+    return type_get(table, id)->is_signed;
+}
+
+size_t type_size(const TypeTable* table, TypeId id) {
+    return type_get(table, id)->size;
+}
+
+bool type_fits_literal(const TypeTable* table, TypeId id, uint64_t value) {
+    const Type* type = type_get(table, id);
+    if (type->kind != TYK_INT) return false;
+    const unsigned bits = type->size * 8 - (type->is_signed ? 1 : 0);
+    return bits >= 64 || value <= (UINT64_MAX >> (64 - bits));
+}
+
+uint64_t type_wrap(const TypeTable* table, TypeId id, uint64_t value) {
+    const unsigned bits = type_size(table, id) * 8;
+    if (bits >= 64) return value;
+    const uint64_t mask = (UINT64_C(1) << bits) - 1;
+    value &= mask;
+    if (type_is_signed(table, id) && (value >> (bits - 1)) != 0) value |= ~mask;
+    return value;
+}
@@ -0,0 +1,78 @@
+#ifndef TYPES_H
+#define TYPES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Every type is interned into a TypeTable, so type equality is just comparing ids
+typedef uint32_t TypeId;
+
+// Builtin types always have these ids
+enum {
+    TYPE_ERROR,
+    TYPE_BOOL,
+    TYPE_I8,
+    TYPE_I16,
+    TYPE_I32,
+    TYPE_I64,
+    TYPE_U8,
+    TYPE_U16,
+    TYPE_U32,
+    TYPE_U64,
+    // Integer literals until they get settled to the type their context expects
+    TYPE_INT_LITERAL,
+    TYPE_BUILTIN_COUNT,
+};
+
+typedef enum {
+    TYK_ERROR,
+    TYK_BOOL,
+    TYK_INT,
+    TYK_INT_LITERAL,
+    TYK_POINTER,
+    TYK_ARRAY,
+} TypeKind;
+
+typedef struct {
+    TypeKind kind;
+    char* name;
+    size_t size;
+    size_t align;
+    bool is_signed;
+    // Pointee/element type
+    TypeId inner;
+    size_t length;
+} Type;
+
+typedef struct {
+    TypeKind kind;
+    TypeId inner;
+    size_t length;
+} TypeKey;
+
+// Lookups are fine from any thread, interning new compound types is not
+typedef struct {
+    Type* types;
+    struct { TypeKey key; TypeId value; }* compound;
+} TypeTable;
+
+TypeTable type_table_new(void);
+void type_table_free(TypeTable* table);
+
+const Type* type_get(const TypeTable* table, TypeId id);
+// Returns TYPE_ERROR for unknown names
+TypeId type_from_name(const TypeTable* table, const char* name);
+TypeId type_pointer_to(TypeTable* table, TypeId pointee);
+TypeId type_array_of(TypeTable* table, TypeId element, size_t length);
+
+bool type_is_integer(const TypeTable* table, TypeId id);
+bool type_is_signed(const TypeTable* table, TypeId id);
+size_t type_size(const TypeTable* table, TypeId id);
+// Whether an integer literal with `value` is representable in the integer type `id`
+bool type_fits_literal(const TypeTable* table, TypeId id, uint64_t value);
+// Truncates `value` to the width of `id` and sign or zero extends it back, the way
+// constants of that type are kept
+uint64_t type_wrap(const TypeTable* table, TypeId id, uint64_t value);
+
+#endif